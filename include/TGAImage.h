@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum {
     TGA_NO_ERR                  = 0,
@@ -31,6 +32,56 @@ typedef enum {
     TGA_UNKNOWN_TYPE            = 255
 } TGAColorType;
 
+/* Encoding of the pixel data written by write_tga_image. */
+typedef enum {
+    TGA_COMPRESS_NONE           = 0,
+    TGA_COMPRESS_RLE            = 1,
+    TGA_COMPRESS_AUTO           = 2     /* RLE if estimated to be smaller. */
+} TGACompression;
+
+/* Stages of reading or writing an image, as reported by TGAStats. */
+typedef enum {
+    TGA_STAGE_FOOTER            = 0,
+    TGA_STAGE_HEADER            = 1,
+    TGA_STAGE_ID                = 2,
+    TGA_STAGE_COLOR_MAP         = 3,
+    TGA_STAGE_PIXELS            = 4,
+    TGA_STAGE_COUNT             = 5
+} TGAStage;
+
+/*
+ * Counters filled in by read_tga_image and write_tga_image while a stats sink
+ * is installed with tga_set_stats. Counters accumulate until the caller resets
+ * them, so a single sink can cover several calls.
+ */
+typedef struct NyTGA_Stats {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t seek_calls;
+    uint64_t rle_run_packets;
+    uint64_t rle_run_pixels;
+    uint64_t rle_raw_packets;
+    uint64_t rle_raw_pixels;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t stage_ns[TGA_STAGE_COUNT];
+    /*
+     * TGA_COMPRESS_AUTO writes left raw and RLE encoded. For the latter, the
+     * estimated and actual sizes of the RLE pixel data and the sum of the
+     * absolute differences between the two.
+     */
+    uint64_t auto_raw_writes;
+    uint64_t auto_rle_writes;
+    uint64_t auto_rle_estimated;
+    uint64_t auto_rle_bytes;
+    uint64_t auto_rle_error;
+} TGAStats;
+
+/* Called when a stage starts and when it ends, for external tracing. */
+typedef void (*TGAStageHook)(TGAStage stage, void *user);
+
 struct _NY_TgaMeta;
 
 typedef struct NyTGA_Image {
@@ -42,15 +93,418 @@ typedef struct NyTGA_Image {
     char __padding[7];
 } TGAImage; /* SIZEOF == 24 */
 
+/*
+ * Options for the asynchronous loader. Zero-initialised options select the
+ * defaults: eight reads in flight and one decode thread per CPU.
+ */
+#define TGA_LOADER_NO_IO_URING      1   /* Always use the thread pool. */
+
+typedef struct NyTGA_LoaderOptions {
+    unsigned queue_depth;   /* Reads kept in flight. */
+    unsigned threads;       /* Decode threads. */
+    unsigned flags;         /* TGA_LOADER_* flags. */
+} TGALoaderOptions;
+
+/* A completed load. image is NULL and error is set if the load failed. */
+typedef struct NyTGA_LoadResult {
+    TGAImage *image;
+    void *user;
+    TGAError error;
+    char error_str[256];
+} TGALoadResult;
+
+typedef struct NyTGA_Loader TGALoader;
+
+/* Result of feeding bytes to an incremental decoder. */
+typedef enum {
+    TGA_DECODE_ERROR            = -1,
+    TGA_DECODE_NEED_MORE        = 0,
+    TGA_DECODE_ROW_READY        = 1,
+    TGA_DECODE_DONE             = 2
+} TGADecodeStatus;
+
+typedef struct NyTGA_Decoder TGADecoder;
+
+typedef struct NyTGA_Pipeline TGAPipeline;
+
+/* Counters of the decoded-image cache, see tga_cache_get. */
+typedef struct NyTGA_CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t budget;
+} TGACacheStats;
+
+/*
+ * Pixel layouts tga_pixel_hash can hash. NATIVE hashes pixels at their stored
+ * depth; BGRA32 first expands every pixel to 8-bit BGRA, so the same picture
+ * stored at different depths hashes the same.
+ */
+typedef enum {
+    TGA_HASH_NATIVE             = 0,
+    TGA_HASH_BGRA32             = 1
+} TGAHashFormat;
+
+/*
+ * Result of tga_compare. Channels are indexed in storage order: blue, green,
+ * red and alpha, or just index 0 for monochrome images. Errors are in the
+ * channel's own units, so 16-bit images peak at 31 (and 1 for alpha). The
+ * bounding box uses a top-left origin and is only set if pixels differ.
+ */
+typedef struct NyTGA_CompareResult {
+    uint64_t differing_pixels;
+    double mse[4];
+    double psnr[4];             /* INFINITY where a channel is identical. */
+    uint16_t min_x;
+    uint16_t min_y;
+    uint16_t max_x;
+    uint16_t max_y;
+    uint8_t identical;
+    uint8_t channels;
+    uint8_t max_error;
+} TGACompareResult;
+
+/* Element type of the planes used by tga_to_planar and tga_from_planar. */
+typedef enum {
+    TGA_PLANAR_U8               = 0,
+    TGA_PLANAR_F32              = 1
+} TGAPlanarType;
+
+/*
+ * Per-channel normalisation of float planes, in R, G, B, A order. A channel
+ * value v in [0, 1] is stored as (v - mean) / std.
+ */
+typedef struct NyTGA_Normalization {
+    float mean[4];
+    float std[4];
+} TGANormalization;
+
+/* Compositing operators of tga_blend, applied with the source's alpha. */
+typedef enum {
+    TGA_BLEND_OVER              = 0,    /* Source over destination. */
+    TGA_BLEND_ADD               = 1,    /* Saturating addition. */
+    TGA_BLEND_MULTIPLY          = 2
+} TGABlendMode;
+
+/* Resampling filters of tga_resize, from fastest to sharpest. */
+typedef enum {
+    TGA_FILTER_BILINEAR         = 0,
+    TGA_FILTER_BICUBIC          = 1,
+    TGA_FILTER_LANCZOS          = 2     /* Lanczos with three lobes. */
+} TGAFilter;
+
+/*
+ * Tone curves tga_build_lut can produce. GAMMA linearizes with the gamma from
+ * the file's extension area (value^gamma); COLOR_CORRECTION uses its colour
+ * correction table.
+ */
+typedef enum {
+    TGA_TRANSFER_SRGB_TO_LINEAR     = 0,
+    TGA_TRANSFER_LINEAR_TO_SRGB     = 1,
+    TGA_TRANSFER_GAMMA              = 2,
+    TGA_TRANSFER_COLOR_CORRECTION   = 3
+} TGATransfer;
+
+/*
+ * Options for tga_pack_atlas. Zero-initialised options select the defaults: a
+ * 32-bit atlas of at most 4096 x 4096 pixels with no padding or extrusion.
+ */
+#define TGA_ATLAS_POWER_OF_TWO      1   /* Round the atlas size up. */
+
+typedef struct NyTGA_AtlasOptions {
+    uint16_t max_width;
+    uint16_t max_height;
+    uint16_t padding;       /* Empty pixels between images. */
+    uint16_t extrude;       /* Copies of each image's edge pixels around it. */
+    uint8_t depth;          /* 16, 24 or 32. */
+    unsigned flags;         /* TGA_ATLAS_* flags. */
+} TGAAtlasOptions;
+
+/*
+ * Where tga_pack_atlas placed an image, in atlas pixels from the top-left
+ * corner and as texture coordinates of the image's edges, v growing down.
+ */
+typedef struct NyTGA_AtlasRect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    float u0;
+    float v0;
+    float u1;
+    float v1;
+} TGAAtlasRect;
+
+/* What tga_compute_stats computes. */
+#define TGA_IMAGE_STATS_HISTOGRAMS  1   /* Histograms, min, max, mean, alpha. */
+#define TGA_IMAGE_STATS_UNIQUE      2   /* Distinct colour count. */
+#define TGA_IMAGE_STATS_ALL         3
+
+/*
+ * Result of tga_compute_stats. Channels are indexed in storage order as in
+ * TGACompareResult, and values are in the channel's own units: 16-bit images
+ * use 32 bins per colour channel and 2 for alpha. alpha_coverage is the
+ * fraction of pixels that are not fully transparent, 1 for images without
+ * alpha. unique_colors counts distinct pixel values; it is exact for 8 and
+ * 16-bit images and an estimate within a few percent otherwise. Fields not
+ * selected by the flags are zero.
+ */
+typedef struct NyTGA_ImageStats {
+    uint64_t histogram[4][256];
+    uint64_t pixels;
+    uint64_t unique_colors;
+    double mean[4];
+    double alpha_coverage;
+    uint8_t min[4];
+    uint8_t max[4];
+    uint8_t channels;
+    uint8_t unique_exact;
+} TGAImageStats;
+
+/* Block formats for tga_encode_bc1 and tga_encode_bc3. */
+typedef enum {
+    TGA_BC1 = 0,    /* DXT1: 8 bytes per 4x4 block, 1-bit alpha. */
+    TGA_BC3 = 1     /* DXT5: 16 bytes per 4x4 block, interpolated alpha. */
+} TGABCFormat;
+
+typedef enum {
+    TGA_BC_RANGE_FIT = 0,   /* Endpoints at the extremes of each block. */
+    TGA_BC_CLUSTER_FIT = 1  /* Least-squares endpoints; slower, lower error. */
+} TGABCQuality;
+
+/* Dithering for tga_convert_to_16. */
+typedef enum {
+    TGA_DITHER_NONE = 0,            /* Round each channel to nearest. */
+    TGA_DITHER_ORDERED = 1,         /* 8x8 Bayer pattern. */
+    TGA_DITHER_FLOYD_STEINBERG = 2  /* Error diffusion. */
+} TGADither;
+
+/*
+ * Entry of the developer area directory. Tags 0 to 32767 are free for
+ * applications; higher numbers are reserved by the TGA specification.
+ */
+typedef struct NyTGA_DeveloperTag {
+    uint16_t tag;
+    uint32_t offset;    /* File offset of the tag's data. */
+    uint32_t size;
+} TGADeveloperTag;
+
 TGAError tga_error(void); /* Returns the current error, if any. */
 char *tga_error_str(void); /* Returns a string with error details. */
 void tga_clear_error(void);
 TGAImage *read_tga_image(FILE *file);
+TGAImage *read_tga_image_from_memory(const uint8_t *buffer, size_t length);
+
+/*
+ * Lazy reading. open_tga_image reads the header, ID field, color map and
+ * extension area only; the pixels are decoded on first use by a pixel
+ * accessor or library function, or by tga_materialize. Call tga_materialize
+ * before touching image->data directly or sharing the image between threads.
+ * The file stays open until the image is freed, and a buffer given to
+ * open_tga_image_from_memory must outlive the image. tga_release_pixels
+ * frees the pixels of such an image, dropping any changes; they are read
+ * again on next use.
+ */
+TGAImage *open_tga_image(const char *filename);
+TGAImage *open_tga_image_from_memory(const uint8_t *buffer, size_t length);
+int tga_materialize(TGAImage *image);
+int tga_release_pixels(TGAImage *image);
 int write_tga_image(TGAImage *image, const char *filename);
+int write_tga_image_fd(TGAImage *image, int fd); /* At the current offset. */
+int write_tga_image_to_memory(TGAImage *image, uint8_t **buffer,
+                              size_t *length); /* Release with free(). */
 TGAImage *new_tga_image(TGAColorType type, uint8_t depth,
                         uint16_t width, uint16_t height);
 void free_tga_image(TGAImage* image);
 
+/*
+ * Clones and views share pixels with their source until either is modified
+ * through the library, which then copies them. Views are rectangles given in
+ * top-left coordinates. Code writing to image->data directly must not do so
+ * on shared images.
+ */
+TGAImage *tga_clone(TGAImage *image);
+TGAImage *tga_subimage(TGAImage *image, uint16_t x, uint16_t y, uint16_t width,
+                       uint16_t height);
+
+/*
+ * Asynchronous loading. Paths are loaded in the background, using io_uring on
+ * Linux when the kernel supports it and a thread pool otherwise, and results
+ * are handed back in submission order.
+ */
+TGALoader *tga_loader_new(const TGALoaderOptions *options);
+int tga_loader_submit(TGALoader *loader, const char *path, void *user);
+int tga_loader_poll(TGALoader *loader, TGALoadResult *result);
+int tga_loader_wait(TGALoader *loader, TGALoadResult *result);
+int tga_loader_uses_io_uring(TGALoader *loader);
+void tga_loader_free(TGALoader *loader);
+
+/*
+ * Incremental decoding for data arriving in chunks (pipes, sockets, uploads).
+ * No seeking is needed; rows can be used as soon as they are reported ready.
+ */
+TGADecoder *tga_decoder_new(void);
+TGADecodeStatus tga_decoder_feed(TGADecoder *dec, const uint8_t *bytes,
+                                 size_t n);
+TGAImage *tga_decoder_image(TGADecoder *dec);
+uint16_t tga_decoder_rows_ready(TGADecoder *dec);
+TGAImage *tga_decoder_finish(TGADecoder *dec);
+void tga_decoder_free(TGADecoder *dec);
+
+/*
+ * Conversions. tga_convert_depth returns a new image at 16, 24 or 32 bits;
+ * tga_set_origin reorders pixels so the image looks the same when stored with
+ * the given origin.
+ */
+TGAImage *tga_convert_depth(TGAImage *image, uint8_t depth);
+uint8_t tga_set_origin(TGAImage *image, uint8_t right, uint8_t top);
+
+/*
+ * 16-bit output for memory-constrained targets. Channels are scaled from 8 to
+ * 5 bits (the 16-bit pixel setters take 5-bit values) and optionally
+ * dithered; error diffusion is split over tga_get_thread_count threads as a
+ * wavefront of rows and gives the same result on any number of threads.
+ */
+TGAImage *tga_convert_to_16(TGAImage *image, TGADither dither);
+
+/*
+ * Fused file-to-file conversion. Stages run in the order they are added over
+ * blocks of rows as they are decoded, so the pixels are read and written
+ * once and the decoded image is never held. RLE output that flips the image
+ * vertically keeps the encoded rows in memory until the end. Blocks are
+ * processed and RLE encoded on tga_get_thread_count threads.
+ */
+TGAPipeline *tga_pipeline_new(void);
+int tga_pipeline_set_origin(TGAPipeline *pipeline, uint8_t right, uint8_t top);
+int tga_pipeline_set_compression(TGAPipeline *pipeline,
+                                 TGACompression compression);
+int tga_pipeline_convert_depth(TGAPipeline *pipeline, uint8_t depth);
+int tga_pipeline_premultiply(TGAPipeline *pipeline);
+int tga_pipeline_apply_lut(TGAPipeline *pipeline, const uint8_t lut[4][256]);
+int tga_pipeline_run(const TGAPipeline *pipeline, const char *input,
+                     const char *output);
+void tga_pipeline_free(TGAPipeline *pipeline);
+
+/*
+ * Planar access for image processing. Planes are R, G, B and A arrays of
+ * width * height uint8_t or float elements in top-left row order; NULL planes
+ * are skipped. Large images use tga_get_thread_count threads.
+ */
+int tga_to_planar(TGAImage *image, void *const planes[4], TGAPlanarType type,
+                  const TGANormalization *norm);
+int tga_from_planar(TGAImage *image, void *const planes[4], TGAPlanarType type,
+                    const TGANormalization *norm);
+
+/*
+ * Composites src onto dst at (dx, dy), both in top-left coordinates, clipped
+ * to dst. Works on 16, 24 and 32-bit truecolor images of any origin.
+ */
+int tga_blend(TGAImage *dst, TGAImage *src, int dx, int dy, TGABlendMode mode);
+
+/*
+ * Returns a copy resampled to width x height, premultiplying alpha while
+ * filtering. Large images use tga_get_thread_count threads.
+ */
+TGAImage *tga_resize(TGAImage *src, uint16_t width, uint16_t height,
+                     TGAFilter filter);
+
+/*
+ * Rotated (clockwise) and transposed copies, and in-place flips. Results keep
+ * the source's origin bits and look as described when displayed.
+ */
+TGAImage *tga_rotate90(TGAImage *image);
+TGAImage *tga_rotate180(TGAImage *image);
+TGAImage *tga_rotate270(TGAImage *image);
+TGAImage *tga_transpose(TGAImage *image);
+uint8_t tga_flip_h(TGAImage *image);
+uint8_t tga_flip_v(TGAImage *image);
+
+/*
+ * Texture atlases. Packs 8-bit monochrome and 16, 24 or 32-bit truecolor
+ * images into one top-down truecolor image, filling rects (count entries) with
+ * their placements. Images are copied on tga_get_thread_count threads; the
+ * files variant also loads them in parallel with a TGALoader.
+ */
+TGAImage *tga_pack_atlas(TGAImage *const *images, size_t count,
+                         const TGAAtlasOptions *options, TGAAtlasRect *rects);
+TGAImage *tga_pack_atlas_files(const char *const *paths, size_t count,
+                               const TGAAtlasOptions *options,
+                               TGAAtlasRect *rects);
+
+/*
+ * Writing options. RLE writes use tga_get_thread_count threads for large
+ * images and record where each scanline starts in the written file. With
+ * TGA_COMPRESS_AUTO each write estimates the RLE size from a sample of rows
+ * and picks whichever encoding comes out smaller.
+ */
+uint8_t tga_set_compression(TGAImage *image, TGACompression compression);
+TGACompression tga_get_compression(TGAImage *image);
+const uint32_t *tga_get_scanline_offsets(TGAImage *image);
+void tga_set_thread_count(unsigned threads); /* 0 uses every CPU. */
+unsigned tga_get_thread_count(void);
+
+/* Comparison, split across tga_get_thread_count threads for large images. */
+int tga_compare(TGAImage *a, TGAImage *b, TGACompareResult *result);
+
+/*
+ * Per-channel lookup tables, indexed in storage order (blue, green, red,
+ * alpha; monochrome images use the first). tga_apply_lut works on 16-bit
+ * pixels without widening them and uses tga_get_thread_count threads for
+ * large images. read_tga_image_transfer applies the curve to each block of
+ * rows as it is decoded.
+ */
+int tga_build_lut(TGAImage *image, TGATransfer transfer, uint8_t lut[4][256]);
+int tga_apply_lut(TGAImage *image, const uint8_t lut[4][256]);
+TGAImage *read_tga_image_transfer(FILE *file, TGATransfer transfer);
+
+/* Image statistics in one pass, threaded like tga_compare. */
+int tga_compute_stats(TGAImage *image, unsigned flags, TGAImageStats *stats);
+
+/*
+ * BC1/BC3 block compression of 16, 24 and 32-bit truecolor images. out must
+ * hold tga_bc_size bytes; blocks run row by row from the top-left of the
+ * displayed image and rows of blocks are encoded on tga_get_thread_count
+ * threads. tga_decode_bc is a reference decoder producing a top-down 32-bit
+ * image, for checking the encoder without a GPU.
+ */
+size_t tga_bc_size(uint16_t width, uint16_t height, TGABCFormat format);
+int tga_encode_bc1(TGAImage *image, TGABCQuality quality, uint8_t *out);
+int tga_encode_bc3(TGAImage *image, TGABCQuality quality, uint8_t *out);
+TGAImage *tga_decode_bc(const uint8_t *blocks, uint16_t width,
+                        uint16_t height, TGABCFormat format);
+
+/*
+ * Content hashing for deduplication, independent of RLE compression, origin
+ * bits and ID field. read_tga_image_hashed computes the same hash while
+ * decoding. Images with different header hashes never share a pixel hash.
+ */
+uint64_t tga_pixel_hash(TGAImage *image, TGAHashFormat format);
+uint64_t tga_header_hash(TGAImage *image, TGAHashFormat format);
+TGAImage *read_tga_image_hashed(FILE *file, TGAHashFormat format,
+                                uint64_t *hash);
+
+/*
+ * Thread-safe cache of decoded images keyed by path. Files are decoded again
+ * only when their inode, size or modification time change. Returned images
+ * are shared and read-only; release them with tga_cache_release (or
+ * free_tga_image, which does the same for cached images).
+ */
+TGAImage *tga_cache_get(const char *path);
+int tga_cache_release(TGAImage *image);
+void tga_cache_set_budget(size_t bytes); /* Default 256 MiB. */
+void tga_cache_clear(void);
+void tga_cache_get_stats(TGACacheStats *stats);
+
+/* Instrumentation */
+void tga_set_stats(TGAStats *stats); /* Per-thread sink, NULL disables. */
+TGAStats *tga_get_stats(void);
+void tga_reset_stats(TGAStats *stats);
+double tga_stats_average_run_length(const TGAStats *stats);
+const char *tga_stage_name(TGAStage stage);
+void tga_set_stage_hooks(TGAStageHook begin, TGAStageHook end, void *user);
+
 /* Getters */
 uint8_t tga_get_id_field_length(TGAImage *image);
 uint8_t tga_get_color_map_type(TGAImage *image);
@@ -70,6 +524,25 @@ uint8_t tga_is_monochrome(TGAImage *image);
 
 uint32_t tga_get_extension_offset(TGAImage *image);
 uint32_t tga_get_developer_offset(TGAImage *image);
+double tga_get_gamma(TGAImage *image); /* 0 when not given. */
+const uint16_t *tga_get_color_correction(TGAImage *image);
+
+/*
+ * Developer area. Only the tag directory is read with the image; tag data is
+ * fetched on request from the source of an image from open_tga_image (with
+ * positioned reads, safe from several threads) or, without copying, from the
+ * buffer of open_tga_image_from_memory. tga_append_developer_tag adds a tag
+ * to a file in place, leaving its pixels untouched.
+ */
+uint16_t tga_get_developer_tag_count(TGAImage *image);
+const TGADeveloperTag *tga_get_developer_tags(TGAImage *image);
+const TGADeveloperTag *tga_find_developer_tag(TGAImage *image, uint16_t tag);
+int tga_read_developer_tag(TGAImage *image, const TGADeveloperTag *tag,
+                           void *buffer); /* buffer holds tag->size bytes. */
+const uint8_t *tga_map_developer_tag(TGAImage *image,
+                                     const TGADeveloperTag *tag);
+int tga_append_developer_tag(const char *filename, uint16_t tag,
+                             const void *data, uint32_t size);
 
 uint8_t tga_get_red_at(TGAImage *image, uint16_t x, uint16_t y);
 uint8_t tga_get_green_at(TGAImage *image, uint16_t x, uint16_t y);
@@ -0,0 +1,43 @@
+#ifndef _TGA_HASH_H
+#define _TGA_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <TGAImage.h>
+
+/* Streaming 64-bit hash, the XXH64 algorithm. */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    uint64_t seed;
+    uint8_t buffer[32];
+    size_t buffered;
+} TGAHashState;
+
+void _tga_hash_init(TGAHashState *state, uint64_t seed);
+void _tga_hash_update(TGAHashState *state, const void *data, size_t length);
+uint64_t _tga_hash_final(const TGAHashState *state);
+uint64_t _tga_hash64(const void *data, size_t length, uint64_t seed);
+
+/*
+ * Pixel hashes are built from one hash per row, combined in top-left row order
+ * at the end. Rows can therefore be hashed in whatever order they become
+ * available: by several threads, or by the decoder as each row is read while
+ * it is still in cache.
+ */
+typedef struct {
+    TGAImage *image;
+    TGAHashFormat format;
+    uint64_t *rows;         /* Row hashes in top-left order. */
+    uint8_t *scratch;       /* Row converted to the canonical layout. */
+} TGAPixelHasher;
+
+int _tga_pixel_hasher_init(TGAPixelHasher *hasher, TGAImage *image,
+                           TGAHashFormat format);
+/* Hashes stored row `row`, which must be complete in image->data. */
+void _tga_pixel_hasher_row(TGAPixelHasher *hasher, size_t row);
+uint64_t _tga_pixel_hasher_final(TGAPixelHasher *hasher);
+void _tga_pixel_hasher_free(TGAPixelHasher *hasher);
+
+#endif/*_TGA_HASH_H*/
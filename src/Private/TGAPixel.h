@@ -0,0 +1,126 @@
+#ifndef _TGA_PIXEL_H
+#define _TGA_PIXEL_H
+
+/*
+ * Pixel format helpers shared by the image operations. 16-bit pixels are
+ * stored little-endian as ARRRRRGGGGGBBBBB; 24 and 32-bit pixels as B, G, R
+ * and (for 32-bit) A bytes. Operations that work on several depths unpack
+ * rows to 8-bit BGRA, work there and pack the result back.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+static inline uint8_t _tga_expand5(uint32_t value)
+{
+    return (uint8_t)((value << 3) | (value >> 2));
+}
+
+/* Nearest 5-bit value to an 8-bit one. */
+static inline uint32_t _tga_reduce8(uint8_t value)
+{
+    return ((uint32_t)value * 31 + 127) / 255;
+}
+
+/* x / 255 rounded to nearest, exact for every x up to 255 * 255. */
+static inline uint32_t _tga_div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/* Unpacks count 16, 24 or 32-bit pixels to BGRA; alpha is opaque if absent. */
+static inline void _tga_unpack_bgra(uint8_t *restrict out,
+                                    const uint8_t *restrict in, size_t count,
+                                    size_t bytes)
+{
+    switch(bytes)
+    {
+        case 2:
+            for(size_t x = 0; x < count; x++)
+            {
+                uint32_t v = (uint32_t)in[x * 2] | (uint32_t)in[x * 2 + 1] << 8;
+                out[x * 4] = _tga_expand5(v & 31);
+                out[x * 4 + 1] = _tga_expand5((v >> 5) & 31);
+                out[x * 4 + 2] = _tga_expand5((v >> 10) & 31);
+                out[x * 4 + 3] = (uint8_t)(0 - (v >> 15));
+            }
+            break;
+        case 3:
+            for(size_t x = 0; x < count; x++)
+            {
+                out[x * 4] = in[x * 3];
+                out[x * 4 + 1] = in[x * 3 + 1];
+                out[x * 4 + 2] = in[x * 3 + 2];
+                out[x * 4 + 3] = 255;
+            }
+            break;
+        default:
+            memcpy(out, in, count * 4);
+            break;
+    }
+}
+
+/*
+ * Whether pixels of this size ignore their alpha: a 16-bit image whose
+ * descriptor declares no attribute bits is opaque whatever its top bit.
+ */
+static inline int _tga_alpha_ignored(size_t bytes, uint8_t descriptor)
+{
+    return bytes == 2 && (descriptor & 15) == 0;
+}
+
+/* _tga_unpack_bgra for the pixels of an image with the given descriptor. */
+static inline void _tga_unpack_image_bgra(uint8_t *restrict out,
+                                          const uint8_t *restrict in,
+                                          size_t count, size_t bytes,
+                                          uint8_t descriptor)
+{
+    _tga_unpack_bgra(out, in, count, bytes);
+    if(_tga_alpha_ignored(bytes, descriptor))
+        for(size_t x = 0; x < count; x++)
+            out[x * 4 + 3] = 255;
+}
+
+/* The reverse of _tga_unpack_bgra; 16-bit alpha is set from alpha >= 128. */
+static inline void _tga_pack_bgra(uint8_t *restrict out,
+                                  const uint8_t *restrict in, size_t count,
+                                  size_t bytes)
+{
+    switch(bytes)
+    {
+        case 2:
+            for(size_t x = 0; x < count; x++)
+            {
+                uint32_t v = _tga_reduce8(in[x * 4]) |
+                             _tga_reduce8(in[x * 4 + 1]) << 5 |
+                             _tga_reduce8(in[x * 4 + 2]) << 10 |
+                             (uint32_t)(in[x * 4 + 3] >> 7) << 15;
+                out[x * 2] = (uint8_t)(v & 0xFF);
+                out[x * 2 + 1] = (uint8_t)(v >> 8);
+            }
+            break;
+        case 3:
+            for(size_t x = 0; x < count; x++)
+            {
+                out[x * 3] = in[x * 4];
+                out[x * 3 + 1] = in[x * 4 + 1];
+                out[x * 3 + 2] = in[x * 4 + 2];
+            }
+            break;
+        default:
+            memcpy(out, in, count * 4);
+            break;
+    }
+}
+
+/* Copies count pixels of the given size in reverse order. */
+static inline void _tga_reverse_pixels(uint8_t *restrict out,
+                                       const uint8_t *restrict in,
+                                       size_t count, size_t bytes)
+{
+    for(size_t x = 0; x < count; x++)
+        memcpy(out + (count - 1 - x) * bytes, in + x * bytes, bytes);
+}
+
+#endif/*_TGA_PIXEL_H*/
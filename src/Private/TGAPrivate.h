@@ -6,17 +6,27 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <memory.h>
+#include <stdlib.h>
 
 #include <TGAImage.h>
 
 #define TGA_HEADER_SIZE 18
 #define TGA_FOOTER_SIZE 26
+#define TGA_EXTENSION_SIZE 495
+#define TGA_COLOR_CORRECTION_SIZE (256 * 4 * 2)
 #define __TGA_SIG_SIZE  18
 #define TGA_ERR_MAX     256
 #define TRUEVISION_SIG "TRUEVISION-XFILE."
 
-extern TGAError tga_err;
-extern char tga_err_string[TGA_ERR_MAX];
+#if defined(_MSC_VER)
+    #define TGA_THREAD_LOCAL __declspec(thread)
+#else
+    #define TGA_THREAD_LOCAL __thread
+#endif
+
+/* Error state is per-thread so images can be decoded concurrently. */
+extern TGA_THREAD_LOCAL TGAError tga_err;
+extern TGA_THREAD_LOCAL char tga_err_string[TGA_ERR_MAX];
 
 /*
  * The below macros are used to perform a check on a simple boolean condition.
@@ -52,9 +62,137 @@ extern char tga_err_string[TGA_ERR_MAX];
 /* The below macro is for unimplemented functions, or 'impossible' branches. */
 #define fail(_TGA_ERR, ...) check(false, _TGA_ERR, __VA_ARGS__)
 
+/*
+ * Instrumentation. All I/O and allocations inside the library go through the
+ * wrappers below so they can be counted while a stats sink is installed. When
+ * nothing is installed the cost is a single test of a thread-local pointer,
+ * and building with TGA_NO_STATS removes the instrumentation entirely.
+ */
+#ifdef TGA_NO_STATS
+    #define stat_add(FIELD, N) ((void)0)
+    #define staged(STAGE, CALL) (CALL)
+#else
+    extern TGA_THREAD_LOCAL TGAStats *tga_stats;
+    extern TGAStageHook tga_stage_begin_hook;
+    extern TGAStageHook tga_stage_end_hook;
+
+    #define stat_add(FIELD, N)                                  \
+        do {                                                    \
+            if(tga_stats)                                       \
+                tga_stats->FIELD += (N);                        \
+        } while(0)
+
+    /* Evaluates CALL as the given stage, timing it and firing the hooks. */
+    #define staged(STAGE, CALL)                                 \
+        (_tga_stage_begin(STAGE), _tga_stage_end((STAGE), (CALL)))
+
+    void _tga_stage_begin(TGAStage stage);
+    int _tga_stage_end(TGAStage stage, int result);
+#endif/*TGA_NO_STATS*/
+
+static inline void *_tga_malloc(size_t size)
+{
+    stat_add(alloc_count, 1);
+    stat_add(alloc_bytes, size);
+    return malloc(size);
+}
+
+static inline size_t _tga_fread(void *ptr, size_t size, size_t n, FILE *file)
+{
+    size_t count = fread(ptr, size, n, file);
+    stat_add(read_calls, 1);
+    stat_add(bytes_read, count * size);
+    return count;
+}
+
+static inline size_t _tga_fwrite(const void *ptr, size_t size, size_t n,
+                                 FILE *file)
+{
+    size_t count = fwrite(ptr, size, n, file);
+    stat_add(write_calls, 1);
+    stat_add(bytes_written, count * size);
+    return count;
+}
+
+static inline int _tga_fseek(FILE *file, long offset, int whence)
+{
+    stat_add(seek_calls, 1);
+    return fseek(file, offset, whence);
+}
+
+/*
+ * The decoder reads from a TGASource so the same code handles stdio streams
+ * and images that are already in memory (e.g. read by the async loader).
+ */
+typedef struct {
+    FILE *file;
+    const uint8_t *buffer;
+    size_t length;
+    size_t position;
+} TGASource;
+
+static inline size_t _tga_source_read(TGASource *src, void *ptr,
+                                      size_t size, size_t n)
+{
+    size_t count = 0;
+    if(src->file)
+        return _tga_fread(ptr, size, n, src->file);
+    if(size == 0)
+        return 0;
+    count = (src->length - src->position) / size;
+    count = count < n ? count : n;
+    memcpy(ptr, src->buffer + src->position, count * size);
+    src->position += count * size;
+    stat_add(read_calls, 1);
+    stat_add(bytes_read, count * size);
+    return count;
+}
+
+static inline int _tga_source_seek(TGASource *src, long offset, int whence)
+{
+    long base = 0;
+    if(src->file)
+        return _tga_fseek(src->file, offset, whence);
+    stat_add(seek_calls, 1);
+    if(whence == SEEK_CUR)
+        base = (long)src->position;
+    else if(whence == SEEK_END)
+        base = (long)src->length;
+    if(base + offset < 0 || (size_t)(base + offset) > src->length)
+        return -1;
+    src->position = (size_t)(base + offset);
+    return 0;
+}
+
+static inline long _tga_source_tell(TGASource *src)
+{
+    return src->file ? ftell(src->file) : (long)src->position;
+}
+
+/*
+ * Where an image from open_tga_image reads its pixels. A file is owned by the
+ * image and closed with it; a buffer belongs to the caller.
+ */
+typedef struct {
+    TGASource src;
+    uint8_t stored_type;        /* Image type in the file, before decoding */
+} TGALazySource;
+
+struct TGACacheEntry;
+struct TGAPixelBuffer;
+
 struct _NY_TgaMeta {
+    size_t data_size;           /* Bytes reserved for data */
+    uint32_t *scanline_offsets; /* Row offsets from the last RLE write */
+    struct TGACacheEntry *cache_entry; /* Owning cache entry, if cached */
+    uint16_t *color_correction; /* Extension area table, 256 A, R, G, B */
+    TGALazySource *lazy;        /* Pixel source of a lazily opened image */
+    struct TGAPixelBuffer *shared; /* Pixels shared with clones and views */
+    TGADeveloperTag *developer_tags; /* Developer area directory */
+
     uint32_t extension_offset;
     uint32_t developer_offset;
+    uint32_t row_stride;        /* Row distance of a view, 0 when packed */
 
     uint16_t c_map_length;
     uint16_t x_offset;
@@ -62,6 +200,9 @@ struct _NY_TgaMeta {
     uint16_t width;
     uint16_t height;
     uint16_t c_map_start;
+    uint16_t gamma_numerator;   /* Extension area gamma, unset if the */
+    uint16_t gamma_denominator; /* denominator is 0 */
+    uint16_t developer_tag_count;
 
     uint8_t id_length;
     uint8_t c_map_type;
@@ -69,13 +210,166 @@ struct _NY_TgaMeta {
     uint8_t pixel_depth;
     uint8_t c_map_depth;
     uint8_t image_descriptor;
-    char __padding[2];
-}; /* SIZEOF == 28 */
+    uint8_t data_mapped;        /* data was allocated with mmap */
+    uint8_t compression;        /* TGACompression used when writing */
+}; /* SIZEOF == 96 on 64-bit targets */
 
 /* Trivial Sanity Check function for functions expecting an allocated image */
-static bool _tga_sanity(TGAImage* image)
+static inline bool _tga_sanity(TGAImage* image)
 {
     return image && image->_meta;
 }
 
+/*
+ * Size helpers. Every size derived from the header is computed in size_t and
+ * checked for overflow: a 65535x65535 32-bit image needs 16 GiB, which does not
+ * fit in 32 bits and cannot be addressed at all on 32-bit targets.
+ */
+static inline size_t _tga_bytes_per_pixel(uint8_t pixel_depth)
+{
+    return (size_t)((pixel_depth + 7) / 8);
+}
+
+static inline bool _tga_pixel_bytes(uint16_t width, uint16_t height,
+                                    uint8_t pixel_depth, size_t *size)
+{
+    size_t bytes = _tga_bytes_per_pixel(pixel_depth);
+    *size = 0;
+    if(width && height && bytes > SIZE_MAX / width / height)
+        return false;
+    *size = (size_t)width * height * bytes;
+    return true;
+}
+
+/* Bytes of pixel data in one row. */
+static inline size_t _tga_row_bytes(TGAImage *image)
+{
+    return (size_t)image->_meta->width *
+           _tga_bytes_per_pixel(image->_meta->pixel_depth);
+}
+
+/*
+ * Distance in bytes between the starts of two consecutive rows. Rows are
+ * packed except in views from tga_subimage, which keep their parent's stride.
+ * Only images given to _tga_writable_pixels are guaranteed to be packed.
+ */
+static inline size_t _tga_row_stride(TGAImage *image)
+{
+    if(image->_meta->row_stride)
+        return image->_meta->row_stride;
+    return _tga_row_bytes(image);
+}
+
+/* Image descriptor bits giving the corner the first stored pixel belongs to. */
+#define TGA_ORIGIN_RIGHT    0x10
+#define TGA_ORIGIN_TOP      0x20
+
+/*
+ * Stored row holding row y of the image as seen with a top-left origin. Rows
+ * of bottom-origin images (the TGA default) are stored last row first.
+ */
+static inline size_t _tga_stored_row(TGAImage *image, size_t y)
+{
+    if(image->_meta->image_descriptor & TGA_ORIGIN_TOP)
+        return y;
+    return image->_meta->height - 1 - y;
+}
+
+/*
+ * Pixel data of an image, decoding it first if the image was opened lazily.
+ * Functions that read pixels get them through here rather than testing
+ * image->data directly; functions that change them use _tga_writable_pixels.
+ */
+static inline uint8_t *_tga_pixels(TGAImage *image)
+{
+    if(!image->data && image->_meta->lazy)
+        tga_materialize(image);
+    return image->data;
+}
+
+/* Size in bytes of the color map that follows the ID field. */
+static inline size_t _tga_color_map_bytes(TGAImage *image)
+{
+    return _tga_bytes_per_pixel(image->_meta->c_map_depth) *
+           image->_meta->c_map_length;
+}
+
+/* Header and footer parsing shared by the decoders, see TGADecode.c. */
+void _tga_parse_header(TGAImage *image, const uint8_t *data);
+void _tga_parse_footer(TGAImage *image, const uint8_t *footer);
+
+/* New image with the header fields of another, see TGAConvert.c. */
+TGAImage *_tga_derive_image(TGAImage *image, uint8_t depth, uint16_t width,
+                            uint16_t height);
+
+/* Reverses stored rows and/or columns in place, see TGATransform.c. */
+int _tga_flip_stored(TGAImage *image, int rows, int columns);
+
+/*
+ * Applies per-channel tables, in storage order, to count stored rows from
+ * first. See TGALut.c.
+ */
+void _tga_lut_rows(TGAImage *image, const uint8_t lut[4][256], size_t first,
+                   size_t count);
+
+/*
+ * Row pipeline plumbing (see TGAPipeline.c). A TGARowReader decodes the
+ * stored rows of a raw or RLE source in order, a block at a time; see
+ * TGADecode.c. A TGARowWriter writes the header, then blocks of rows already
+ * in the file's pixel format, then the footer; with reverse set, blocks
+ * arrive last row first. See TGAEncode.c.
+ */
+typedef struct {
+    TGASource *src;
+    size_t width;
+    size_t bytes;
+    size_t remaining;           /* Pixels not yet claimed by a packet */
+    size_t left;                /* Pixels left in the current packet */
+    int encoded;
+    int run;                    /* The current packet repeats value */
+    uint8_t value[4];
+} TGARowReader;
+
+int _tga_row_reader_open(TGARowReader *reader, TGAImage *image,
+                         TGASource *src);
+int _tga_row_reader_read(TGARowReader *reader, uint8_t *out, size_t rows);
+
+typedef struct {
+    uint64_t run_packets;
+    uint64_t run_pixels;
+    uint64_t raw_packets;
+    uint64_t raw_pixels;
+} TGARleCounts;
+
+typedef struct TGARowWriter TGARowWriter;
+
+size_t _tga_rle_encode_row(const uint8_t *row, size_t width, size_t bytes,
+                           uint8_t *out, TGARleCounts *counts);
+size_t _tga_rle_row_bound(size_t width, size_t bytes);
+TGARowWriter *_tga_row_writer_open(TGAImage *image, const char *filename,
+                                   int reverse);
+int _tga_row_writer_put(TGARowWriter *writer, const uint8_t *data,
+                        size_t length, size_t first_row);
+int _tga_row_writer_close(TGARowWriter *writer, int finish);
+
+/* Attribute bits after converting between depths, see TGAConvert.c. */
+uint8_t _tga_converted_attribute_bits(uint8_t bits, uint8_t from, uint8_t to);
+
+/* Reads the developer area directory into the image, see TGADeveloper.c. */
+int _tga_read_developer_directory(TGAImage *image, TGASource *src);
+
+/* Drops a reference taken by tga_cache_get, see TGACache.c. */
+void _tga_cache_release(TGAImage *image);
+
+/*
+ * Pixel buffer allocation, see TGAMemory.c. _tga_share_pixels makes `to`
+ * share `from`'s pixel buffer (copy-on-write), starting offset bytes in;
+ * _tga_writable_pixels gives an image packed pixels of its own before they
+ * are changed.
+ */
+int _tga_alloc_pixels(TGAImage *image, size_t size, bool zero);
+void _tga_free_pixels(TGAImage *image);
+int _tga_share_pixels(TGAImage *from, TGAImage *to, size_t offset);
+uint8_t *_tga_writable_pixels(TGAImage *image);
+
 #endif/*_TGA_PRIVATE_H*/
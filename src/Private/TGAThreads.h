@@ -0,0 +1,54 @@
+#ifndef _TGA_THREADS_H
+#define _TGA_THREADS_H
+
+/*
+ * Thin portability layer over the platform's threads. TGA_HAVE_PTHREADS is
+ * defined by the build when POSIX threads are available; without it every
+ * parallel code path in the library runs on the calling thread.
+ */
+#include <stddef.h>
+
+#ifdef TGA_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/* Mutexes that compile away when the library is built without threads. */
+#ifdef TGA_HAVE_PTHREADS
+typedef pthread_mutex_t TGAMutex;
+#define TGA_MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define _tga_mutex_init(M)      pthread_mutex_init((M), NULL)
+#define _tga_mutex_destroy(M)   pthread_mutex_destroy(M)
+#define _tga_mutex_lock(M)      pthread_mutex_lock(M)
+#define _tga_mutex_unlock(M)    pthread_mutex_unlock(M)
+#else
+typedef int TGAMutex;
+#define TGA_MUTEX_INITIALIZER   0
+#define _tga_mutex_init(M)      ((void)(M))
+#define _tga_mutex_destroy(M)   ((void)(M))
+#define _tga_mutex_lock(M)      ((void)(M))
+#define _tga_mutex_unlock(M)    ((void)(M))
+#endif
+
+/* Upper bound on worker threads used by a single operation. */
+#define TGA_MAX_THREADS 64
+
+/* Number of online processors, at least 1. */
+unsigned _tga_cpu_count(void);
+
+/*
+ * Threads an operation touching the given number of bytes should use, based
+ * on tga_set_thread_count. Small jobs stay on the calling thread since thread
+ * start-up would cost more than it saves.
+ */
+unsigned _tga_threads_for(size_t bytes);
+
+/*
+ * Splits [0, count) into at most `threads` contiguous ranges and calls fn for
+ * each range, one range per thread. The calling thread runs the first range
+ * and the call returns once every range is done.
+ */
+typedef void (*TGAParallelFn)(void *ctx, size_t begin, size_t end);
+void _tga_parallel_for(size_t count, unsigned threads, TGAParallelFn fn,
+                       void *ctx);
+
+#endif/*_TGA_THREADS_H*/
@@ -0,0 +1,491 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Texture atlases. Images are placed with a skyline packer: the top edge of
+ * everything placed so far is kept as a list of horizontal segments, and each
+ * image, tallest first, goes where its bottom edge ends up highest (lowest y),
+ * leftmost on ties. A width is picked from the total area and doubled until
+ * the result fits the height limit.
+ *
+ * Each image occupies a slot of its own size plus the extrusion on every side
+ * and the padding on its right and bottom. Slots never overlap, so images are
+ * copied into the atlas in parallel, a row at a time, and the atlas is stored
+ * top-down so rows of a slot are contiguous runs.
+ */
+
+#define TGA_ATLAS_DEFAULT_MAX   4096
+
+typedef struct {
+    size_t x;
+    size_t y;
+    size_t width;
+} TGASkylineNode;
+
+typedef struct {
+    TGASkylineNode *nodes;
+    size_t count;
+    size_t width;
+} TGASkyline;
+
+typedef struct {
+    size_t width;               /* Slot size: image, extrusion and padding. */
+    size_t height;
+    size_t x;                   /* Slot position once packed. */
+    size_t y;
+    size_t index;               /* Input the slot belongs to. */
+} TGAAtlasSlot;
+
+typedef struct {
+    TGAImage *const *images;
+    TGAAtlasRect *rects;
+    TGAImage *atlas;
+    size_t count;
+    size_t extrude;
+    size_t chunk_items;
+    uint8_t **scratch;          /* Two rows of the widest image, per chunk. */
+} TGAAtlasJob;
+
+/* Height at which a slot of the given width rests if placed at node i. */
+static int _skyline_fit(const TGASkyline *sky, size_t i, size_t width,
+                        size_t *y)
+{
+    size_t remaining = width;
+    if(sky->nodes[i].x + width > sky->width)
+        return 0;
+    *y = 0;
+    for(size_t j = i; remaining > 0; j++)
+    {
+        size_t span = sky->nodes[j].width < remaining ? sky->nodes[j].width
+                                                      : remaining;
+        *y = sky->nodes[j].y > *y ? sky->nodes[j].y : *y;
+        remaining -= span;
+    }
+    return 1;
+}
+
+/* Raises the skyline under a slot placed at node i. */
+static void _skyline_add(TGASkyline *sky, size_t i, size_t width, size_t top)
+{
+    size_t right = sky->nodes[i].x + width;
+    TGASkylineNode node = {sky->nodes[i].x, top, width};
+
+    memmove(sky->nodes + i + 1, sky->nodes + i,
+            (sky->count - i) * sizeof(TGASkylineNode));
+    sky->nodes[i] = node;
+    sky->count++;
+
+    /* Trim or drop the segments the slot now covers. */
+    while(i + 1 < sky->count && sky->nodes[i + 1].x < right)
+    {
+        TGASkylineNode *next = &sky->nodes[i + 1];
+        size_t covered = right - next->x;
+        if(covered < next->width)
+        {
+            next->x += covered;
+            next->width -= covered;
+            break;
+        }
+        memmove(next, next + 1,
+                (sky->count - i - 2) * sizeof(TGASkylineNode));
+        sky->count--;
+    }
+    /* Merge neighbours at the same height. */
+    for(size_t j = 0; j + 1 < sky->count;)
+    {
+        if(sky->nodes[j].y == sky->nodes[j + 1].y)
+        {
+            sky->nodes[j].width += sky->nodes[j + 1].width;
+            memmove(sky->nodes + j + 1, sky->nodes + j + 2,
+                    (sky->count - j - 2) * sizeof(TGASkylineNode));
+            sky->count--;
+        }
+        else
+            j++;
+    }
+}
+
+/*
+ * Packs the slots, in order, into a strip of the given width. Returns the
+ * height used, or SIZE_MAX if a slot is wider than the strip.
+ */
+static size_t _skyline_pack(TGASkyline *sky, TGAAtlasSlot *slots,
+                            size_t count, size_t width)
+{
+    size_t height = 0;
+    sky->width = width;
+    sky->count = 1;
+    sky->nodes[0].x = 0;
+    sky->nodes[0].y = 0;
+    sky->nodes[0].width = width;
+
+    for(size_t n = 0; n < count; n++)
+    {
+        TGAAtlasSlot *slot = &slots[n];
+        size_t best = SIZE_MAX, best_top = SIZE_MAX, best_x = SIZE_MAX;
+        if(slot->width == 0 || slot->height == 0)
+            continue;
+        for(size_t i = 0; i < sky->count; i++)
+        {
+            size_t y = 0;
+            if(!_skyline_fit(sky, i, slot->width, &y))
+                continue;
+            if(y + slot->height < best_top ||
+                (y + slot->height == best_top && sky->nodes[i].x < best_x))
+            {
+                best = i;
+                best_top = y + slot->height;
+                best_x = sky->nodes[i].x;
+            }
+        }
+        if(best == SIZE_MAX)
+            return SIZE_MAX;
+        slot->x = best_x;
+        slot->y = best_top - slot->height;
+        _skyline_add(sky, best, slot->width, best_top);
+        height = best_top > height ? best_top : height;
+    }
+    return height;
+}
+
+/* Tallest first, then widest, then input order. */
+static int _compare_slots(const void *a, const void *b)
+{
+    const TGAAtlasSlot *sa = a, *sb = b;
+    if(sa->height != sb->height)
+        return sa->height > sb->height ? -1 : 1;
+    if(sa->width != sb->width)
+        return sa->width > sb->width ? -1 : 1;
+    return sa->index < sb->index ? -1 : 1;
+}
+
+static size_t _round_pow2(size_t value)
+{
+    size_t p = 1;
+    while(p < value)
+        p *= 2;
+    return p;
+}
+
+/* One display row of src, converted to the atlas format. */
+static void _atlas_row(TGAImage *src, size_t y, uint8_t *out, size_t bytes,
+                       uint8_t *scratch)
+{
+    size_t width = src->_meta->width;
+    size_t in_bytes = _tga_bytes_per_pixel(src->_meta->pixel_depth);
+    const uint8_t *row = src->data + _tga_stored_row(src, y) *
+                         _tga_row_stride(src);
+    int mirrored = (src->_meta->image_descriptor & TGA_ORIGIN_RIGHT) != 0;
+    int opaque = _tga_alpha_ignored(in_bytes, src->_meta->image_descriptor);
+    uint8_t *bgra = scratch + width * 4;
+
+    if(in_bytes == bytes && !opaque)
+    {
+        if(mirrored)
+            _tga_reverse_pixels(out, row, width, bytes);
+        else
+            memcpy(out, row, width * bytes);
+        return;
+    }
+    if(mirrored)
+    {
+        _tga_reverse_pixels(scratch, row, width, in_bytes);
+        row = scratch;
+    }
+    if(in_bytes == 1)
+    {
+        for(size_t x = 0; x < width; x++)
+        {
+            bgra[x * 4] = bgra[x * 4 + 1] = bgra[x * 4 + 2] = row[x];
+            bgra[x * 4 + 3] = 255;
+        }
+    }
+    else
+        _tga_unpack_image_bgra(bgra, row, width, in_bytes,
+                               src->_meta->image_descriptor);
+    _tga_pack_bgra(out, bgra, width, bytes);
+}
+
+/* Repeats the edge pixels of a placed image outwards. */
+static void _extrude(TGAImage *atlas, const TGAAtlasRect *rect, size_t extrude)
+{
+    size_t bytes = _tga_bytes_per_pixel(atlas->_meta->pixel_depth);
+    size_t stride = _tga_row_stride(atlas);
+    size_t x0 = rect->x, y0 = rect->y, w = rect->width, h = rect->height;
+    size_t span = (w + 2 * extrude) * bytes;
+
+    for(size_t y = y0; y < y0 + h; y++)
+    {
+        uint8_t *row = atlas->data + y * stride;
+        for(size_t e = 1; e <= extrude; e++)
+        {
+            memcpy(row + (x0 - e) * bytes, row + x0 * bytes, bytes);
+            memcpy(row + (x0 + w - 1 + e) * bytes,
+                   row + (x0 + w - 1) * bytes, bytes);
+        }
+    }
+    for(size_t e = 1; e <= extrude; e++)
+    {
+        uint8_t *first = atlas->data + y0 * stride + (x0 - extrude) * bytes;
+        uint8_t *last = atlas->data + (y0 + h - 1) * stride +
+                        (x0 - extrude) * bytes;
+        memcpy(first - e * stride, first, span);
+        memcpy(last + e * stride, last, span);
+    }
+}
+
+static void _blit_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAAtlasJob *job = ctx;
+    size_t bytes = _tga_bytes_per_pixel(job->atlas->_meta->pixel_depth);
+    size_t stride = _tga_row_stride(job->atlas);
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        size_t first = chunk * job->chunk_items;
+        size_t last = first + job->chunk_items < job->count ?
+                      first + job->chunk_items : job->count;
+        for(size_t i = first; i < last; i++)
+        {
+            const TGAAtlasRect *rect = &job->rects[i];
+            uint8_t *dst = job->atlas->data + rect->y * stride +
+                           rect->x * bytes;
+            if(rect->width == 0 || rect->height == 0)
+                continue;
+            for(size_t y = 0; y < rect->height; y++)
+                _atlas_row(job->images[i], y, dst + y * stride, bytes,
+                           job->scratch[chunk]);
+            if(job->extrude)
+                _extrude(job->atlas, rect, job->extrude);
+        }
+    }
+}
+
+static int _atlas_input(TGAImage *image)
+{
+    if(!_tga_sanity(image))
+        return 0;
+    if(image->_meta->width == 0 || image->_meta->height == 0)
+        return 1;
+    if(!_tga_pixels(image))
+        return 0;
+    if(image->_meta->image_type == TGA_MONOCHROME)
+        return image->_meta->pixel_depth == 8;
+    return image->_meta->image_type == TGA_TRUECOLOR &&
+           (image->_meta->pixel_depth == 16 ||
+            image->_meta->pixel_depth == 24 ||
+            image->_meta->pixel_depth == 32);
+}
+
+/*
+ * Packs images into a new atlas and records where each one went in rects,
+ * which must hold count entries. The atlas is stored top-down; space outside
+ * the images (and their extrusion) is transparent black.
+ */
+TGAImage *tga_pack_atlas(TGAImage *const *images, size_t count,
+                         const TGAAtlasOptions *options, TGAAtlasRect *rects)
+{
+    TGAAtlasOptions defaults = {0};
+    TGAAtlasJob job = {0};
+    TGASkyline sky = {0};
+    TGAAtlasSlot *slots = NULL;
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    TGAImage *atlas = NULL;
+    size_t max_width = 0, max_height = 0, padding = 0, extrude = 0;
+    size_t area = 0, widest = 0, tallest = 0, width = 0, height = 0;
+    size_t used_width = 0, used_height = 0, widest_image = 0;
+    unsigned threads = 0, chunks = 0;
+    uint8_t depth = 0;
+    int pow2 = 0;
+
+    check(images || count == 0, TGA_ARG_ERR, "Invalid image list.");
+    check(rects || count == 0, TGA_ARG_ERR, "Invalid rect table.");
+    options = options ? options : &defaults;
+    max_width = options->max_width ? options->max_width : TGA_ATLAS_DEFAULT_MAX;
+    max_height = options->max_height ? options->max_height
+                                     : TGA_ATLAS_DEFAULT_MAX;
+    padding = options->padding;
+    extrude = options->extrude;
+    depth = options->depth ? options->depth : 32;
+    pow2 = (options->flags & TGA_ATLAS_POWER_OF_TWO) != 0;
+    check(depth == 16 || depth == 24 || depth == 32, TGA_ARG_ERR,
+            "Unsupported atlas depth %u.", depth);
+
+    slots = _tga_malloc((count ? count : 1) * sizeof(TGAAtlasSlot));
+    sky.nodes = _tga_malloc((count + 1) * sizeof(TGASkylineNode));
+    check(slots && sky.nodes, TGA_MEM_ERR,
+            "Unable to allocate packer state.");
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t w = 0, h = 0;
+        check(_atlas_input(images[i]), TGA_UNSUPPORTED,
+                "Image %zu cannot be packed: only 16, 24 and 32-bit truecolor "
+                "and 8-bit monochrome images are supported.", i);
+        w = images[i]->_meta->width;
+        h = images[i]->_meta->height;
+        slots[i].width = w && h ? w + 2 * extrude + padding : 0;
+        slots[i].height = w && h ? h + 2 * extrude + padding : 0;
+        area += slots[i].width * slots[i].height;
+        widest = slots[i].width > widest ? slots[i].width : widest;
+        tallest = slots[i].height > tallest ? slots[i].height : tallest;
+        widest_image = w > widest_image ? w : widest_image;
+        slots[i].index = i;
+    }
+    /* Trailing padding may hang off the right and bottom edges. */
+    check(widest <= max_width + padding && tallest <= max_height + padding,
+            TGA_ARG_ERR, "An image is larger than the atlas size limit.");
+
+    qsort(slots, count, sizeof(TGAAtlasSlot), _compare_slots);
+
+    {
+        double side = ceil(sqrt((double)area));
+        width = (size_t)side;
+    }
+    width = width > widest ? width : widest;
+    width = width ? width : 1;
+    for(;;)
+    {
+        size_t strip = (pow2 ? _round_pow2(width) : width) + padding;
+        if(strip > max_width + padding)
+            strip = max_width + padding;
+        height = _skyline_pack(&sky, slots, count, strip);
+        check(height != SIZE_MAX, TGA_INTERNAL_ERR,
+                "Atlas strip narrower than an image.");
+        height = height > padding ? height - padding : 0;
+        if((pow2 ? _round_pow2(height) : height) <= max_height)
+            break;
+        check(strip < max_width + padding, TGA_ARG_ERR,
+                "Images do not fit in a %zux%zu atlas.", max_width,
+                max_height);
+        width = (strip - padding) * 2;
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t right = slots[i].x + slots[i].width - padding;
+        if(slots[i].width == 0)
+            continue;
+        used_width = right > used_width ? right : used_width;
+    }
+    used_height = height;
+    if(pow2)
+    {
+        used_width = _round_pow2(used_width ? used_width : 1);
+        used_height = _round_pow2(used_height ? used_height : 1);
+    }
+    check(used_width <= max_width && used_height <= max_height, TGA_ARG_ERR,
+            "Images do not fit in a %zux%zu atlas.", max_width, max_height);
+
+    atlas = new_tga_image(TGA_TRUECOLOR, depth, (uint16_t)used_width,
+                          (uint16_t)used_height);
+    check(atlas, tga_error(), "Unable to create atlas.");
+    atlas->_meta->image_descriptor = (uint8_t)(TGA_ORIGIN_TOP |
+        (depth == 32 ? 8 : depth == 16 ? 1 : 0));
+
+    for(size_t n = 0; n < count; n++)
+    {
+        size_t i = slots[n].index;
+        TGAAtlasRect *rect = &rects[i];
+        memset(rect, 0, sizeof(*rect));
+        if(slots[n].width == 0)
+            continue;
+        rect->x = (uint16_t)(slots[n].x + extrude);
+        rect->y = (uint16_t)(slots[n].y + extrude);
+        rect->width = images[i]->_meta->width;
+        rect->height = images[i]->_meta->height;
+        rect->u0 = (float)rect->x / (float)used_width;
+        rect->v0 = (float)rect->y / (float)used_height;
+        rect->u1 = (float)(rect->x + rect->width) / (float)used_width;
+        rect->v1 = (float)(rect->y + rect->height) / (float)used_height;
+    }
+
+    if(count > 0 && used_width > 0 && used_height > 0)
+    {
+        threads = _tga_threads_for(_tga_row_stride(atlas) * used_height);
+        if(threads > count)
+            threads = (unsigned)count;
+        chunks = threads;
+        job.images = images;
+        job.rects = rects;
+        job.atlas = atlas;
+        job.count = count;
+        job.extrude = extrude;
+        job.chunk_items = (count + chunks - 1) / chunks;
+        job.scratch = scratch;
+        for(unsigned i = 0; i < chunks; i++)
+        {
+            scratch[i] = _tga_malloc(widest_image * 8);
+            check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+        }
+        _tga_parallel_for(chunks, threads, _blit_chunks, &job);
+    }
+
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    free(slots);
+    free(sky.nodes);
+    return atlas;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    free(slots);
+    free(sky.nodes);
+    free_tga_image(atlas);
+    return NULL;
+}
+
+/*
+ * Loads the files with a TGALoader, which reads and decodes them in parallel,
+ * and packs them with tga_pack_atlas.
+ */
+TGAImage *tga_pack_atlas_files(const char *const *paths, size_t count,
+                               const TGAAtlasOptions *options,
+                               TGAAtlasRect *rects)
+{
+    TGALoader *loader = NULL;
+    TGAImage **images = NULL;
+    TGAImage *atlas = NULL;
+    TGALoadResult result;
+    size_t loaded = 0;
+
+    check(paths || count == 0, TGA_ARG_ERR, "Invalid path list.");
+    images = _tga_malloc((count ? count : 1) * sizeof(TGAImage *));
+    check(images, TGA_MEM_ERR, "Unable to allocate image list.");
+    loader = tga_loader_new(NULL);
+    check(loader, tga_error(), "Unable to start loader.");
+    for(size_t i = 0; i < count; i++)
+        check(tga_loader_submit(loader, paths[i], NULL), tga_error(),
+                "Unable to queue %s.", paths[i]);
+    /* Results come back in submission order. */
+    for(; loaded < count; loaded++)
+    {
+        check(tga_loader_wait(loader, &result), TGA_INTERNAL_ERR,
+                "Loader finished early.");
+        images[loaded] = result.image;
+        check(result.image, result.error, "Unable to load %s: %.128s",
+                paths[loaded], result.error_str);
+    }
+    tga_loader_free(loader);
+    loader = NULL;
+
+    atlas = tga_pack_atlas(images, count, options, rects);
+    check(atlas, tga_error(), "Unable to pack atlas.");
+    for(size_t i = 0; i < count; i++)
+        free_tga_image(images[i]);
+    free(images);
+    return atlas;
+
+error:
+    tga_loader_free(loader);
+    for(size_t i = 0; i < loaded && images; i++)
+        free_tga_image(images[i]);
+    free(images);
+    return NULL;
+}
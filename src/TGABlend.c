@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Alpha compositing. Rows of the overlapping area are brought to 8-bit BGRA
+ * (32-bit rows are used in place) and combined by per-mode kernels: plain
+ * loops over four channels with 32-bit integer arithmetic and no branches in
+ * the body, which the compiler vectorizes. Products are divided by 255 with
+ * rounding to nearest, so opaque and transparent sources reproduce their
+ * inputs exactly and results match the reference formulas bit for bit.
+ *
+ * Colours are straight (not premultiplied) alpha, and the destination keeps
+ * the union of the two coverages: a = sa + da * (1 - sa) in every mode.
+ */
+
+typedef struct {
+    TGAImage *dst;
+    TGAImage *src;
+    TGABlendMode mode;
+    size_t x0;                  /* Overlap in destination top-left pixels. */
+    size_t y0;
+    size_t src_x0;              /* The same in source top-left pixels. */
+    size_t src_y0;
+    size_t span;
+    size_t rows;
+    size_t chunk_rows;
+    uint8_t **scratch;          /* Source and destination BGRA rows. */
+} TGABlendJob;
+
+static void _blend_over(uint8_t *restrict d, const uint8_t *restrict s,
+                        size_t count)
+{
+    for(size_t x = 0; x < count; x++)
+    {
+        uint32_t sa = s[x * 4 + 3], ia = 255 - sa;
+        for(size_t c = 0; c < 3; c++)
+            d[x * 4 + c] = (uint8_t)_tga_div255(s[x * 4 + c] * sa +
+                                                d[x * 4 + c] * ia);
+        d[x * 4 + 3] = (uint8_t)(sa + _tga_div255(d[x * 4 + 3] * ia));
+    }
+}
+
+/* d + s * sa, saturating. */
+static void _blend_add(uint8_t *restrict d, const uint8_t *restrict s,
+                       size_t count)
+{
+    for(size_t x = 0; x < count; x++)
+    {
+        uint32_t sa = s[x * 4 + 3], ia = 255 - sa;
+        for(size_t c = 0; c < 3; c++)
+        {
+            uint32_t v = d[x * 4 + c] + _tga_div255(s[x * 4 + c] * sa);
+            d[x * 4 + c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+        d[x * 4 + 3] = (uint8_t)(sa + _tga_div255(d[x * 4 + 3] * ia));
+    }
+}
+
+/* d * s, faded in by sa. */
+static void _blend_multiply(uint8_t *restrict d, const uint8_t *restrict s,
+                            size_t count)
+{
+    for(size_t x = 0; x < count; x++)
+    {
+        uint32_t sa = s[x * 4 + 3], ia = 255 - sa;
+        for(size_t c = 0; c < 3; c++)
+        {
+            uint32_t m = _tga_div255(d[x * 4 + c] * (uint32_t)s[x * 4 + c]);
+            d[x * 4 + c] = (uint8_t)_tga_div255(m * sa + d[x * 4 + c] * ia);
+        }
+        d[x * 4 + 3] = (uint8_t)(sa + _tga_div255(d[x * 4 + 3] * ia));
+    }
+}
+
+/* First stored pixel of the top-left span [x, x + span) of a row. */
+static size_t _stored_x(TGAImage *image, size_t x, size_t span)
+{
+    if(image->_meta->image_descriptor & TGA_ORIGIN_RIGHT)
+        return image->_meta->width - x - span;
+    return x;
+}
+
+static void _blend_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGABlendJob *job = ctx;
+    TGAImage *dst = job->dst, *src = job->src;
+    size_t dst_bytes = _tga_bytes_per_pixel(dst->_meta->pixel_depth);
+    size_t src_bytes = _tga_bytes_per_pixel(src->_meta->pixel_depth);
+    size_t span = job->span;
+    size_t dst_x = _stored_x(dst, job->x0, span);
+    size_t src_x = _stored_x(src, job->src_x0, span);
+    /* Source pixels are used in the destination's stored order. */
+    int reverse = ((dst->_meta->image_descriptor ^
+                    src->_meta->image_descriptor) & TGA_ORIGIN_RIGHT) != 0;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        uint8_t *s_row = job->scratch[chunk];
+        uint8_t *d_row = s_row + span * 4;
+        uint8_t *flipped = d_row + span * 4;
+        size_t row = chunk * job->chunk_rows;
+        size_t last = row + job->chunk_rows < job->rows ? row + job->chunk_rows
+                                                        : job->rows;
+        for(; row < last; row++)
+        {
+            uint8_t *d = dst->data +
+                _tga_stored_row(dst, job->y0 + row) * _tga_row_stride(dst) +
+                dst_x * dst_bytes;
+            const uint8_t *s = src->data +
+                _tga_stored_row(src, job->src_y0 + row) * _tga_row_stride(src) +
+                src_x * src_bytes;
+            uint8_t *db = d;
+
+            if(reverse)
+            {
+                _tga_reverse_pixels(flipped, s, span, src_bytes);
+                s = flipped;
+            }
+            if(src_bytes != 4)
+            {
+                _tga_unpack_image_bgra(s_row, s, span, src_bytes,
+                                       src->_meta->image_descriptor);
+                s = s_row;
+            }
+            if(dst_bytes != 4)
+            {
+                _tga_unpack_bgra(d_row, d, span, dst_bytes);
+                db = d_row;
+            }
+
+            switch(job->mode)
+            {
+                case TGA_BLEND_ADD:
+                    _blend_add(db, s, span);
+                    break;
+                case TGA_BLEND_MULTIPLY:
+                    _blend_multiply(db, s, span);
+                    break;
+                default:
+                    _blend_over(db, s, span);
+                    break;
+            }
+            if(dst_bytes != 4)
+                _tga_pack_bgra(d, d_row, span, dst_bytes);
+        }
+    }
+}
+
+static bool _blendable(TGAImage *image)
+{
+    uint8_t depth = image->_meta->pixel_depth;
+    return image->_meta->image_type == TGA_TRUECOLOR &&
+           (depth == 16 || depth == 24 || depth == 32);
+}
+
+/*
+ * Composites src onto dst with src's top-left corner at (dx, dy) in dst's
+ * top-left coordinates, clipping to dst. Both images may use any origin and
+ * any of the 16, 24 and 32-bit depths. 24-bit sources are opaque, as are
+ * 16-bit ones that do not declare their alpha bit in the attribute bits; the
+ * alpha byte of 32-bit sources is always used, since many writers leave the
+ * attribute bits unset. Large areas are split across tga_get_thread_count
+ * threads.
+ */
+int tga_blend(TGAImage *dst, TGAImage *src, int dx, int dy, TGABlendMode mode)
+{
+    TGABlendJob job = {0};
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    long x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    unsigned threads = 0, chunks = 0;
+
+    check(_tga_sanity(dst) && _tga_sanity(src), TGA_INV_IMAGE_PNT,
+            "Invalid TGAImage Pointer.");
+    check(dst != src, TGA_ARG_ERR, "Cannot blend an image onto itself.");
+    check(mode == TGA_BLEND_OVER || mode == TGA_BLEND_ADD ||
+            mode == TGA_BLEND_MULTIPLY, TGA_ARG_ERR,
+            "Unknown blend mode %d.", (int)mode);
+    check(_blendable(dst) && _blendable(src), TGA_UNSUPPORTED,
+            "Only 16, 24 and 32-bit truecolor images can be blended.");
+
+    x0 = dx > 0 ? dx : 0;
+    y0 = dy > 0 ? dy : 0;
+    x1 = (long)dx + src->_meta->width;
+    y1 = (long)dy + src->_meta->height;
+    x1 = x1 < dst->_meta->width ? x1 : dst->_meta->width;
+    y1 = y1 < dst->_meta->height ? y1 : dst->_meta->height;
+    if(x0 >= x1 || y0 >= y1)
+        return 1; /* Nothing overlaps. */
+    check(_tga_pixels(src) && _tga_writable_pixels(dst), TGA_INV_IMAGE_PNT,
+            "Image data missing.");
+
+    job.dst = dst;
+    job.src = src;
+    job.mode = mode;
+    job.x0 = (size_t)x0;
+    job.y0 = (size_t)y0;
+    job.span = (size_t)(x1 - x0);
+    job.rows = (size_t)(y1 - y0);
+    job.src_x0 = (size_t)(x0 - dx);
+    job.src_y0 = (size_t)(y0 - dy);
+    threads = _tga_threads_for(job.span * job.rows * 8);
+    if(threads > job.rows)
+        threads = (unsigned)job.rows;
+    chunks = threads;
+    job.chunk_rows = (job.rows + chunks - 1) / chunks;
+    job.scratch = scratch;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        scratch[i] = _tga_malloc(job.span * 12);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+    }
+
+    _tga_parallel_for(chunks, threads, _blend_chunks, &job);
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 1;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 0;
+}
@@ -0,0 +1,701 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <float.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * BC1 and BC3 (DXT1 and DXT5) block compression. The image is read in display
+ * order, top row first, one row of 4x4 blocks at a time; blocks on the right
+ * and bottom edges repeat the last column and row.
+ *
+ * A BC1 block holds two RGB565 endpoints and a 2-bit palette index per pixel.
+ * With c0 > c1 the palette is c0, c1 and the colours a third and two thirds
+ * of the way between; otherwise it is c0, c1, their midpoint and transparent
+ * black. BC1 uses the second form for blocks with pixels below half alpha.
+ * BC3 adds an alpha block (two 8-bit endpoints and 3-bit indices) and always
+ * reads its colour block in the four-colour form.
+ *
+ * Endpoints are fitted in floating point. The range fit takes the extremes of
+ * the pixels along their principal axis. The cluster fit sorts the pixels
+ * along that axis, tries every split of that order into palette entries,
+ * solves least squares for the endpoints of each split and keeps the one with
+ * the lowest error after rounding to RGB565. Either way the indices are then
+ * chosen against the integer palette the decoder builds, so the decoder below
+ * reproduces exactly what the encoder measured.
+ */
+
+#define TGA_BC_POWER_ITERATIONS 8
+
+typedef struct {
+    TGAImage *image;
+    uint8_t *out;
+    TGABCFormat format;
+    TGABCQuality quality;
+    size_t blocks_x;
+    size_t block_rows;
+    size_t chunk_rows;          /* Block rows per chunk. */
+    uint8_t **scratch;          /* Four BGRA rows and a pixel row, per chunk. */
+} TGABCJob;
+
+static const float tga_bc_weights4[4] = {1.0f, 2.0f / 3.0f, 1.0f / 3.0f, 0.0f};
+static const float tga_bc_weights3[4] = {1.0f, 0.5f, 0.0f, 0.0f};
+
+static inline void _put16(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)(value & 0xFF);
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static inline uint16_t _get16(const uint8_t *in)
+{
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static inline uint8_t _expand6(uint32_t value)
+{
+    return (uint8_t)((value << 2) | (value >> 4));
+}
+
+/* RGB565 to 8-bit R, G and B. */
+static void _expand565(uint16_t color, uint8_t rgb[3])
+{
+    rgb[0] = _tga_expand5(color >> 11);
+    rgb[1] = _expand6((color >> 5) & 63);
+    rgb[2] = _tga_expand5(color & 31);
+}
+
+static uint32_t _quantize(float value, uint32_t max)
+{
+    float v = value * ((float)max / 255.0f) + 0.5f;
+    v = v < 0.0f ? 0.0f : v;
+    return v > (float)max ? max : (uint32_t)v;
+}
+
+static uint16_t _pack565(const float rgb[3])
+{
+    return (uint16_t)(_quantize(rgb[0], 31) << 11 |
+                      _quantize(rgb[1], 63) << 5 | _quantize(rgb[2], 31));
+}
+
+/* The palette a decoder builds from two endpoints. */
+static void _color_palette(uint16_t c0, uint16_t c1, int four,
+                           uint8_t palette[4][3])
+{
+    _expand565(c0, palette[0]);
+    _expand565(c1, palette[1]);
+    for(size_t c = 0; c < 3; c++)
+    {
+        uint32_t a = palette[0][c], b = palette[1][c];
+        if(four)
+        {
+            palette[2][c] = (uint8_t)((2 * a + b + 1) / 3);
+            palette[3][c] = (uint8_t)((a + 2 * b + 1) / 3);
+        }
+        else
+        {
+            palette[2][c] = (uint8_t)((a + b + 1) / 2);
+            palette[3][c] = 0;
+        }
+    }
+}
+
+static void _alpha_palette(uint32_t a0, uint32_t a1, uint8_t palette[8])
+{
+    palette[0] = (uint8_t)a0;
+    palette[1] = (uint8_t)a1;
+    if(a0 > a1)
+    {
+        for(uint32_t i = 1; i < 7; i++)
+            palette[i + 1] = (uint8_t)(((7 - i) * a0 + i * a1 + 3) / 7);
+    }
+    else
+    {
+        for(uint32_t i = 1; i < 5; i++)
+            palette[i + 1] = (uint8_t)(((5 - i) * a0 + i * a1 + 2) / 5);
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+/*
+ * Picks the nearest palette entry for every pixel in mask. Pixels marked
+ * transparent take index 3 of a three-colour palette, which opaque pixels
+ * never use.
+ */
+static uint32_t _color_indices(const uint8_t palette[4][3], int four,
+                               const uint8_t pixels[16][4], uint32_t mask,
+                               const uint8_t transparent[16], uint32_t *error)
+{
+    uint32_t indices = 0, total = 0;
+    size_t entries = four ? 4 : 3;
+    for(size_t i = 0; i < 16; i++)
+    {
+        uint32_t best = UINT32_MAX, index = 3;
+        if(transparent[i])
+        {
+            indices |= 3u << (2 * i);
+            continue;
+        }
+        if(!(mask >> i & 1))
+            continue;
+        for(size_t e = 0; e < entries; e++)
+        {
+            uint32_t d = 0; /* The palette is R, G, B. */
+            for(size_t c = 0; c < 3; c++)
+            {
+                int diff = (int)pixels[i][2 - c] - (int)palette[e][c];
+                d += (uint32_t)(diff * diff);
+            }
+            if(d < best)
+            {
+                best = d;
+                index = (uint32_t)e;
+            }
+        }
+        indices |= index << (2 * i);
+        total += best;
+    }
+    *error = total;
+    return indices;
+}
+
+/*
+ * Principal axis of the points by power iteration on their covariance. Flat
+ * blocks give a zero axis.
+ */
+static void _principal_axis(const float (*points)[3], size_t count,
+                            float axis[3])
+{
+    float mean[3] = {0.0f, 0.0f, 0.0f}, cov[6] = {0.0f};
+    float v[3] = {1.0f, 1.0f, 1.0f};
+    for(size_t i = 0; i < count; i++)
+        for(size_t c = 0; c < 3; c++)
+            mean[c] += points[i][c] / (float)count;
+    for(size_t i = 0; i < count; i++)
+    {
+        float d[3];
+        for(size_t c = 0; c < 3; c++)
+            d[c] = points[i][c] - mean[c];
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+    for(size_t n = 0; n < TGA_BC_POWER_ITERATIONS; n++)
+    {
+        float w[3], scale = 0.0f;
+        w[0] = cov[0] * v[0] + cov[1] * v[1] + cov[2] * v[2];
+        w[1] = cov[1] * v[0] + cov[3] * v[1] + cov[4] * v[2];
+        w[2] = cov[2] * v[0] + cov[4] * v[1] + cov[5] * v[2];
+        for(size_t c = 0; c < 3; c++)
+            scale = w[c] > scale ? w[c] : -w[c] > scale ? -w[c] : scale;
+        if(scale <= 0.0f)
+        {
+            v[0] = v[1] = v[2] = 0.0f;
+            break;
+        }
+        for(size_t c = 0; c < 3; c++)
+            v[c] = w[c] / scale;
+    }
+    for(size_t c = 0; c < 3; c++)
+        axis[c] = v[c];
+}
+
+static inline float _dot(const float a[3], const float b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/* Endpoints at the extremes of the points along the principal axis. */
+static void _range_fit(const float (*points)[3], size_t count,
+                       const float axis[3], float start[3], float end[3])
+{
+    size_t lo = 0, hi = 0;
+    float min = FLT_MAX, max = -FLT_MAX;
+    for(size_t i = 0; i < count; i++)
+    {
+        float d = _dot(points[i], axis);
+        if(d < min)
+        {
+            min = d;
+            lo = i;
+        }
+        if(d > max)
+        {
+            max = d;
+            hi = i;
+        }
+    }
+    memcpy(start, points[hi], sizeof(float) * 3);
+    memcpy(end, points[lo], sizeof(float) * 3);
+}
+
+static void _snap565(const float in[3], float out[3])
+{
+    uint8_t rgb[3];
+    _expand565(_pack565(in), rgb);
+    for(size_t c = 0; c < 3; c++)
+        out[c] = rgb[c];
+}
+
+/*
+ * Least-squares endpoints over every ordered split of the points into the
+ * palette's levels (4, or 3 for the transparent form). Cluster m is weighted
+ * weights[m] towards start and 1 - weights[m] towards end. The weighted sums
+ * telescope, so each split costs three prefix-sum lookups per channel.
+ */
+static void _cluster_fit(const float (*points)[3], size_t count,
+                         const float axis[3], size_t levels, float start[3],
+                         float end[3])
+{
+    const float *weights = levels == 4 ? tga_bc_weights4 : tga_bc_weights3;
+    float sorted[16][3], prefix[17][3], keys[16];
+    float steps[3], waa[4], wbb[4], wab[4];
+    float best = FLT_MAX;
+
+    for(size_t m = 0; m < 4; m++)
+    {
+        waa[m] = weights[m] * weights[m];
+        wbb[m] = (1.0f - weights[m]) * (1.0f - weights[m]);
+        wab[m] = weights[m] * (1.0f - weights[m]);
+        if(m < 3)
+            steps[m] = weights[m] - weights[m + 1];
+    }
+
+    /* Insertion sort along the axis, largest projection first. */
+    for(size_t i = 0; i < count; i++)
+    {
+        float key = _dot(points[i], axis);
+        size_t j = i;
+        for(; j > 0 && keys[j - 1] < key; j--)
+        {
+            keys[j] = keys[j - 1];
+            memcpy(sorted[j], sorted[j - 1], sizeof(sorted[j]));
+        }
+        keys[j] = key;
+        memcpy(sorted[j], points[i], sizeof(sorted[j]));
+    }
+    memset(prefix[0], 0, sizeof(prefix[0]));
+    for(size_t i = 0; i < count; i++)
+        for(size_t c = 0; c < 3; c++)
+            prefix[i + 1][c] = prefix[i][c] + sorted[i][c];
+
+    for(size_t i = 0; i <= count; i++)
+    for(size_t j = i; j <= count; j++)
+    for(size_t k = levels == 4 ? j : count; k <= count; k++)
+    {
+        float n[4] = {(float)i, (float)(j - i), (float)(k - j),
+                      (float)(count - k)};
+        float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[3], bx[3];
+        float det = 0.0f, a[3], b[3], error = 0.0f;
+        for(size_t m = 0; m < 4; m++)
+        {
+            aa += n[m] * waa[m];
+            bb += n[m] * wbb[m];
+            ab += n[m] * wab[m];
+        }
+        det = aa * bb - ab * ab;
+        if(det < 1e-6f)
+            continue;
+        det = 1.0f / det;
+        for(size_t c = 0; c < 3; c++)
+        {
+            ax[c] = steps[0] * prefix[i][c] + steps[1] * prefix[j][c] +
+                    steps[2] * prefix[k][c];
+            bx[c] = prefix[count][c] - ax[c];
+            a[c] = (ax[c] * bb - bx[c] * ab) * det;
+            b[c] = (bx[c] * aa - ax[c] * ab) * det;
+            error -= a[c] * ax[c] + b[c] * bx[c];
+        }
+        /* Rounding can only add to the least-squares error. */
+        if(error >= best)
+            continue;
+        error = 0.0f;
+        _snap565(a, a);
+        _snap565(b, b);
+        /* Squared error less the constant sum of squared points. */
+        for(size_t c = 0; c < 3; c++)
+            error += a[c] * a[c] * aa + b[c] * b[c] * bb +
+                     2.0f * (a[c] * b[c] * ab - a[c] * ax[c] - b[c] * bx[c]);
+        if(error < best)
+        {
+            best = error;
+            memcpy(start, a, sizeof(a));
+            memcpy(end, b, sizeof(b));
+        }
+    }
+}
+
+/*
+ * Encodes the colour half of a block. four is set for BC3, whose colour block
+ * is always read in the four-colour form; BC1 blocks with transparent pixels
+ * use the three-colour form.
+ */
+static void _encode_color(const uint8_t pixels[16][4], uint32_t mask,
+                          TGABCQuality quality, int bc3, uint8_t *out)
+{
+    float points[16][3], axis[3], start[3], end[3];
+    uint8_t transparent[16] = {0}, palette[4][3];
+    uint16_t best_c0 = 0, best_c1 = 0;
+    uint32_t best_indices = 0, best_error = UINT32_MAX;
+    size_t count = 0;
+    int four = 1;
+
+    for(size_t i = 0; i < 16; i++)
+    {
+        if(!(mask >> i & 1))
+            continue;
+        if(!bc3 && pixels[i][3] < 128)
+        {
+            transparent[i] = 1;
+            four = 0;
+            continue;
+        }
+        /* BGRA to R, G, B. */
+        points[count][0] = pixels[i][2];
+        points[count][1] = pixels[i][1];
+        points[count][2] = pixels[i][0];
+        count++;
+    }
+
+    if(count > 0)
+    {
+        _principal_axis((const float (*)[3])points, count, axis);
+        for(int pass = 0; pass < (quality == TGA_BC_CLUSTER_FIT ? 2 : 1);
+            pass++)
+        {
+            uint16_t c0 = 0, c1 = 0, swap = 0;
+            uint32_t indices = 0, error = 0;
+            if(pass == 0)
+                _range_fit((const float (*)[3])points, count, axis, start,
+                           end);
+            else
+                _cluster_fit((const float (*)[3])points, count, axis,
+                             four ? 4 : 3, start, end);
+            c0 = _pack565(start);
+            c1 = _pack565(end);
+            /* The order of the endpoints selects the palette form. */
+            if((four && c0 < c1) || (!four && c0 > c1))
+            {
+                swap = c0;
+                c0 = c1;
+                c1 = swap;
+            }
+            _color_palette(c0, c1, bc3 || c0 > c1, palette);
+            indices = _color_indices((const uint8_t (*)[3])palette,
+                                     bc3 || c0 > c1, pixels, mask,
+                                     transparent, &error);
+            if(error < best_error)
+            {
+                best_error = error;
+                best_c0 = c0;
+                best_c1 = c1;
+                best_indices = indices;
+            }
+        }
+    }
+    else if(!four)
+        best_indices = 0xFFFFFFFFu; /* Every pixel transparent. */
+
+    _put16(out, best_c0);
+    _put16(out + 2, best_c1);
+    _put16(out + 4, best_indices & 0xFFFF);
+    _put16(out + 6, best_indices >> 16);
+}
+
+static uint64_t _alpha_indices(const uint8_t palette[8],
+                               const uint8_t pixels[16][4], uint32_t mask,
+                               uint32_t *error)
+{
+    uint64_t indices = 0;
+    uint32_t total = 0;
+    for(size_t i = 0; i < 16; i++)
+    {
+        uint32_t best = UINT32_MAX, index = 0;
+        if(!(mask >> i & 1))
+            continue;
+        for(uint32_t e = 0; e < 8; e++)
+        {
+            int diff = (int)pixels[i][3] - (int)palette[e];
+            uint32_t d = (uint32_t)(diff * diff);
+            if(d < best)
+            {
+                best = d;
+                index = e;
+            }
+        }
+        indices |= (uint64_t)index << (3 * i);
+        total += best;
+    }
+    *error = total;
+    return indices;
+}
+
+/*
+ * Encodes the alpha half of a BC3 block. The range fit interpolates between
+ * the extremes; the cluster fit also tries the six-value form, which spans
+ * only the alphas strictly between 0 and 255 and has both of those exactly.
+ */
+static void _encode_alpha(const uint8_t pixels[16][4], uint32_t mask,
+                          TGABCQuality quality, uint8_t *out)
+{
+    uint32_t min = 255, max = 0, inner_min = 255, inner_max = 0;
+    uint32_t ends[2][2], best_error = UINT32_MAX;
+    uint64_t best_indices = 0;
+    size_t best = 0, candidates = quality == TGA_BC_CLUSTER_FIT ? 2 : 1;
+
+    for(size_t i = 0; i < 16; i++)
+    {
+        uint32_t a = pixels[i][3];
+        if(!(mask >> i & 1))
+            continue;
+        min = a < min ? a : min;
+        max = a > max ? a : max;
+        if(a > 0 && a < 255)
+        {
+            inner_min = a < inner_min ? a : inner_min;
+            inner_max = a > inner_max ? a : inner_max;
+        }
+    }
+    ends[0][0] = max;
+    ends[0][1] = min;
+    ends[1][0] = inner_min <= inner_max ? inner_min : 0;
+    ends[1][1] = inner_min <= inner_max ? inner_max : 0;
+    for(size_t n = 0; n < candidates; n++)
+    {
+        uint8_t palette[8];
+        uint32_t error = 0;
+        uint64_t indices = 0;
+        _alpha_palette(ends[n][0], ends[n][1], palette);
+        indices = _alpha_indices(palette, pixels, mask, &error);
+        if(error < best_error)
+        {
+            best_error = error;
+            best_indices = indices;
+            best = n;
+        }
+    }
+    out[0] = (uint8_t)ends[best][0];
+    out[1] = (uint8_t)ends[best][1];
+    for(size_t i = 0; i < 6; i++)
+        out[2 + i] = (uint8_t)(best_indices >> (8 * i));
+}
+
+/*
+ * Copies a 4x4 block out of four BGRA rows, repeating the edges, and returns
+ * the mask of pixels inside the image. Only those are fitted and measured.
+ */
+static uint32_t _gather_block(uint8_t *const rows[4], size_t rows_left,
+                              size_t bx, size_t width, uint8_t pixels[16][4])
+{
+    uint32_t mask = 0;
+    for(size_t y = 0; y < 4; y++)
+        for(size_t x = 0; x < 4; x++)
+        {
+            size_t sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+            memcpy(pixels[y * 4 + x], rows[y] + sx * 4, 4);
+            if(bx * 4 + x < width && y < rows_left)
+                mask |= 1u << (y * 4 + x);
+        }
+    return mask;
+}
+
+/* One display row of the image as BGRA. */
+static void _bgra_row(TGAImage *image, size_t y, uint8_t *out, uint8_t *tmp)
+{
+    size_t width = image->_meta->width;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    const uint8_t *row = image->data + _tga_stored_row(image, y) *
+                         _tga_row_stride(image);
+    if(image->_meta->image_descriptor & TGA_ORIGIN_RIGHT)
+    {
+        _tga_reverse_pixels(tmp, row, width, bytes);
+        row = tmp;
+    }
+    _tga_unpack_image_bgra(out, row, width, bytes,
+                           image->_meta->image_descriptor);
+}
+
+static void _encode_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGABCJob *job = ctx;
+    size_t width = job->image->_meta->width;
+    size_t height = job->image->_meta->height;
+    size_t block_bytes = job->format == TGA_BC3 ? 16 : 8;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        uint8_t *scratch = job->scratch[chunk];
+        uint8_t *rows[4], *tmp = scratch + 4 * width * 4;
+        size_t by = chunk * job->chunk_rows;
+        size_t last = by + job->chunk_rows < job->block_rows ?
+                      by + job->chunk_rows : job->block_rows;
+        for(; by < last; by++)
+        {
+            uint8_t *out = job->out + by * job->blocks_x * block_bytes;
+            for(size_t y = 0; y < 4; y++)
+            {
+                rows[y] = scratch + y * width * 4;
+                if(by * 4 + y < height)
+                    _bgra_row(job->image, by * 4 + y, rows[y], tmp);
+                else
+                    rows[y] = rows[y - 1];
+            }
+            for(size_t bx = 0; bx < job->blocks_x; bx++)
+            {
+                uint8_t pixels[16][4];
+                uint32_t mask = _gather_block(rows, height - by * 4, bx,
+                                              width, pixels);
+                if(job->format == TGA_BC3)
+                {
+                    _encode_alpha((const uint8_t (*)[4])pixels, mask,
+                                  job->quality, out);
+                    _encode_color((const uint8_t (*)[4])pixels, mask,
+                                  job->quality, 1, out + 8);
+                }
+                else
+                    _encode_color((const uint8_t (*)[4])pixels, mask,
+                                  job->quality, 0, out);
+                out += block_bytes;
+            }
+        }
+    }
+}
+
+/* Bytes needed for an image of the given size. */
+size_t tga_bc_size(uint16_t width, uint16_t height, TGABCFormat format)
+{
+    size_t blocks = ((size_t)width + 3) / 4 * (((size_t)height + 3) / 4);
+    return blocks * (format == TGA_BC3 ? 16 : 8);
+}
+
+static int _encode_bc(TGAImage *image, TGABCQuality quality,
+                      TGABCFormat format, uint8_t *out)
+{
+    TGABCJob job = {0};
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    size_t width = 0, height = 0;
+    unsigned threads = 0, chunks = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(out, TGA_ARG_ERR, "Invalid output buffer.");
+    check(quality == TGA_BC_RANGE_FIT || quality == TGA_BC_CLUSTER_FIT,
+            TGA_ARG_ERR, "Unknown quality %d.", (int)quality);
+    check(image->_meta->image_type == TGA_TRUECOLOR &&
+            (image->_meta->pixel_depth == 16 ||
+             image->_meta->pixel_depth == 24 ||
+             image->_meta->pixel_depth == 32), TGA_UNSUPPORTED,
+            "Only 16, 24 and 32-bit truecolor images can be compressed.");
+    width = image->_meta->width;
+    height = image->_meta->height;
+    if(width == 0 || height == 0)
+        return 1;
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    job.image = image;
+    job.out = out;
+    job.format = format;
+    job.quality = quality;
+    job.blocks_x = (width + 3) / 4;
+    job.block_rows = (height + 3) / 4;
+    /* Cluster fitting does far more work per byte than a copy. */
+    threads = _tga_threads_for(_tga_row_stride(image) * height *
+                               (quality == TGA_BC_CLUSTER_FIT ? 64 : 4));
+    if(threads > job.block_rows)
+        threads = (unsigned)job.block_rows;
+    chunks = threads;
+    job.chunk_rows = (job.block_rows + chunks - 1) / chunks;
+    job.scratch = scratch;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        scratch[i] = _tga_malloc(width * 4 * 4 + width * 4);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+    }
+    _tga_parallel_for(chunks, threads, _encode_chunks, &job);
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 1;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 0;
+}
+
+/*
+ * Compresses the image into out, which must hold tga_bc_size bytes. Blocks
+ * are written row by row from the top-left corner of the displayed image.
+ */
+int tga_encode_bc1(TGAImage *image, TGABCQuality quality, uint8_t *out)
+{
+    return _encode_bc(image, quality, TGA_BC1, out);
+}
+
+int tga_encode_bc3(TGAImage *image, TGABCQuality quality, uint8_t *out)
+{
+    return _encode_bc(image, quality, TGA_BC3, out);
+}
+
+/*
+ * Reference decoder: expands BC1 or BC3 blocks into a new 32-bit image stored
+ * top-down. Transparent BC1 pixels decode to transparent black.
+ */
+TGAImage *tga_decode_bc(const uint8_t *blocks, uint16_t width,
+                        uint16_t height, TGABCFormat format)
+{
+    TGAImage *image = NULL;
+    size_t blocks_x = ((size_t)width + 3) / 4, stride = 0;
+    size_t block_bytes = format == TGA_BC3 ? 16 : 8;
+
+    check(blocks || width == 0 || height == 0, TGA_ARG_ERR,
+            "Invalid block data.");
+    check(format == TGA_BC1 || format == TGA_BC3, TGA_ARG_ERR,
+            "Unknown block format %d.", (int)format);
+    image = new_tga_image(TGA_TRUECOLOR, 32, width, height);
+    check(image, tga_error(), "Unable to create decoded image.");
+    image->_meta->image_descriptor = TGA_ORIGIN_TOP | 8;
+    stride = _tga_row_stride(image);
+
+    for(size_t by = 0; by * 4 < height; by++)
+    for(size_t bx = 0; bx < blocks_x; bx++)
+    {
+        const uint8_t *block = blocks + (by * blocks_x + bx) * block_bytes;
+        const uint8_t *color = format == TGA_BC3 ? block + 8 : block;
+        uint16_t c0 = _get16(color), c1 = _get16(color + 2);
+        uint32_t indices = _get16(color + 4) | (uint32_t)_get16(color + 6) << 16;
+        int four = format == TGA_BC3 || c0 > c1;
+        uint8_t palette[4][3], alphas[8];
+        uint64_t alpha_indices = 0;
+
+        _color_palette(c0, c1, four, palette);
+        if(format == TGA_BC3)
+        {
+            _alpha_palette(block[0], block[1], alphas);
+            for(size_t i = 0; i < 6; i++)
+                alpha_indices |= (uint64_t)block[2 + i] << (8 * i);
+        }
+        for(size_t y = 0; y < 4 && by * 4 + y < height; y++)
+        for(size_t x = 0; x < 4 && bx * 4 + x < width; x++)
+        {
+            size_t i = y * 4 + x, index = (indices >> (2 * i)) & 3;
+            uint8_t *p = image->data + (by * 4 + y) * stride +
+                         (bx * 4 + x) * 4;
+            p[0] = palette[index][2];
+            p[1] = palette[index][1];
+            p[2] = palette[index][0];
+            p[3] = !four && index == 3 ? 0 : 255;
+            if(format == TGA_BC3)
+                p[3] = alphas[(alpha_indices >> (3 * i)) & 7];
+        }
+    }
+    return image;
+
+error:
+    free_tga_image(image);
+    return NULL;
+}
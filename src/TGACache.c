@@ -0,0 +1,471 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAHash.h"
+#include "Private/TGAThreads.h"
+
+/*
+ * Process-wide cache of decoded images. Paths are spread over shards by hash,
+ * each with its own lock, hash table and LRU list, so lookups from different
+ * threads rarely contend. Decoding happens outside the lock. Entries remember
+ * the device, inode, size and modification time seen when they were decoded
+ * and are replaced when any of them change.
+ *
+ * The byte budget is split evenly between shards. Entries still referenced by
+ * a caller are never evicted; an entry that goes stale or is cleared while in
+ * use is detached from its shard and freed on its last release.
+ */
+#define TGA_CACHE_SHARDS            16
+#define TGA_CACHE_INITIAL_BUCKETS   16
+#define TGA_CACHE_DEFAULT_BUDGET    ((size_t)256 << 20)
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+} TGAFileIdentity;
+
+struct TGACacheShard;
+
+typedef struct TGACacheEntry {
+    char *path;
+    uint64_t hash;
+    TGAFileIdentity identity;
+    TGAImage *image;
+    size_t bytes;
+    unsigned refs;
+    int detached;
+    struct TGACacheShard *shard;
+    struct TGACacheEntry *next;         /* Hash bucket chain. */
+    struct TGACacheEntry *lru_prev;     /* Towards most recently used. */
+    struct TGACacheEntry *lru_next;
+} TGACacheEntry;
+
+typedef struct TGACacheShard {
+    TGAMutex lock;
+    TGACacheEntry **buckets;
+    size_t bucket_count;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    TGACacheEntry *lru_head;            /* Most recently used. */
+    TGACacheEntry *lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} TGACacheShard;
+
+static TGACacheShard tga_cache_shards[TGA_CACHE_SHARDS];
+
+#ifdef TGA_HAVE_PTHREADS
+static pthread_once_t tga_cache_once = PTHREAD_ONCE_INIT;
+#else
+static int tga_cache_ready = 0;
+#endif
+
+static void _cache_init(void)
+{
+    for(size_t i = 0; i < TGA_CACHE_SHARDS; i++)
+    {
+        memset(&tga_cache_shards[i], 0, sizeof(tga_cache_shards[i]));
+        tga_cache_shards[i].budget = TGA_CACHE_DEFAULT_BUDGET /
+                                     TGA_CACHE_SHARDS;
+        _tga_mutex_init(&tga_cache_shards[i].lock);
+    }
+}
+
+static void _cache_ensure_init(void)
+{
+#ifdef TGA_HAVE_PTHREADS
+    pthread_once(&tga_cache_once, _cache_init);
+#else
+    if(!tga_cache_ready)
+    {
+        _cache_init();
+        tga_cache_ready = 1;
+    }
+#endif
+}
+
+static int _file_identity(const char *path, TGAFileIdentity *identity)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    check(_stat64(path, &st) == 0, TGA_READ_ERR, "Unable to stat %s.", path);
+    identity->dev = (uint64_t)st.st_dev;
+    identity->ino = 0;
+    identity->mtime_ns = (int64_t)st.st_mtime * 1000000000;
+#else
+    struct stat st;
+    check(stat(path, &st) == 0, TGA_READ_ERR, "Unable to stat %s.", path);
+    identity->dev = (uint64_t)st.st_dev;
+    identity->ino = (uint64_t)st.st_ino;
+#if defined(__APPLE__)
+    identity->mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 +
+                         st.st_mtimespec.tv_nsec;
+#else
+    identity->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+                         st.st_mtim.tv_nsec;
+#endif
+#endif
+    identity->size = (uint64_t)st.st_size;
+    return 1;
+error:
+    return 0;
+}
+
+static int _same_identity(const TGAFileIdentity *a, const TGAFileIdentity *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns;
+}
+
+/* Memory held by a decoded image, charged against the budget. */
+static size_t _image_bytes(TGAImage *image)
+{
+    return sizeof(TGAImage) + sizeof(struct _NY_TgaMeta) +
+           image->_meta->data_size + image->_meta->id_length +
+           (image->color_map ? _tga_color_map_bytes(image) : 0);
+}
+
+static void _lru_unlink(TGACacheShard *shard, TGACacheEntry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void _lru_push_front(TGACacheShard *shard, TGACacheEntry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if(shard->lru_head)
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if(!shard->lru_tail)
+        shard->lru_tail = entry;
+}
+
+static TGACacheEntry *_shard_find(TGACacheShard *shard, const char *path,
+                                  uint64_t hash)
+{
+    TGACacheEntry *entry = NULL;
+    if(!shard->bucket_count)
+        return NULL;
+    for(entry = shard->buckets[hash % shard->bucket_count]; entry;
+        entry = entry->next)
+        if(entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
+    return NULL;
+}
+
+/* Removes an entry from the table and LRU list; the caller owns it after. */
+static void _shard_remove(TGACacheShard *shard, TGACacheEntry *entry)
+{
+    TGACacheEntry **link = &shard->buckets[entry->hash % shard->bucket_count];
+    while(*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    entry->next = NULL;
+    _lru_unlink(shard, entry);
+    shard->entries--;
+    shard->bytes -= entry->bytes;
+    entry->detached = 1;
+}
+
+static int _shard_insert(TGACacheShard *shard, TGACacheEntry *entry)
+{
+    if(shard->entries >= shard->bucket_count)
+    {
+        size_t count = shard->bucket_count ? shard->bucket_count * 2
+                                           : TGA_CACHE_INITIAL_BUCKETS;
+        TGACacheEntry **buckets = _tga_malloc(count * sizeof(*buckets));
+        check(buckets, TGA_MEM_ERR, "Unable to grow image cache.");
+        memset(buckets, 0, count * sizeof(*buckets));
+        for(size_t i = 0; i < shard->bucket_count; i++)
+        {
+            TGACacheEntry *item = shard->buckets[i];
+            while(item)
+            {
+                TGACacheEntry *next = item->next;
+                item->next = buckets[item->hash % count];
+                buckets[item->hash % count] = item;
+                item = next;
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = buckets;
+        shard->bucket_count = count;
+    }
+    entry->next = shard->buckets[entry->hash % shard->bucket_count];
+    shard->buckets[entry->hash % shard->bucket_count] = entry;
+    _lru_push_front(shard, entry);
+    shard->entries++;
+    shard->bytes += entry->bytes;
+    return 1;
+error:
+    return 0;
+}
+
+static void _entry_free(TGACacheEntry *entry)
+{
+    if(!entry)
+        return;
+    if(entry->image)
+    {
+        entry->image->_meta->cache_entry = NULL;
+        free_tga_image(entry->image);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * Evicts unreferenced entries from the cold end until the shard fits its
+ * budget. Evicted entries are chained through next for freeing once the lock
+ * has been dropped.
+ */
+static TGACacheEntry *_shard_evict(TGACacheShard *shard)
+{
+    TGACacheEntry *evicted = NULL;
+    TGACacheEntry *entry = shard->lru_tail;
+
+    while(entry && shard->bytes > shard->budget)
+    {
+        TGACacheEntry *prev = entry->lru_prev;
+        if(entry->refs == 0)
+        {
+            _shard_remove(shard, entry);
+            entry->next = evicted;
+            evicted = entry;
+            shard->evictions++;
+        }
+        entry = prev;
+    }
+    return evicted;
+}
+
+static void _free_chain(TGACacheEntry *entry)
+{
+    while(entry)
+    {
+        TGACacheEntry *next = entry->next;
+        _entry_free(entry);
+        entry = next;
+    }
+}
+
+static TGACacheEntry *_entry_load(const char *path, uint64_t hash,
+                                  const TGAFileIdentity *identity)
+{
+    TGACacheEntry *entry = _tga_malloc(sizeof(*entry));
+    FILE *file = NULL;
+    size_t length = strlen(path);
+
+    check(entry, TGA_MEM_ERR, "Unable to allocate cache entry.");
+    memset(entry, 0, sizeof(*entry));
+    entry->path = _tga_malloc(length + 1);
+    check(entry->path, TGA_MEM_ERR, "Unable to allocate cache entry.");
+    memcpy(entry->path, path, length + 1);
+    entry->hash = hash;
+    entry->identity = *identity;
+
+    file = fopen(path, "rb");
+    check(file, TGA_READ_ERR, "Unable to open %s.", path);
+    entry->image = read_tga_image(file);
+    fclose(file);
+    check(entry->image, tga_error(), "Unable to decode %s.", path);
+    entry->bytes = _image_bytes(entry->image);
+    return entry;
+error:
+    _entry_free(entry);
+    return NULL;
+}
+
+/*
+ * Returns the decoded image for path, decoding it only if it is not cached or
+ * the file changed since. The image is shared and must not be modified; hand
+ * it back with tga_cache_release (or free_tga_image) when done.
+ */
+TGAImage *tga_cache_get(const char *path)
+{
+    TGAFileIdentity identity;
+    TGACacheShard *shard = NULL;
+    TGACacheEntry *entry = NULL;
+    TGACacheEntry *loaded = NULL;
+    TGACacheEntry *stale = NULL;
+    TGACacheEntry *evicted = NULL;
+    TGAImage *image = NULL;
+    uint64_t hash = 0;
+
+    check(path && path[0] != '\0', TGA_INV_FILE_NAME, "Invalid path.");
+    _cache_ensure_init();
+    check(_file_identity(path, &identity), tga_error(), "Unable to stat %s.",
+            path);
+    hash = _tga_hash64(path, strlen(path), 0);
+    shard = &tga_cache_shards[hash % TGA_CACHE_SHARDS];
+
+    _tga_mutex_lock(&shard->lock);
+    entry = _shard_find(shard, path, hash);
+    if(entry && _same_identity(&entry->identity, &identity))
+    {
+        entry->refs++;
+        _lru_unlink(shard, entry);
+        _lru_push_front(shard, entry);
+        shard->hits++;
+        _tga_mutex_unlock(&shard->lock);
+        return entry->image;
+    }
+    shard->misses++;
+    _tga_mutex_unlock(&shard->lock);
+
+    loaded = _entry_load(path, hash, &identity);
+    check(loaded, tga_error(), "Unable to load %s.", path);
+
+    _tga_mutex_lock(&shard->lock);
+    entry = _shard_find(shard, path, hash);
+    if(entry && _same_identity(&entry->identity, &identity))
+    {
+        /* Another thread decoded the same file meanwhile; use its copy. */
+        entry->refs++;
+        image = entry->image;
+        _tga_mutex_unlock(&shard->lock);
+        _entry_free(loaded);
+        return image;
+    }
+    if(entry)
+    {
+        _shard_remove(shard, entry);
+        if(entry->refs == 0)
+            stale = entry;
+    }
+    loaded->shard = shard;
+    loaded->refs = 1;
+    if(!_shard_insert(shard, loaded))
+    {
+        _tga_mutex_unlock(&shard->lock);
+        _entry_free(stale);
+        goto error;
+    }
+    loaded->image->_meta->cache_entry = loaded;
+    image = loaded->image;
+    evicted = _shard_evict(shard);
+    _tga_mutex_unlock(&shard->lock);
+
+    _entry_free(stale);
+    _free_chain(evicted);
+    return image;
+
+error:
+    _entry_free(loaded);
+    return NULL;
+}
+
+void _tga_cache_release(TGAImage *image)
+{
+    TGACacheEntry *entry = image->_meta->cache_entry;
+    TGACacheShard *shard = entry->shard;
+    TGACacheEntry *evicted = NULL;
+    TGACacheEntry *detached = NULL;
+
+    _tga_mutex_lock(&shard->lock);
+    if(entry->refs > 0)
+        entry->refs--;
+    if(entry->refs == 0 && entry->detached)
+        detached = entry;
+    else if(entry->refs == 0)
+        evicted = _shard_evict(shard);
+    _tga_mutex_unlock(&shard->lock);
+
+    _entry_free(detached);
+    _free_chain(evicted);
+}
+
+/* Drops the reference taken by tga_cache_get. */
+int tga_cache_release(TGAImage *image)
+{
+    check(_tga_sanity(image) && image->_meta->cache_entry, TGA_ARG_ERR,
+            "Image was not returned by tga_cache_get.");
+    _tga_cache_release(image);
+    return 1;
+error:
+    return 0;
+}
+
+/* Sets the memory budget shared by all cached images, evicting as needed. */
+void tga_cache_set_budget(size_t bytes)
+{
+    _cache_ensure_init();
+    for(size_t i = 0; i < TGA_CACHE_SHARDS; i++)
+    {
+        TGACacheEntry *evicted = NULL;
+        _tga_mutex_lock(&tga_cache_shards[i].lock);
+        tga_cache_shards[i].budget = bytes / TGA_CACHE_SHARDS;
+        evicted = _shard_evict(&tga_cache_shards[i]);
+        _tga_mutex_unlock(&tga_cache_shards[i].lock);
+        _free_chain(evicted);
+    }
+}
+
+/* Drops every cached image; images still in use are freed on release. */
+void tga_cache_clear(void)
+{
+    _cache_ensure_init();
+    for(size_t i = 0; i < TGA_CACHE_SHARDS; i++)
+    {
+        TGACacheShard *shard = &tga_cache_shards[i];
+        TGACacheEntry *removed = NULL;
+
+        _tga_mutex_lock(&shard->lock);
+        while(shard->lru_head)
+        {
+            TGACacheEntry *entry = shard->lru_head;
+            _shard_remove(shard, entry);
+            if(entry->refs == 0)
+            {
+                entry->next = removed;
+                removed = entry;
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->bucket_count = 0;
+        _tga_mutex_unlock(&shard->lock);
+        _free_chain(removed);
+    }
+}
+
+void tga_cache_get_stats(TGACacheStats *stats)
+{
+    if(!stats)
+        return;
+    _cache_ensure_init();
+    memset(stats, 0, sizeof(*stats));
+    for(size_t i = 0; i < TGA_CACHE_SHARDS; i++)
+    {
+        TGACacheShard *shard = &tga_cache_shards[i];
+        _tga_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->budget += shard->budget;
+        _tga_mutex_unlock(&shard->lock);
+    }
+}
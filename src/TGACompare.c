@@ -0,0 +1,297 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+/*
+ * Image comparison. Rows are compared with memcmp first, which is all the work
+ * needed for identical images, and only rows that differ go through the
+ * per-depth error kernels. Those are plain loops over a fixed channel count
+ * with no branches in the body so the compiler vectorizes them.
+ *
+ * Error sums for one row fit in 32 bits (65535 pixels * 255^2), so kernels
+ * accumulate per row and the totals are kept in 64 bits.
+ */
+
+typedef struct {
+    uint64_t sq[4];
+    uint64_t differing;
+    uint32_t max_error;
+    size_t min_x;
+    size_t min_y;
+    size_t max_x;
+    size_t max_y;
+} TGACompareAccum;
+
+typedef struct {
+    TGAImage *a;
+    TGAImage *b;
+    size_t stride_a;
+    size_t stride_b;
+    size_t row_bytes;
+    size_t bytes;
+    size_t chunk_rows;
+    int flip_x;                 /* b is stored mirrored relative to a */
+    int flip_y;
+    TGACompareAccum *accums;    /* One per chunk. */
+    uint8_t **scratch;          /* Reversed b rows when flip_x, per chunk. */
+} TGACompareJob;
+
+static inline void _compare_channels(const uint8_t *restrict a,
+                                     const uint8_t *restrict b, size_t width,
+                                     size_t channels, uint32_t *restrict sq,
+                                     uint32_t *max_error, uint32_t *differing)
+{
+    uint32_t max = 0, count = 0;
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t any = 0;
+        for(size_t c = 0; c < channels; c++)
+        {
+            int d = (int)a[x * channels + c] - (int)b[x * channels + c];
+            uint32_t ad = (uint32_t)(d < 0 ? -d : d);
+            sq[c] += ad * ad;
+            max = ad > max ? ad : max;
+            any |= ad;
+        }
+        count += any != 0;
+    }
+    *max_error = max;
+    *differing = count;
+}
+
+/* 16-bit pixels hold 5 bits each of blue, green and red and one alpha bit. */
+static void _compare_1555(const uint8_t *restrict a, const uint8_t *restrict b,
+                          size_t width, uint32_t *restrict sq,
+                          uint32_t *max_error, uint32_t *differing)
+{
+    uint32_t max = 0, count = 0;
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t pa = (uint32_t)a[x * 2] | (uint32_t)a[x * 2 + 1] << 8;
+        uint32_t pb = (uint32_t)b[x * 2] | (uint32_t)b[x * 2 + 1] << 8;
+        uint32_t any = 0;
+        for(uint32_t c = 0; c < 4; c++)
+        {
+            int d = (int)((pa >> (5 * c)) & 31) - (int)((pb >> (5 * c)) & 31);
+            uint32_t ad = (uint32_t)(d < 0 ? -d : d);
+            sq[c] += ad * ad;
+            max = ad > max ? ad : max;
+            any |= ad;
+        }
+        count += any != 0;
+    }
+    *max_error = max;
+    *differing = count;
+}
+
+static void _compare_row(const uint8_t *a, const uint8_t *b, size_t width,
+                         size_t bytes, size_t y, TGACompareAccum *acc)
+{
+    uint32_t sq[4] = {0};
+    uint32_t max_error = 0, differing = 0;
+    size_t first = 0, last = width - 1;
+
+    switch(bytes)
+    {
+        case 1:
+            _compare_channels(a, b, width, 1, sq, &max_error, &differing);
+            break;
+        case 2:
+            _compare_1555(a, b, width, sq, &max_error, &differing);
+            break;
+        case 3:
+            _compare_channels(a, b, width, 3, sq, &max_error, &differing);
+            break;
+        default:
+            _compare_channels(a, b, width, 4, sq, &max_error, &differing);
+            break;
+    }
+    for(size_t c = 0; c < 4; c++)
+        acc->sq[c] += sq[c];
+    acc->differing += differing;
+    acc->max_error = max_error > acc->max_error ? max_error : acc->max_error;
+
+    /* The caller only passes rows that differ, so both scans terminate. */
+    while(memcmp(a + first * bytes, b + first * bytes, bytes) == 0)
+        first++;
+    while(memcmp(a + last * bytes, b + last * bytes, bytes) == 0)
+        last--;
+    acc->min_x = first < acc->min_x ? first : acc->min_x;
+    acc->max_x = last > acc->max_x ? last : acc->max_x;
+    acc->min_y = y < acc->min_y ? y : acc->min_y;
+    acc->max_y = y;
+}
+
+static void _reverse_row(const uint8_t *row, uint8_t *out, size_t width,
+                         size_t bytes)
+{
+    for(size_t x = 0; x < width; x++)
+        memcpy(out + (width - 1 - x) * bytes, row + x * bytes, bytes);
+}
+
+static void _compare_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGACompareJob *job = ctx;
+    size_t width = job->a->_meta->width;
+    size_t height = job->a->_meta->height;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        TGACompareAccum *acc = &job->accums[chunk];
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        for(; y < last; y++)
+        {
+            const uint8_t *ra = job->a->data + y * job->stride_a;
+            const uint8_t *rb = job->b->data +
+                (job->flip_y ? height - 1 - y : y) * job->stride_b;
+            if(job->flip_x)
+            {
+                _reverse_row(rb, job->scratch[chunk], width, job->bytes);
+                rb = job->scratch[chunk];
+            }
+            if(memcmp(ra, rb, job->row_bytes) != 0)
+                _compare_row(ra, rb, width, job->bytes, y, acc);
+        }
+    }
+}
+
+static double _psnr(double mse, double peak)
+{
+    return mse > 0 ? 10.0 * log10(peak * peak / mse) : INFINITY;
+}
+
+/*
+ * Compares the pixels of two images of the same type, depth and size. Images
+ * stored with different origins are compared as they would be displayed, and
+ * the bounding box is reported with a top-left origin. Large images are split
+ * across tga_get_thread_count threads.
+ */
+int tga_compare(TGAImage *a, TGAImage *b, TGACompareResult *result)
+{
+    TGACompareJob job = {0};
+    TGACompareAccum accums[TGA_MAX_THREADS];
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    TGACompareAccum total;
+    size_t width = 0, height = 0, total_bytes = 0;
+    unsigned threads = 0, chunks = 0;
+    uint8_t flip = 0;
+
+    check(_tga_sanity(a) && _tga_sanity(b), TGA_INV_IMAGE_PNT,
+            "Invalid TGAImage Pointer.");
+    check(result, TGA_ARG_ERR, "Invalid result pointer.");
+    check(a->_meta->image_type == b->_meta->image_type &&
+            a->_meta->pixel_depth == b->_meta->pixel_depth,
+            TGA_TYPE_ERR, "Images differ in type or depth.");
+    check(a->_meta->width == b->_meta->width &&
+            a->_meta->height == b->_meta->height, TGA_ARG_ERR,
+            "Images differ in size: %ux%u and %ux%u.", a->_meta->width,
+            a->_meta->height, b->_meta->width, b->_meta->height);
+    check(a->_meta->image_type == TGA_TRUECOLOR ||
+            a->_meta->image_type == TGA_MONOCHROME, TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be compared.");
+
+    memset(result, 0, sizeof(*result));
+    width = a->_meta->width;
+    height = a->_meta->height;
+    job.bytes = _tga_bytes_per_pixel(a->_meta->pixel_depth);
+    result->channels = job.bytes == 1 ? 1 : job.bytes == 3 ? 3 : 4;
+    result->identical = 1;
+    if(width == 0 || height == 0)
+        return 1;
+    check(_tga_pixels(a) && _tga_pixels(b), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    job.a = a;
+    job.b = b;
+    job.stride_a = _tga_row_stride(a);
+    job.stride_b = _tga_row_stride(b);
+    job.row_bytes = _tga_row_bytes(a);
+    flip = a->_meta->image_descriptor ^ b->_meta->image_descriptor;
+    job.flip_x = (flip & TGA_ORIGIN_RIGHT) != 0;
+    job.flip_y = (flip & TGA_ORIGIN_TOP) != 0;
+
+    total_bytes = job.row_bytes * height;
+    threads = _tga_threads_for(total_bytes);
+    if(threads > height)
+        threads = (unsigned)height;
+    chunks = threads;
+    job.chunk_rows = (height + chunks - 1) / chunks;
+    job.accums = accums;
+    job.scratch = scratch;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        memset(&accums[i], 0, sizeof(accums[i]));
+        accums[i].min_x = accums[i].min_y = SIZE_MAX;
+        accums[i].max_y = SIZE_MAX;
+        if(job.flip_x)
+        {
+            scratch[i] = _tga_malloc(job.row_bytes);
+            check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+        }
+    }
+
+    _tga_parallel_for(chunks, threads, _compare_chunks, &job);
+
+    memset(&total, 0, sizeof(total));
+    total.min_x = total.min_y = SIZE_MAX;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        for(size_t c = 0; c < 4; c++)
+            total.sq[c] += accums[i].sq[c];
+        total.differing += accums[i].differing;
+        if(accums[i].max_error > total.max_error)
+            total.max_error = accums[i].max_error;
+        if(accums[i].max_y == SIZE_MAX)
+            continue; /* Nothing differed in this chunk. */
+        total.min_x = accums[i].min_x < total.min_x ? accums[i].min_x
+                                                    : total.min_x;
+        total.max_x = accums[i].max_x > total.max_x ? accums[i].max_x
+                                                    : total.max_x;
+        total.min_y = accums[i].min_y < total.min_y ? accums[i].min_y
+                                                    : total.min_y;
+        total.max_y = accums[i].max_y;
+    }
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+
+    result->differing_pixels = total.differing;
+    result->identical = total.differing == 0;
+    result->max_error = (uint8_t)total.max_error;
+    for(size_t c = 0; c < result->channels; c++)
+    {
+        double peak = job.bytes == 2 ? (c == 3 ? 1.0 : 31.0) : 255.0;
+        result->mse[c] = (double)total.sq[c] / ((double)width * height);
+        result->psnr[c] = _psnr(result->mse[c], peak);
+    }
+
+    if(!result->identical)
+    {
+        /* Convert a's stored coordinates to a top-left origin. */
+        size_t min_x = total.min_x, max_x = total.max_x;
+        size_t min_y = total.min_y, max_y = total.max_y;
+        if(a->_meta->image_descriptor & TGA_ORIGIN_RIGHT)
+        {
+            min_x = width - 1 - total.max_x;
+            max_x = width - 1 - total.min_x;
+        }
+        if(!(a->_meta->image_descriptor & TGA_ORIGIN_TOP))
+        {
+            min_y = height - 1 - total.max_y;
+            max_y = height - 1 - total.min_y;
+        }
+        result->min_x = (uint16_t)min_x;
+        result->min_y = (uint16_t)min_y;
+        result->max_x = (uint16_t)max_x;
+        result->max_y = (uint16_t)max_y;
+    }
+    return 1;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 0;
+}
@@ -0,0 +1,446 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/* Conversions between pixel formats and storage layouts. */
+
+/*
+ * Creates an image of the same type as `image` with the given depth and size,
+ * carrying over the version, offsets, descriptor, compression setting and ID
+ * field. Pixels are left zeroed.
+ */
+TGAImage *_tga_derive_image(TGAImage *image, uint8_t depth, uint16_t width,
+                            uint16_t height)
+{
+    TGAImage *out = new_tga_image(image->_meta->image_type, depth, width,
+                                  height);
+    check(out, tga_error(), "Unable to create image.");
+    out->version = image->version;
+    out->_meta->x_offset = image->_meta->x_offset;
+    out->_meta->y_offset = image->_meta->y_offset;
+    out->_meta->compression = image->_meta->compression;
+    out->_meta->image_descriptor = image->_meta->image_descriptor;
+    if(image->_meta->id_length && image->id_field)
+    {
+        out->id_field = _tga_malloc(image->_meta->id_length);
+        check(out->id_field, TGA_MEM_ERR, "Unable to copy ID field.");
+        memcpy(out->id_field, image->id_field, image->_meta->id_length);
+        out->_meta->id_length = image->_meta->id_length;
+    }
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
+/* Attribute (alpha) bits an image with bits at depth from declares at to. */
+uint8_t _tga_converted_attribute_bits(uint8_t bits, uint8_t from, uint8_t to)
+{
+    if(to == 24 || bits == 0)
+        return 0;
+    if(to == 16)
+        return 1;
+    return from == 32 ? bits : 8;
+}
+
+/*
+ * Returns a copy of a truecolor image converted to another of the 16, 24 and
+ * 32-bit depths. Alpha is opaque when added, and the ID field, offsets,
+ * origin and compression setting carry over.
+ */
+TGAImage *tga_convert_depth(TGAImage *image, uint8_t depth)
+{
+    TGAImage *out = NULL;
+    size_t in_bytes = 0, out_bytes = 0, pixels = 0, rows = 0, width = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(image->_meta->image_type == TGA_TRUECOLOR, TGA_TYPE_ERR,
+            "Only truecolor images can change depth.");
+    check(depth == 16 || depth == 24 || depth == 32, TGA_ARG_ERR,
+            "Unsupported target depth %u.", depth);
+    check(image->_meta->pixel_depth == 16 || image->_meta->pixel_depth == 24 ||
+            image->_meta->pixel_depth == 32, TGA_UNSUPPORTED,
+            "Unsupported source depth %u.", image->_meta->pixel_depth);
+
+    out = _tga_derive_image(image, depth, image->_meta->width,
+                            image->_meta->height);
+    check(out, tga_error(), "Unable to create converted image.");
+    out->_meta->image_descriptor = (uint8_t)(
+        (image->_meta->image_descriptor & (TGA_ORIGIN_RIGHT | TGA_ORIGIN_TOP)) |
+        _tga_converted_attribute_bits(image->_meta->image_descriptor & 15,
+                                      image->_meta->pixel_depth, depth));
+
+    pixels = (size_t)image->_meta->width * image->_meta->height;
+    if(pixels == 0)
+        return out;
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+    in_bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    out_bytes = _tga_bytes_per_pixel(depth);
+    /* Views of a larger image are converted a row at a time. */
+    if(_tga_row_stride(image) == _tga_row_bytes(image))
+        rows = 1, width = pixels;
+    else
+        rows = image->_meta->height, width = image->_meta->width;
+    for(size_t y = 0; y < rows; y++)
+    {
+        const uint8_t *in = image->data + y * _tga_row_stride(image);
+        uint8_t *dst = out->data + y * width * out_bytes;
+        if(in_bytes == out_bytes)
+        {
+            memcpy(dst, in, width * in_bytes);
+            continue;
+        }
+        for(size_t i = 0; i < width; i += 256)
+        {
+            uint8_t bgra[256 * 4];
+            size_t count = width - i < 256 ? width - i : 256;
+            _tga_unpack_bgra(bgra, in + i * in_bytes, count, in_bytes);
+            _tga_pack_bgra(dst + i * out_bytes, bgra, count, out_bytes);
+        }
+    }
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
+/*
+ * Changes the origin an image is stored with. Pixels are reordered to match,
+ * so the image looks the same; only the storage order changes.
+ */
+uint8_t tga_set_origin(TGAImage *image, uint8_t right, uint8_t top)
+{
+    uint8_t wanted = 0, change = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    wanted = (uint8_t)((right ? TGA_ORIGIN_RIGHT : 0) |
+                       (top ? TGA_ORIGIN_TOP : 0));
+    change = (image->_meta->image_descriptor ^ wanted) &
+             (TGA_ORIGIN_RIGHT | TGA_ORIGIN_TOP);
+    check(_tga_flip_stored(image, change & TGA_ORIGIN_TOP,
+                           change & TGA_ORIGIN_RIGHT), tga_error(),
+            "Unable to reorder pixels.");
+
+    image->_meta->image_descriptor = (uint8_t)(
+        (image->_meta->image_descriptor & ~(TGA_ORIGIN_RIGHT | TGA_ORIGIN_TOP)) |
+        wanted);
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Planar (one array per channel) access. Rows are split or joined through
+ * fixed-layout loops with no branches in the body so the compiler turns them
+ * into vector shuffles, and planes that are not wanted go to a scratch row
+ * rather than adding a test per pixel. Float planes are produced from the
+ * 8-bit values with one multiply-add per element, the normalisation folded
+ * into its constants.
+ */
+
+typedef struct {
+    TGAImage *image;
+    void *const *planes;        /* R, G, B, A; NULL entries are skipped. */
+    TGAPlanarType type;
+    float scale[4];
+    float bias[4];
+    size_t chunk_rows;
+    uint8_t **scratch;          /* Four channel rows and a pixel row. */
+} TGAPlanarJob;
+
+/* Splits a stored row into blue, green, red and alpha rows. */
+static void _split_row(const uint8_t *restrict src, size_t width, size_t bytes,
+                       uint8_t *restrict b, uint8_t *restrict g,
+                       uint8_t *restrict r, uint8_t *restrict a)
+{
+    switch(bytes)
+    {
+        case 1:
+            memcpy(r, src, width);
+            break;
+        case 2:
+            for(size_t x = 0; x < width; x++)
+            {
+                uint32_t v = (uint32_t)src[x * 2] | (uint32_t)src[x * 2 + 1] << 8;
+                b[x] = _tga_expand5(v & 31);
+                g[x] = _tga_expand5((v >> 5) & 31);
+                r[x] = _tga_expand5((v >> 10) & 31);
+                a[x] = (uint8_t)(0 - (v >> 15));
+            }
+            break;
+        case 3:
+            for(size_t x = 0; x < width; x++)
+            {
+                b[x] = src[x * 3];
+                g[x] = src[x * 3 + 1];
+                r[x] = src[x * 3 + 2];
+                a[x] = 255;
+            }
+            break;
+        default:
+            for(size_t x = 0; x < width; x++)
+            {
+                b[x] = src[x * 4];
+                g[x] = src[x * 4 + 1];
+                r[x] = src[x * 4 + 2];
+                a[x] = src[x * 4 + 3];
+            }
+            break;
+    }
+}
+
+/* The reverse of _split_row. */
+static void _join_row(uint8_t *restrict dst, size_t width, size_t bytes,
+                      const uint8_t *restrict b, const uint8_t *restrict g,
+                      const uint8_t *restrict r, const uint8_t *restrict a)
+{
+    switch(bytes)
+    {
+        case 1:
+            memcpy(dst, r, width);
+            break;
+        case 2:
+            for(size_t x = 0; x < width; x++)
+            {
+                uint32_t v = _tga_reduce8(b[x]) | _tga_reduce8(g[x]) << 5 |
+                             _tga_reduce8(r[x]) << 10 | (uint32_t)(a[x] >> 7) << 15;
+                dst[x * 2] = (uint8_t)(v & 0xFF);
+                dst[x * 2 + 1] = (uint8_t)(v >> 8);
+            }
+            break;
+        case 3:
+            for(size_t x = 0; x < width; x++)
+            {
+                dst[x * 3] = b[x];
+                dst[x * 3 + 1] = g[x];
+                dst[x * 3 + 2] = r[x];
+            }
+            break;
+        default:
+            for(size_t x = 0; x < width; x++)
+            {
+                dst[x * 4] = b[x];
+                dst[x * 4 + 1] = g[x];
+                dst[x * 4 + 2] = r[x];
+                dst[x * 4 + 3] = a[x];
+            }
+            break;
+    }
+}
+
+static void _u8_to_float(const uint8_t *restrict in, size_t count, float scale,
+                         float bias, float *restrict out)
+{
+    for(size_t x = 0; x < count; x++)
+        out[x] = (float)in[x] * scale + bias;
+}
+
+static void _float_to_u8(const float *restrict in, size_t count, float scale,
+                         float bias, uint8_t *restrict out)
+{
+    for(size_t x = 0; x < count; x++)
+    {
+        float v = in[x] * scale + bias;
+        v = v < 0.0f ? 0.0f : v > 255.0f ? 255.0f : v;
+        out[x] = (uint8_t)(v + 0.5f);
+    }
+}
+
+/* Channel rows of the scratch buffer, in plane (R, G, B, A) order. */
+static void _scratch_channels(TGAPlanarJob *job, size_t chunk,
+                              uint8_t *rows[4])
+{
+    size_t width = job->image->_meta->width;
+    for(size_t c = 0; c < 4; c++)
+        rows[c] = job->scratch[chunk] + c * width;
+}
+
+static void _to_planar_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAPlanarJob *job = ctx;
+    TGAImage *image = job->image;
+    size_t width = image->_meta->width, height = image->_meta->height;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    size_t stride = _tga_row_stride(image);
+    int mirrored = (image->_meta->image_descriptor & TGA_ORIGIN_RIGHT) != 0;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        uint8_t *rows[4], *out[4];
+        uint8_t *pixels = job->scratch[chunk] + 4 * width;
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        _scratch_channels(job, chunk, rows);
+        for(; y < last; y++)
+        {
+            const uint8_t *src = image->data + _tga_stored_row(image, y) * stride;
+            size_t at = y * width;
+            if(mirrored)
+            {
+                _tga_reverse_pixels(pixels, src, width, bytes);
+                src = pixels;
+            }
+            for(size_t c = 0; c < 4; c++)
+            {
+                int direct = job->type == TGA_PLANAR_U8 && job->planes[c];
+                out[c] = direct ? (uint8_t *)job->planes[c] + at : rows[c];
+            }
+            _split_row(src, width, bytes, out[2], out[1], out[0], out[3]);
+            if(_tga_alpha_ignored(bytes, image->_meta->image_descriptor))
+                memset(out[3], 255, width);
+            if(job->type != TGA_PLANAR_F32)
+                continue;
+            /* Monochrome rows only split into the first channel. */
+            for(size_t c = 0; c < (bytes == 1 ? 1u : 4u); c++)
+            {
+                if(job->planes[c])
+                    _u8_to_float(rows[c], width, job->scale[c], job->bias[c],
+                                 (float *)job->planes[c] + at);
+            }
+        }
+    }
+}
+
+static void _from_planar_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAPlanarJob *job = ctx;
+    TGAImage *image = job->image;
+    size_t width = image->_meta->width, height = image->_meta->height;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    size_t stride = _tga_row_stride(image);
+    int mirrored = (image->_meta->image_descriptor & TGA_ORIGIN_RIGHT) != 0;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        uint8_t *rows[4];
+        const uint8_t *in[4];
+        uint8_t *pixels = job->scratch[chunk] + 4 * width;
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        _scratch_channels(job, chunk, rows);
+        /* Missing planes read as black and opaque. */
+        for(size_t c = 0; c < 4; c++)
+        {
+            if(!job->planes[c])
+                memset(rows[c], c == 3 ? 255 : 0, width);
+        }
+        for(; y < last; y++)
+        {
+            uint8_t *dst = image->data + _tga_stored_row(image, y) * stride;
+            size_t at = y * width;
+            for(size_t c = 0; c < 4; c++)
+            {
+                in[c] = rows[c];
+                if(!job->planes[c])
+                    continue;
+                if(job->type == TGA_PLANAR_F32)
+                    _float_to_u8((const float *)job->planes[c] + at, width,
+                                 job->scale[c], job->bias[c], rows[c]);
+                else
+                    in[c] = (const uint8_t *)job->planes[c] + at;
+            }
+            _join_row(mirrored ? pixels : dst, width, bytes,
+                      in[2], in[1], in[0], in[3]);
+            if(mirrored)
+                _tga_reverse_pixels(dst, pixels, width, bytes);
+        }
+    }
+}
+
+static int _run_planar(TGAImage *image, void *const planes[4],
+                       TGAPlanarType type, const TGANormalization *norm,
+                       int to_image)
+{
+    TGAPlanarJob job = {0};
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    size_t width = 0, height = 0, bytes = 0;
+    unsigned threads = 0, chunks = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(planes, TGA_ARG_ERR, "Invalid plane array.");
+    check(type == TGA_PLANAR_U8 || type == TGA_PLANAR_F32, TGA_ARG_ERR,
+            "Unknown plane type %d.", (int)type);
+    check(!norm || type == TGA_PLANAR_F32, TGA_ARG_ERR,
+            "Normalisation needs float planes.");
+    bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    check((image->_meta->image_type == TGA_TRUECOLOR &&
+            (image->_meta->pixel_depth == 16 || image->_meta->pixel_depth == 24 ||
+             image->_meta->pixel_depth == 32)) ||
+            (image->_meta->image_type == TGA_MONOCHROME && bytes == 1),
+            TGA_UNSUPPORTED, "Only 16, 24 and 32-bit truecolor and 8-bit "
+            "monochrome images have planar forms.");
+
+    for(size_t c = 0; c < 4; c++)
+    {
+        float mean = norm ? norm->mean[c] : 0.0f;
+        float std = norm ? norm->std[c] : 1.0f;
+        check(std > 0.0f, TGA_ARG_ERR, "Standard deviation must be positive.");
+        /* Stored value = (v / 255 - mean) / std, and back again. */
+        job.scale[c] = to_image ? 255.0f * std : 1.0f / (255.0f * std);
+        job.bias[c] = to_image ? 255.0f * mean : -mean / std;
+    }
+
+    width = image->_meta->width;
+    height = image->_meta->height;
+    if(width == 0 || height == 0)
+        return 1;
+    check(to_image ? _tga_writable_pixels(image) : _tga_pixels(image),
+            TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    job.image = image;
+    job.planes = planes;
+    job.type = type;
+    threads = _tga_threads_for(width * height * (type == TGA_PLANAR_F32 ? 16 : 4));
+    if(threads > height)
+        threads = (unsigned)height;
+    chunks = threads;
+    job.chunk_rows = (height + chunks - 1) / chunks;
+    job.scratch = scratch;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        scratch[i] = _tga_malloc(width * 4 + width * bytes);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+    }
+
+    _tga_parallel_for(chunks, threads,
+                      to_image ? _from_planar_chunks : _to_planar_chunks, &job);
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 1;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    return 0;
+}
+
+/*
+ * Copies the pixels of an image into separate R, G, B and A planes of
+ * width * height elements each, in top-left row order whatever the stored
+ * origin. 16-bit channels are scaled to 8 bits and images without alpha give
+ * an opaque plane. Monochrome images only fill planes[0]. Float planes hold
+ * values in [0, 1], normalised per channel when norm is given.
+ */
+int tga_to_planar(TGAImage *image, void *const planes[4], TGAPlanarType type,
+                  const TGANormalization *norm)
+{
+    return _run_planar(image, planes, type, norm, 0);
+}
+
+/*
+ * Fills an existing image from planes laid out as tga_to_planar writes them.
+ * Float values are clamped to [0, 1] after undoing the normalisation; missing
+ * planes are taken as black and opaque.
+ */
+int tga_from_planar(TGAImage *image, void *const planes[4], TGAPlanarType type,
+                    const TGANormalization *norm)
+{
+    return _run_planar(image, planes, type, norm, 1);
+}
@@ -2,28 +2,52 @@
 #include <stdlib.h>
 
 #include "Private/TGAPrivate.h"
+#include "Private/TGAHash.h"
+
+/* Rows read per call when the decoder hashes pixels as it goes. */
+#define TGA_HASH_BLOCK_BYTES ((size_t)256 << 10)
 
 /*
- * The TGA Footer is only present in version 2 of the TGA Specification.
- * This function should be called first to see if the file contains a valid TGA
- * Footer, and thus determine if this is a TGA V2 file, rather than a V1 file.
+ * Work done on rows as soon as they are decoded, while they are still in
+ * cache: hashing for read_tga_image_hashed and tone curves for
+ * read_tga_image_transfer.
  */
-static uint8_t _read_tga_footer(TGAImage *image, FILE *file)
+typedef struct {
+    TGAPixelHasher *hasher;
+    const uint8_t (*lut)[256];
+} TGARowHooks;
+
+static void _rows_decoded(TGARowHooks *hooks, TGAImage *image, size_t first,
+                          size_t count)
 {
-    uint8_t footer_buffer[TGA_FOOTER_SIZE];
-    uint32_t ext_off;
-    uint32_t dev_off;
-    if(!_tga_sanity(image))
-        goto error;
+    if(hooks->lut)
+        _tga_lut_rows(image, hooks->lut, first, count);
+    if(hooks->hasher)
+        for(size_t row = first; row < first + count; row++)
+            _tga_pixel_hasher_row(hooks->hasher, row);
+}
+
+static inline uint16_t _uint16_at(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
 
-    check(fseek(file, -TGA_FOOTER_SIZE, SEEK_END) == 0, TGA_GEN_IO_ERR,
-            "Unable to seek to TGA Footer.");
-    check(fread(&footer_buffer, TGA_FOOTER_SIZE, 1, file) == 1, TGA_READ_ERR,
-            "Unable to read TGA Footer from File.");
+static inline uint32_t _uint32_at(const uint8_t *data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+           (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
 
-    /* If the footer contains the signature "TRUEVISION-XFILE.\0", then it is
-     * a version 2 file. Otherwise, it is random data and is version 1. */
-    if(strncmp(((char *)(footer_buffer + 8)),
+/*
+ * Interprets a 26 byte footer. If it contains the signature
+ * "TRUEVISION-XFILE.\0", then it is a version 2 file. Otherwise, it is random
+ * data and the file is version 1.
+ */
+void _tga_parse_footer(TGAImage *image, const uint8_t *footer_buffer)
+{
+    uint32_t ext_off;
+    uint32_t dev_off;
+    if(strncmp(((const char *)(footer_buffer + 8)),
             TRUEVISION_SIG, __TGA_SIG_SIZE-1) == 0)
     {
         image->version = 2;
@@ -45,7 +69,24 @@ static uint8_t _read_tga_footer(TGAImage *image, FILE *file)
         image->_meta->extension_offset = 0;
         image->_meta->developer_offset = 0;
     }
+}
 
+/*
+ * The TGA Footer is only present in version 2 of the TGA Specification.
+ * This function should be called first to see if the file contains a valid TGA
+ * Footer, and thus determine if this is a TGA V2 file, rather than a V1 file.
+ */
+static uint8_t _read_tga_footer(TGAImage *image, TGASource *src)
+{
+    uint8_t footer_buffer[TGA_FOOTER_SIZE];
+    if(!_tga_sanity(image))
+        goto error;
+
+    check(_tga_source_seek(src, -TGA_FOOTER_SIZE, SEEK_END) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to TGA Footer.");
+    check(_tga_source_read(src, &footer_buffer, TGA_FOOTER_SIZE, 1) == 1,
+            TGA_READ_ERR, "Unable to read TGA Footer from File.");
+    _tga_parse_footer(image, footer_buffer);
     return 1;
 
 error:
@@ -76,53 +117,98 @@ error:
  *      0x11: (1 byte) ImageDescriptor
  * Total Size: 18 Bytes
  */
-static int _read_tga_header(TGAImage *image, FILE *file)
+void _tga_parse_header(TGAImage *image, const uint8_t *data)
+{
+    image->_meta->id_length = data[0];
+    image->_meta->c_map_type = data[1];
+    image->_meta->image_type = data[2];
+    image->_meta->c_map_start = (uint16_t)(data[3] | (data[4] << 8));
+    image->_meta->c_map_length = (uint16_t)(data[5] | (data[6] << 8));
+    image->_meta->c_map_depth = data[7];
+    image->_meta->x_offset = (uint16_t)(data[8] | (data[9] << 8));
+    image->_meta->y_offset = (uint16_t)(data[10] | (data[11] << 8));
+    image->_meta->width = (uint16_t)(data[12] | (data[13] << 8));
+    image->_meta->height = (uint16_t)(data[14] | (data[15] << 8));
+    image->_meta->pixel_depth = data[16];
+    image->_meta->image_descriptor = data[17];
+}
+
+static int _read_tga_header(TGAImage *image, TGASource *src)
 {
     uint8_t data[TGA_HEADER_SIZE] = {0};
 
     /* Sanity Checks */
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    check(file, TGA_INV_FILE_PNT, "Invalid File Pointer Passed.");
+    check(src, TGA_INV_FILE_PNT, "Invalid File Pointer Passed.");
     /* Ensure that we are at the beginning of the file. */
-    check(fseek(file, 0, SEEK_SET) == 0, TGA_GEN_IO_ERR,
+    check(_tga_source_seek(src, 0, SEEK_SET) == 0, TGA_GEN_IO_ERR,
             "Unable to seek to beginning of file.");
 
-    check(fread(&data, TGA_HEADER_SIZE, 1, file) == 1, TGA_READ_ERR,
+    check(_tga_source_read(src, &data, TGA_HEADER_SIZE, 1) == 1, TGA_READ_ERR,
             "Unable to read file.");
-    image->_meta->id_length = data[0];
-    image->_meta->c_map_type = data[1];
-    image->_meta->image_type = data[2];
-    image->_meta->c_map_start = *((uint16_t*)(data+3));
-    image->_meta->c_map_length = *((uint16_t*)(data+5));
-    image->_meta->c_map_depth = data[7];
-    image->_meta->x_offset = *((uint16_t*)(data+8));
-    image->_meta->y_offset = *((uint16_t*)(data+10));
-    image->_meta->width = *((uint16_t*)(data+12));
-    image->_meta->height = *((uint16_t*)(data+14));
-    image->_meta->pixel_depth = data[16];
-    image->_meta->image_descriptor = data[17];
+    _tga_parse_header(image, data);
     return 1;
 
 error:
     return 0;
 }
 
-static int _read_tga_id_field(TGAImage *image, FILE *file)
+/*
+ * The TGA 2.0 extension area. Of its fields only the gamma value (offset 478)
+ * and the colour correction table (offset 482 holds its file offset) are
+ * kept. Areas shorter than the 2.0 size predate those fields and are skipped.
+ */
+static int _read_tga_extension(TGAImage *image, TGASource *src)
 {
-    check(file, TGA_INV_FILE_PNT, "Invalid File.");
+    uint8_t area[TGA_EXTENSION_SIZE];
+    uint8_t table[TGA_COLOR_CORRECTION_SIZE];
+    uint32_t table_offset = 0;
+    uint16_t *entries = NULL;
+
+    check(_tga_source_seek(src, (long)image->_meta->extension_offset,
+            SEEK_SET) == 0, TGA_GEN_IO_ERR,
+            "Unable to seek to extension area.");
+    check(_tga_source_read(src, area, TGA_EXTENSION_SIZE, 1) == 1,
+            TGA_READ_ERR, "Unable to read extension area.");
+    if(_uint16_at(area) < TGA_EXTENSION_SIZE)
+        return 1;
+    image->_meta->gamma_numerator = _uint16_at(area + 478);
+    image->_meta->gamma_denominator = _uint16_at(area + 480);
+
+    table_offset = _uint32_at(area + 482);
+    if(table_offset == 0)
+        return 1;
+    check(_tga_source_seek(src, (long)table_offset, SEEK_SET) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to color correction table.");
+    check(_tga_source_read(src, table, TGA_COLOR_CORRECTION_SIZE, 1) == 1,
+            TGA_READ_ERR, "Unable to read color correction table.");
+    entries = _tga_malloc(TGA_COLOR_CORRECTION_SIZE);
+    check(entries, TGA_MEM_ERR, "Unable to allocate color correction table.");
+    for(size_t i = 0; i < TGA_COLOR_CORRECTION_SIZE / 2; i++)
+        entries[i] = _uint16_at(table + i * 2);
+    image->_meta->color_correction = entries;
+    return 1;
+error:
+    return 0;
+}
+
+static int _read_tga_id_field(TGAImage *image, TGASource *src)
+{
+    check(src, TGA_INV_FILE_PNT, "Invalid File.");
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     check(image->_meta->id_length != 0, TGA_INTERNAL_ERR,
             "TGA Image ID Length is 0. This should not have been called.");
 
-    image->id_field = malloc(image->_meta->id_length);
+    image->id_field = _tga_malloc(image->_meta->id_length);
     check(image->id_field, TGA_MEM_ERR,
             "Unable to allocate memory for TGA ID Field.");
 
-    if(ftell(file) != TGA_HEADER_SIZE)
-        check(fseek(file, TGA_HEADER_SIZE, SEEK_SET) == 0, TGA_GEN_IO_ERR,
-                "Unable to seek to ID Field.");
+    if(_tga_source_tell(src) != TGA_HEADER_SIZE)
+        check(_tga_source_seek(src, TGA_HEADER_SIZE, SEEK_SET) == 0,
+                TGA_GEN_IO_ERR, "Unable to seek to ID Field.");
 
-    check(fread(image->id_field, image->_meta->id_length, 1, file) == 1,
+    check(_tga_source_read(src, image->id_field, image->_meta->id_length,
+                1) == 1,
             TGA_READ_ERR, "Unable to read ID Field from file.");
     return 1;
 
@@ -138,181 +224,552 @@ error:
     return 0;
 }
 
-static int _read_tga_color_map(TGAImage *image, FILE *file)
+/* File offset of the first byte of pixel data. */
+static long _pixel_data_offset(TGAImage *image)
+{
+    return (long)(TGA_HEADER_SIZE + image->_meta->id_length +
+                  _tga_color_map_bytes(image) + image->_meta->c_map_start);
+}
+
+static int _read_tga_color_map(TGAImage *image, TGASource *src)
 {
-    uint16_t c_map_size = 0;
-    uint16_t start = 0;
+    size_t c_map_size = 0;
+    long start = 0;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    check(file, TGA_INV_FILE_PNT, "Invalid File Pointer.");
+    check(src, TGA_INV_FILE_PNT, "Invalid File Pointer.");
     check(image->_meta->image_type == TGA_COLOR_MAPPED, TGA_INTERNAL_ERR,
             "Image is not color-mapped. This should not have been called.");
-    c_map_size = ((image->_meta->c_map_depth+7)/8) * image->_meta->c_map_length;
+    c_map_size = _tga_color_map_bytes(image);
     check(c_map_size > 0, TGA_COLOR_MAP_ERR, "Image claims color map, but "
             "map is of size 0.");
 
     start = TGA_HEADER_SIZE + image->_meta->id_length +
             image->_meta->c_map_start;
-    check(fseek(file, start, SEEK_SET) == 0, TGA_GEN_IO_ERR,
+    check(_tga_source_seek(src, start, SEEK_SET) == 0, TGA_GEN_IO_ERR,
             "Unable to seek to color map start.");
 
-    image->color_map = malloc(sizeof(uint8_t) * c_map_size);
+    image->color_map = _tga_malloc(sizeof(uint8_t) * c_map_size);
     check(image->color_map, TGA_MEM_ERR, "Unable to allocate color map.");
-    check(fread(image->color_map, c_map_size, 1, file) == 1, TGA_READ_ERR,
-            "Unable to read Color Map.");
+    check(_tga_source_read(src, image->color_map, c_map_size, 1) == 1,
+            TGA_READ_ERR, "Unable to read Color Map.");
     return 1;
 error:
     return 0;
 }
 
+/*
+ * Packets are decoded against the image as a whole rather than per scanline:
+ * version 1 writers were allowed to let packets run across scanlines, and a
+ * packet claiming more pixels than remain in the image is rejected instead of
+ * being written past the end of the buffer.
+ */
 /* TODO: Implement Reading Color-Mapped Encoded Images. */
-static int _read_encoded_tga_image_data(TGAImage *image, FILE *file)
+static int _read_encoded_tga_image_data(TGAImage *image, TGASource *src,
+                                        TGARowHooks *hooks)
 {
-    uint16_t line = 0;
-    uint32_t offset = (uint32_t)TGA_HEADER_SIZE + image->_meta->id_length +
-            (image->_meta->c_map_length * (image->_meta->c_map_depth/8)) +
-            image->_meta->c_map_start;
-    uint8_t depth = (uint8_t)((image->_meta->pixel_depth+7)/8);
-    uint32_t total = image->_meta->width * image->_meta->height * depth;
+    size_t depth = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    size_t total = 0;
+    size_t pixels = (size_t)image->_meta->width * image->_meta->height;
+    size_t position = 0; /* In Pixels, Not Bytes */
     uint8_t packet = 0;
-    uint8_t current_packet_cnt = 0;
-    uint16_t current_line_pos = 0;
-    uint8_t current_pixel = 0;
-    uint32_t data_offset = 0;
-    uint8_t *run_packet = malloc(sizeof(uint8_t)*depth);
+    size_t current_packet_cnt = 0;
+    size_t current_pixel = 0;
+    size_t done_rows = 0;
+    uint8_t *out = NULL;
+    uint8_t run_packet[4];
 
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    check(file, TGA_INV_FILE_PNT, "Invalid File Pointer.");
+    check(src, TGA_INV_FILE_PNT, "Invalid File Pointer.");
     check(image->_meta->image_type != TGA_ENCODED_COLOR_MAPPED, TGA_UNSUPPORTED,
             "Unfortunately, Encoded Color Map Images are not supported yet.");
     check(image->_meta->image_type == TGA_ENCODED_TRUECOLOR ||
             image->_meta->image_type == TGA_ENCODED_MONOCHROME,
             TGA_INTERNAL_ERR, "Not encoded image. Should not have been called");
-    check(fseek(file, offset, SEEK_SET) == 0, TGA_GEN_IO_ERR,
-            "Unable to seek to data begining.");
+    check(depth >= 1 && depth <= sizeof(run_packet), TGA_UNSUPPORTED,
+            "Unsupported pixel depth %u.", image->_meta->pixel_depth);
+    check(_tga_pixel_bytes(image->_meta->width, image->_meta->height,
+            image->_meta->pixel_depth, &total), TGA_MEM_ERR,
+            "Image dimensions are too large.");
+    check(_tga_source_seek(src, _pixel_data_offset(image), SEEK_SET) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to data begining.");
+
+    check(_tga_alloc_pixels(image, total, false), tga_error(),
+            "Unable to allocate image data.");
+
+    while(position < pixels)
+    {
+        check(_tga_source_read(src, &packet, sizeof(packet), 1) == 1,
+                TGA_READ_ERR, "Failed to read packet");
+        current_packet_cnt = (size_t)(packet & 127) + 1; /* Also in Pixels */
+        check(current_packet_cnt <= pixels - position, TGA_READ_ERR,
+                "RLE packet runs past the end of the image.");
 
-    image->data = malloc(sizeof(uint8_t) * total);
+        /* Offset from beginning, in bytes, hence multiply by depth */
+        out = image->data + position * depth;
 
-    for(line = 0; line < image->_meta->height-1; line++)
-    {
-        current_line_pos = 0; /* In Pixels, Not Bytes */
-        while(current_line_pos < image->_meta->width)
+        if(packet & 128) /*X & 10000000b */
         {
-            check(fread(&packet, sizeof(packet), 1, file) == 1,
-                    TGA_READ_ERR, "Failed to read packet");
-            current_packet_cnt = (packet & 127) + 1; /* Also in Pixels */
-
-            /* Offset from beginning, in bytes, hence multiply by depth */
-            data_offset = (current_line_pos + (line*image->_meta->width))*depth;
+            /* Run-length packet, copy the following value count times */
+            check(_tga_source_read(src, run_packet, depth, 1) == 1,
+                    TGA_READ_ERR, "Failed to read RLE pixel packet.");
+            stat_add(rle_run_packets, 1);
+            stat_add(rle_run_pixels, current_packet_cnt);
+            for(current_pixel = 0; current_pixel < current_packet_cnt;
+                current_pixel++)
+                memcpy(out + (depth*current_pixel), run_packet, depth);
+        }
+        else
+        {
+            /* Raw-packet, read the following cnt values */
+            check(_tga_source_read(src, out, depth, current_packet_cnt) ==
+                        current_packet_cnt,
+                    TGA_READ_ERR, "Unable to read Raw Pixel Values.");
+            stat_add(rle_raw_packets, 1);
+            stat_add(rle_raw_pixels, current_packet_cnt);
+        }
+        position += current_packet_cnt;
 
-            if(packet & 128) /*X & 10000000b */
-            {
-                /* Run-length packet, copy the following value count times */
-                check(fread(run_packet, depth, 1, file) == 1, TGA_READ_ERR,
-                        "Failed to read RLE pixel packet.");
-                for(current_pixel = 0; current_pixel < current_packet_cnt; current_pixel++)
-                    memcpy(image->data+data_offset+(depth*current_pixel),
-                            run_packet, depth);
-            }
-            else
-            {
-                /* Raw-packet, read the following cnt values */
-                check(fread(image->data+data_offset, depth,
-                            current_packet_cnt, file) == current_packet_cnt,
-                        TGA_READ_ERR, "Unable to read Raw Pixel Values.");
-            }
-            current_line_pos += current_packet_cnt;
+        /* Finish rows as soon as they are complete, while still in cache. */
+        if(hooks && done_rows < position / image->_meta->width)
+        {
+            size_t rows = position / image->_meta->width;
+            _rows_decoded(hooks, image, done_rows, rows - done_rows);
+            done_rows = rows;
         }
     }
     return 1;
 error:
-    if(image->data)
-        free(image->data);
+    _tga_free_pixels(image);
     return 0;
 }
 
-static int _read_unencoded_tga_image_data(TGAImage *image, FILE *file)
+static int _read_unencoded_tga_image_data(TGAImage *image, TGASource *src,
+                                          TGARowHooks *hooks)
 {
+    size_t total = 0;
+    size_t stride = 0;
+    size_t block = 0;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    if(image->data)
-        free(image->data);
-    check(file, TGA_INV_FILE_PNT, "Invalid File Pointer passed.");
-    int32_t offset = (uint32_t)TGA_HEADER_SIZE + image->_meta->id_length +
-            (image->_meta->c_map_length * (image->_meta->c_map_depth/8)) +
-            image->_meta->c_map_start;
-    check(fseek(file, offset, SEEK_SET) == 0, TGA_GEN_IO_ERR,
-            "Unable to seek to data offset.");
-
-    uint8_t depth_mult = (uint8_t)((image->_meta->pixel_depth+7) / 8);
-    uint32_t pixels = image->_meta->width * image->_meta->height;
-    image->data = malloc(sizeof(uint8_t) * pixels * depth_mult);
-    check(image->data, TGA_MEM_ERR, "Unable to allocate image data.");
-    check(fread(image->data, pixels * depth_mult, 1, file) == 1, TGA_READ_ERR,
-            "Unable to read image pixel data.");
+    check(src, TGA_INV_FILE_PNT, "Invalid File Pointer passed.");
+    check(_tga_source_seek(src, _pixel_data_offset(image), SEEK_SET) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to data offset.");
+
+    check(_tga_pixel_bytes(image->_meta->width, image->_meta->height,
+            image->_meta->pixel_depth, &total), TGA_MEM_ERR,
+            "Image dimensions are too large.");
+    check(_tga_alloc_pixels(image, total, false), tga_error(),
+            "Unable to allocate image data.");
+    if(!hooks || total == 0)
+    {
+        check(total == 0 || _tga_source_read(src, image->data, total, 1) == 1,
+                TGA_READ_ERR, "Unable to read image pixel data.");
+        return 1;
+    }
 
+    /* Read in blocks of rows and finish each block before reading the next. */
+    stride = _tga_row_stride(image);
+    block = TGA_HASH_BLOCK_BYTES / stride ? TGA_HASH_BLOCK_BYTES / stride : 1;
+    for(size_t row = 0; row < image->_meta->height; row += block)
+    {
+        size_t rows = image->_meta->height - row < block ?
+                      image->_meta->height - row : block;
+        check(_tga_source_read(src, image->data + row * stride, stride * rows,
+                1) == 1, TGA_READ_ERR, "Unable to read image pixel data.");
+        _rows_decoded(hooks, image, row, rows);
+    }
     return 1;
 
 error:
-    if(image->data)
-        free(image->data);
-    image->data = NULL;
+    _tga_free_pixels(image);
     return 0;
 }
 
-/* Most errors in this subroutine are already set by the lower-level functions.
- * So the error is set using tga_error() to fetch the existing error. */
-/* TODO: Implement reading for Encoded TGA Images. */
-/* TODO: Implement reading for developer/extension areas. */
-TGAImage *read_tga_image(FILE *file)
+/*
+ * Everything but the pixels: footer, header, extension area, developer
+ * directory, ID field and color map.
+ */
+static int _read_tga_metadata(TGAImage *image, TGASource *src)
 {
-    TGAImage *image = NULL;
-
-    check(file, TGA_INV_FILE_PNT, "Invalid file passed.");
-
-    image = new_tga_image(TGA_NO_DATA, 0, 0, 0);
-    check(image, tga_error(), "Unable to create new TGAImage.");
-    check(_read_tga_footer(image, file), tga_error(),
-            "Unable to read TGA Footer.");
-    check(_read_tga_header(image, file), tga_error(),
-            "Unable to read TGA Header.");
+    check(staged(TGA_STAGE_FOOTER, _read_tga_footer(image, src)),
+            tga_error(), "Unable to read TGA Footer.");
+    check(staged(TGA_STAGE_HEADER, _read_tga_header(image, src)),
+            tga_error(), "Unable to read TGA Header.");
+
+    /* A damaged extension area is treated as absent, as in 1.0 files. */
+    if(image->version == 2 && image->_meta->extension_offset &&
+        !_read_tga_extension(image, src))
+    {
+        image->_meta->gamma_numerator = 0;
+        image->_meta->gamma_denominator = 0;
+        free(image->_meta->color_correction);
+        image->_meta->color_correction = NULL;
+        tga_clear_error();
+    }
+    /* Likewise a developer directory that cannot be read is dropped. */
+    if(image->version == 2 && image->_meta->developer_offset &&
+        !_tga_read_developer_directory(image, src))
+    {
+        free(image->_meta->developer_tags);
+        image->_meta->developer_tags = NULL;
+        image->_meta->developer_tag_count = 0;
+        tga_clear_error();
+    }
 
     if(image->_meta->id_length)
-        check(_read_tga_id_field(image, file), tga_error(),
-                "Unable to read TGA ID Field.");
+        check(staged(TGA_STAGE_ID, _read_tga_id_field(image, src)),
+                tga_error(), "Unable to read TGA ID Field.");
     else
         image->id_field = NULL;
 
     if(image->_meta->image_type == TGA_COLOR_MAPPED)
-        check(_read_tga_color_map(image, file), tga_error(),
-            "Unable to read TGA ColorMap Data.");
+        check(staged(TGA_STAGE_COLOR_MAP, _read_tga_color_map(image, src)),
+                tga_error(), "Unable to read TGA ColorMap Data.");
+    return 1;
+error:
+    return 0;
+}
 
+/* Reads the pixels; RLE image types become their unencoded counterparts. */
+static int _read_tga_pixels(TGAImage *image, TGASource *src,
+                            TGARowHooks *finishing)
+{
     switch(image->_meta->image_type)
     {
         case TGA_ENCODED_TRUECOLOR:
-            check(_read_encoded_tga_image_data(image, file), tga_error(),
+            check(staged(TGA_STAGE_PIXELS,
+                    _read_encoded_tga_image_data(image, src, finishing)), tga_error(),
                     "Unable to read Encoded Truecolor TGA Image Data.");
             image->_meta->image_type = TGA_TRUECOLOR;
             break;
         case TGA_ENCODED_MONOCHROME:
-            check(_read_encoded_tga_image_data(image, file), tga_error(),
+            check(staged(TGA_STAGE_PIXELS,
+                    _read_encoded_tga_image_data(image, src, finishing)), tga_error(),
                     "Unable to read Encoded Monochrome TGA Image Data.");
             image->_meta->image_type = TGA_MONOCHROME;
             break;
         case TGA_TRUECOLOR:
         case TGA_MONOCHROME:
         case TGA_COLOR_MAPPED:
-            check(_read_unencoded_tga_image_data(image, file), tga_error(),
+            check(staged(TGA_STAGE_PIXELS,
+                    _read_unencoded_tga_image_data(image, src, finishing)),
+                    tga_error(),
                     "Unable to read TGA Image Data.");
             break;
         default:
             fail(TGA_UNSUPPORTED, "Unsupported TGA Format.");
     }
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Streaming access for the row pipeline: the metadata is read into image and
+ * the source is left at the pixels, which _tga_row_reader_read then decodes a
+ * block of stored rows at a time into the caller's buffer. RLE packets that
+ * continue past a block are carried over to the next call.
+ */
+int _tga_row_reader_open(TGARowReader *reader, TGAImage *image,
+                         TGASource *src)
+{
+    memset(reader, 0, sizeof(*reader));
+    check(_read_tga_metadata(image, src), tga_error(),
+            "Unable to read TGA metadata.");
+    switch(image->_meta->image_type)
+    {
+        case TGA_ENCODED_TRUECOLOR:
+        case TGA_ENCODED_MONOCHROME:
+            reader->encoded = 1;
+            break;
+        case TGA_TRUECOLOR:
+        case TGA_MONOCHROME:
+            break;
+        default:
+            fail(TGA_UNSUPPORTED, "Only truecolor and monochrome images can "
+                    "be streamed.");
+    }
+    reader->src = src;
+    reader->width = image->_meta->width;
+    reader->bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    reader->remaining = (size_t)image->_meta->width * image->_meta->height;
+    check(reader->bytes >= 1 && reader->bytes <= sizeof(reader->value),
+            TGA_UNSUPPORTED, "Unsupported pixel depth %u.",
+            image->_meta->pixel_depth);
+    check(_tga_source_seek(src, _pixel_data_offset(image), SEEK_SET) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to data offset.");
+    return 1;
+error:
+    return 0;
+}
+
+int _tga_row_reader_read(TGARowReader *reader, uint8_t *out, size_t rows)
+{
+    size_t pixels = rows * reader->width, position = 0;
+    size_t bytes = reader->bytes;
+
+    if(!reader->encoded)
+    {
+        check(pixels == 0 || _tga_source_read(reader->src, out, pixels * bytes,
+                1) == 1, TGA_READ_ERR, "Unable to read image pixel data.");
+        return 1;
+    }
+    while(position < pixels)
+    {
+        size_t count = 0;
+        if(reader->left == 0)
+        {
+            uint8_t packet = 0;
+            check(_tga_source_read(reader->src, &packet, 1, 1) == 1,
+                    TGA_READ_ERR, "Failed to read packet");
+            reader->left = (size_t)(packet & 127) + 1;
+            reader->run = (packet & 128) != 0;
+            check(reader->left <= reader->remaining, TGA_READ_ERR,
+                    "RLE packet runs past the end of the image.");
+            reader->remaining -= reader->left;
+            if(reader->run)
+            {
+                check(_tga_source_read(reader->src, reader->value, bytes, 1)
+                        == 1, TGA_READ_ERR, "Failed to read RLE pixel packet.");
+                stat_add(rle_run_packets, 1);
+                stat_add(rle_run_pixels, reader->left);
+            }
+            else
+            {
+                stat_add(rle_raw_packets, 1);
+                stat_add(rle_raw_pixels, reader->left);
+            }
+        }
+        count = reader->left < pixels - position ? reader->left
+                                                 : pixels - position;
+        if(reader->run)
+            for(size_t i = 0; i < count; i++)
+                memcpy(out + (position + i) * bytes, reader->value, bytes);
+        else
+            check(_tga_source_read(reader->src, out + position * bytes, bytes,
+                    count) == count, TGA_READ_ERR,
+                    "Unable to read Raw Pixel Values.");
+        position += count;
+        reader->left -= count;
+    }
+    return 1;
+error:
+    return 0;
+}
+
+/* Most errors in this subroutine are already set by the lower-level functions.
+ * So the error is set using tga_error() to fetch the existing error. */
+static TGAImage *_read_tga_image(TGASource *src, TGAHashFormat format,
+                                 uint64_t *hash, const TGATransfer *transfer)
+{
+    TGAImage *image = NULL;
+    TGAPixelHasher hasher = { NULL, TGA_HASH_NATIVE, NULL, NULL };
+    TGARowHooks hooks = { NULL, NULL };
+    TGARowHooks *finishing = NULL;
+    uint8_t lut[4][256];
 
+    image = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    check(image, tga_error(), "Unable to create new TGAImage.");
+    check(_read_tga_metadata(image, src), tga_error(),
+            "Unable to read TGA metadata.");
+
+    if(hash)
+    {
+        check(_tga_pixel_hasher_init(&hasher, image, format), tga_error(),
+                "Unable to start pixel hash.");
+        hooks.hasher = &hasher;
+        finishing = &hooks;
+    }
+    if(transfer)
+    {
+        check(image->_meta->image_type == TGA_TRUECOLOR ||
+                image->_meta->image_type == TGA_MONOCHROME ||
+                image->_meta->image_type == TGA_ENCODED_TRUECOLOR ||
+                image->_meta->image_type == TGA_ENCODED_MONOCHROME,
+                TGA_UNSUPPORTED,
+                "Only truecolor and monochrome images can be corrected.");
+        check(tga_build_lut(image, *transfer, lut), tga_error(),
+                "Unable to build transfer table.");
+        hooks.lut = (const uint8_t (*)[256])lut;
+        finishing = &hooks;
+    }
+    check(_read_tga_pixels(image, src, finishing), tga_error(),
+            "Unable to read TGA pixels.");
+
+    if(hash)
+    {
+        *hash = _tga_pixel_hasher_final(&hasher);
+        _tga_pixel_hasher_free(&hasher);
+    }
     return image;
 
 error:
-    if(image)
+    _tga_pixel_hasher_free(&hasher);
+    free_tga_image(image);
+    return NULL;
+}
+
+/*
+ * Lazy opening. Only the metadata is read; the source is kept so the pixels
+ * can be read on first use, and again after tga_release_pixels. The image
+ * reports the type it will have once decoded.
+ */
+static TGAImage *_open_tga_image(TGASource *src)
+{
+    TGAImage *image = NULL;
+    TGALazySource *lazy = NULL;
+
+    image = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    check(image, tga_error(), "Unable to create new TGAImage.");
+    lazy = _tga_malloc(sizeof(TGALazySource));
+    check(lazy, TGA_MEM_ERR, "Unable to allocate lazy image source.");
+    lazy->src = *src;
+    lazy->stored_type = 0;
+    image->_meta->lazy = lazy;
+    check(_read_tga_metadata(image, &lazy->src), tga_error(),
+            "Unable to read TGA metadata.");
+
+    lazy->stored_type = image->_meta->image_type;
+    switch(image->_meta->image_type)
+    {
+        case TGA_ENCODED_TRUECOLOR:
+            image->_meta->image_type = TGA_TRUECOLOR;
+            break;
+        case TGA_ENCODED_MONOCHROME:
+            image->_meta->image_type = TGA_MONOCHROME;
+            break;
+        case TGA_TRUECOLOR:
+        case TGA_MONOCHROME:
+        case TGA_COLOR_MAPPED:
+            break;
+        default:
+            fail(TGA_UNSUPPORTED, "Unsupported TGA Format.");
+    }
+    return image;
+
+error:
+    if(image && image->_meta->lazy)
+        image->_meta->lazy->src.file = NULL; /* Still the caller's to close. */
+    free_tga_image(image);
+    return NULL;
+}
+
+/*
+ * Decodes the pixels of an image from open_tga_image if they are not already
+ * present. Images with their pixels, and images that were never opened
+ * lazily, are left alone.
+ */
+int tga_materialize(TGAImage *image)
+{
+    TGALazySource *lazy = NULL;
+    uint8_t type = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    lazy = image->_meta->lazy;
+    if(image->data || !lazy)
+        return 1;
+    type = image->_meta->image_type;
+    image->_meta->image_type = lazy->stored_type;
+    if(!_read_tga_pixels(image, &lazy->src, NULL))
     {
-        free(image);
+        image->_meta->image_type = type;
+        return 0;
     }
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Frees the pixels of a lazily opened image; they are read again on next use.
+ * Changes made to the pixels are lost.
+ */
+int tga_release_pixels(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(image->_meta->lazy, TGA_ARG_ERR,
+            "Image was not opened lazily; its pixels cannot be read again.");
+    _tga_free_pixels(image);
+    return 1;
+error:
+    return 0;
+}
+
+TGAImage *open_tga_image(const char *filename)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    TGAImage *image = NULL;
+    check(filename && filename[0] != '\0', TGA_INV_FILE_NAME,
+            "Invalid or Null filename.");
+    src.file = fopen(filename, "rb");
+    check(src.file, TGA_INV_FILE_NAME, "Unable to open %.128s.", filename);
+    image = _open_tga_image(&src);
+    if(!image)
+        fclose(src.file);
+    return image;
+error:
+    return NULL;
+}
+
+/* As open_tga_image; buffer must outlive the image. */
+TGAImage *open_tga_image_from_memory(const uint8_t *buffer, size_t length)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    check(buffer, TGA_ARG_ERR, "Invalid buffer passed.");
+    src.buffer = buffer;
+    src.length = length;
+    return _open_tga_image(&src);
+error:
+    return NULL;
+}
+
+TGAImage *read_tga_image(FILE *file)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    check(file, TGA_INV_FILE_PNT, "Invalid file passed.");
+    src.file = file;
+    return _read_tga_image(&src, TGA_HASH_NATIVE, NULL, NULL);
+error:
+    return NULL;
+}
+
+/*
+ * Reads an image and computes tga_pixel_hash(image, format) on the way, one
+ * block of rows at a time, so the pixels are hashed while still in cache.
+ */
+TGAImage *read_tga_image_hashed(FILE *file, TGAHashFormat format,
+                                uint64_t *hash)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    check(file, TGA_INV_FILE_PNT, "Invalid file passed.");
+    check(hash, TGA_ARG_ERR, "Invalid hash pointer passed.");
+    src.file = file;
+    return _read_tga_image(&src, format, hash, NULL);
+error:
+    return NULL;
+}
+
+/*
+ * Reads an image and maps it through the given curve (see tga_build_lut) one
+ * block of rows at a time, while the decoded pixels are still in cache.
+ */
+TGAImage *read_tga_image_transfer(FILE *file, TGATransfer transfer)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    check(file, TGA_INV_FILE_PNT, "Invalid file passed.");
+    src.file = file;
+    return _read_tga_image(&src, TGA_HASH_NATIVE, NULL, &transfer);
+error:
+    return NULL;
+}
+
+/* Decodes an image from a buffer holding the complete contents of a file. */
+TGAImage *read_tga_image_from_memory(const uint8_t *buffer, size_t length)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    check(buffer, TGA_ARG_ERR, "Invalid buffer passed.");
+    src.buffer = buffer;
+    src.length = length;
+    return _read_tga_image(&src, TGA_HASH_NATIVE, NULL, NULL);
+error:
     return NULL;
 }
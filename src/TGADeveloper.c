@@ -0,0 +1,304 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#define TGA_HAVE_PREAD 1
+#endif
+
+#include "Private/TGAPrivate.h"
+
+/*
+ * The TGA 2.0 developer area. Its directory is a 16-bit tag count followed by
+ * one 10 byte entry per tag: the tag number, then the file offset and size of
+ * its data, which may lie anywhere in the file. Only the directory is read
+ * with the image, so files carrying large payloads open as fast as any other.
+ */
+
+#define TGA_DEVELOPER_ENTRY_SIZE 10
+
+static inline uint32_t _uint32_at(const uint8_t *data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+           (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static inline void _put_uint16(uint8_t *data, uint16_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+}
+
+static inline void _put_uint32(uint8_t *data, uint32_t value)
+{
+    for(size_t i = 0; i < 4; i++)
+        data[i] = (uint8_t)(value >> (8 * i));
+}
+
+/* Reads count entries at the source's position into a new array. */
+static TGADeveloperTag *_read_entries(TGASource *src, uint16_t count)
+{
+    uint8_t *table = NULL;
+    TGADeveloperTag *tags = NULL;
+
+    table = _tga_malloc((size_t)count * TGA_DEVELOPER_ENTRY_SIZE);
+    check(table, TGA_MEM_ERR, "Unable to allocate developer directory.");
+    tags = _tga_malloc(count * sizeof(TGADeveloperTag));
+    check(tags, TGA_MEM_ERR, "Unable to allocate developer directory.");
+    check(_tga_source_read(src, table, TGA_DEVELOPER_ENTRY_SIZE, count) ==
+            count, TGA_READ_ERR, "Unable to read developer directory.");
+    for(size_t i = 0; i < count; i++)
+    {
+        const uint8_t *entry = table + i * TGA_DEVELOPER_ENTRY_SIZE;
+        tags[i].tag = (uint16_t)(entry[0] | entry[1] << 8);
+        tags[i].offset = _uint32_at(entry + 2);
+        tags[i].size = _uint32_at(entry + 6);
+    }
+    free(table);
+    return tags;
+
+error:
+    free(table);
+    free(tags);
+    return NULL;
+}
+
+int _tga_read_developer_directory(TGAImage *image, TGASource *src)
+{
+    uint8_t count[2];
+    uint16_t n = 0;
+
+    check(_tga_source_seek(src, (long)image->_meta->developer_offset,
+            SEEK_SET) == 0, TGA_GEN_IO_ERR,
+            "Unable to seek to developer area.");
+    check(_tga_source_read(src, count, sizeof(count), 1) == 1, TGA_READ_ERR,
+            "Unable to read developer directory.");
+    n = (uint16_t)(count[0] | count[1] << 8);
+    free(image->_meta->developer_tags);
+    image->_meta->developer_tags = NULL;
+    image->_meta->developer_tag_count = 0;
+    if(n == 0)
+        return 1;
+    image->_meta->developer_tags = _read_entries(src, n);
+    check(image->_meta->developer_tags, tga_error(),
+            "Unable to read developer directory.");
+    image->_meta->developer_tag_count = n;
+    return 1;
+error:
+    return 0;
+}
+
+uint16_t tga_get_developer_tag_count(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    return image->_meta->developer_tag_count;
+error:
+    return 0;
+}
+
+/* The directory in file order, or NULL if the image has none. */
+const TGADeveloperTag *tga_get_developer_tags(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    return image->_meta->developer_tags;
+error:
+    return NULL;
+}
+
+/* First directory entry for tag, or NULL without setting an error. */
+const TGADeveloperTag *tga_find_developer_tag(TGAImage *image, uint16_t tag)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    for(size_t i = 0; i < image->_meta->developer_tag_count; i++)
+        if(image->_meta->developer_tags[i].tag == tag)
+            return &image->_meta->developer_tags[i];
+error:
+    return NULL;
+}
+
+/*
+ * Source a tag of the image can be fetched from. tag must be an entry of the
+ * image's own directory, so its offset and size were read from this file.
+ */
+static TGASource *_tag_source(TGAImage *image, const TGADeveloperTag *tag)
+{
+    size_t i = 0;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    check(tag, TGA_ARG_ERR, "Invalid tag pointer.");
+    while(i < image->_meta->developer_tag_count &&
+          &image->_meta->developer_tags[i] != tag)
+        i++;
+    check(i < image->_meta->developer_tag_count, TGA_ARG_ERR,
+            "Tag is not in the image's developer directory.");
+    check(image->_meta->lazy, TGA_ARG_ERR,
+            "Developer tags are only kept for images from open_tga_image.");
+    return &image->_meta->lazy->src;
+error:
+    return NULL;
+}
+
+/*
+ * Copies the data of tag, an entry of the image's directory, into buffer.
+ * File-backed images use a positioned read, which leaves the stream alone.
+ */
+int tga_read_developer_tag(TGAImage *image, const TGADeveloperTag *tag,
+                           void *buffer)
+{
+    TGASource *src = _tag_source(image, tag);
+    check(src, tga_error(), "Unable to read developer tag.");
+    check(buffer || tag->size == 0, TGA_ARG_ERR, "Invalid buffer pointer.");
+    if(tag->size == 0)
+        return 1;
+    if(!src->file)
+    {
+        check(tag->offset <= src->length &&
+                tag->size <= src->length - tag->offset, TGA_READ_ERR,
+                "Tag %u lies past the end of the image.", tag->tag);
+        memcpy(buffer, src->buffer + tag->offset, tag->size);
+        stat_add(read_calls, 1);
+        stat_add(bytes_read, tag->size);
+        return 1;
+    }
+#ifdef TGA_HAVE_PREAD
+    for(size_t done = 0; done < tag->size;)
+    {
+        ssize_t n = pread(fileno(src->file), (uint8_t *)buffer + done,
+                          tag->size - done, (off_t)tag->offset + (off_t)done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        check(n > 0, TGA_READ_ERR, "Unable to read tag %u.", tag->tag);
+        done += (size_t)n;
+        stat_add(read_calls, 1);
+        stat_add(bytes_read, (size_t)n);
+    }
+#else
+    check(_tga_fseek(src->file, (long)tag->offset, SEEK_SET) == 0,
+            TGA_GEN_IO_ERR, "Unable to seek to tag %u.", tag->tag);
+    check(_tga_fread(buffer, tag->size, 1, src->file) == 1, TGA_READ_ERR,
+            "Unable to read tag %u.", tag->tag);
+#endif
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * The data of tag in the buffer of an image from open_tga_image_from_memory,
+ * without copying. Fails for file-backed images; use tga_read_developer_tag.
+ */
+const uint8_t *tga_map_developer_tag(TGAImage *image,
+                                     const TGADeveloperTag *tag)
+{
+    TGASource *src = _tag_source(image, tag);
+    check(src, tga_error(), "Unable to map developer tag.");
+    check(!src->file, TGA_ARG_ERR, "Image is read from a file, not memory.");
+    check(tag->offset <= src->length && tag->size <= src->length - tag->offset,
+            TGA_READ_ERR, "Tag %u lies past the end of the image.", tag->tag);
+    return src->buffer + tag->offset;
+error:
+    return NULL;
+}
+
+/*
+ * Appends a tag to the file. The data and a new directory, with the old
+ * entries and this one, are written over the footer, followed by a new footer
+ * pointing at them; the header, pixels and any earlier tag data stay where
+ * they are. Version 1 files become version 2. The old directory is left
+ * behind as a few unreferenced bytes.
+ */
+int tga_append_developer_tag(const char *filename, uint16_t tag,
+                             const void *data, uint32_t size)
+{
+    FILE *file = NULL;
+    TGAImage *probe = NULL;
+    TGADeveloperTag *tags = NULL;
+    TGASource src = { NULL, NULL, 0, 0 };
+    uint8_t footer[TGA_FOOTER_SIZE];
+    uint8_t *directory = NULL;
+    long length = 0;
+    uint64_t end = 0, dir_offset = 0, dir_size = 0;
+    uint16_t count = 0;
+    int closed = 0;
+
+    check(filename && filename[0] != '\0', TGA_INV_FILE_NAME,
+            "Invalid or Null filename.");
+    check(data || size == 0, TGA_ARG_ERR, "Invalid tag data pointer.");
+    file = fopen(filename, "r+b");
+    check(file, TGA_INV_FILE_NAME, "Unable to open %.128s.", filename);
+    src.file = file;
+    probe = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    check(probe, tga_error(), "Unable to create new TGAImage.");
+
+    check(_tga_fseek(file, 0, SEEK_END) == 0, TGA_GEN_IO_ERR,
+            "Unable to seek to end of file.");
+    length = ftell(file);
+    check(length >= TGA_HEADER_SIZE, TGA_READ_ERR,
+            "%.128s is too short to be an image.", filename);
+    end = (uint64_t)length;
+    if(length >= TGA_HEADER_SIZE + TGA_FOOTER_SIZE)
+    {
+        check(_tga_fseek(file, -TGA_FOOTER_SIZE, SEEK_END) == 0,
+                TGA_GEN_IO_ERR, "Unable to seek to TGA Footer.");
+        check(_tga_fread(footer, TGA_FOOTER_SIZE, 1, file) == 1, TGA_READ_ERR,
+                "Unable to read TGA Footer.");
+        _tga_parse_footer(probe, footer);
+        if(probe->version == 2)
+            end -= TGA_FOOTER_SIZE;
+    }
+    if(probe->version == 2 && probe->_meta->developer_offset)
+    {
+        check(_tga_read_developer_directory(probe, &src), tga_error(),
+                "Unable to read developer directory.");
+        count = probe->_meta->developer_tag_count;
+        tags = probe->_meta->developer_tags;
+    }
+    check(count < UINT16_MAX, TGA_ARG_ERR, "Developer directory is full.");
+
+    dir_offset = end + size;
+    dir_size = 2 + (uint64_t)(count + 1) * TGA_DEVELOPER_ENTRY_SIZE;
+    check(dir_offset + dir_size + TGA_FOOTER_SIZE <= UINT32_MAX, TGA_ARG_ERR,
+            "Tag would take the file past 4 GiB.");
+    directory = _tga_malloc((size_t)dir_size);
+    check(directory, TGA_MEM_ERR, "Unable to allocate developer directory.");
+    _put_uint16(directory, (uint16_t)(count + 1));
+    for(size_t i = 0; i <= count; i++)
+    {
+        uint8_t *entry = directory + 2 + i * TGA_DEVELOPER_ENTRY_SIZE;
+        _put_uint16(entry, i < count ? tags[i].tag : tag);
+        _put_uint32(entry + 2, i < count ? tags[i].offset : (uint32_t)end);
+        _put_uint32(entry + 6, i < count ? tags[i].size : size);
+    }
+    memset(footer, 0, TGA_FOOTER_SIZE);
+    _put_uint32(footer, probe->_meta->extension_offset);
+    _put_uint32(footer + 4, (uint32_t)dir_offset);
+    memcpy(footer + 8, TRUEVISION_SIG, sizeof(TRUEVISION_SIG));
+
+    check(_tga_fseek(file, (long)end, SEEK_SET) == 0, TGA_GEN_IO_ERR,
+            "Unable to seek to end of image.");
+    if(size)
+        check(_tga_fwrite(data, size, 1, file) == 1, TGA_WRITE_ERR,
+                "Unable to write tag data.");
+    check(_tga_fwrite(directory, (size_t)dir_size, 1, file) == 1,
+            TGA_WRITE_ERR, "Unable to write developer directory.");
+    check(_tga_fwrite(footer, TGA_FOOTER_SIZE, 1, file) == 1, TGA_WRITE_ERR,
+            "Unable to write TGA Footer.");
+    free(directory);
+    free_tga_image(probe);
+    directory = NULL;
+    probe = NULL;
+    closed = fclose(file);
+    file = NULL;
+    check(closed == 0, TGA_WRITE_ERR, "Unable to close %.128s.", filename);
+    return 1;
+
+error:
+    free(directory);
+    free_tga_image(probe);
+    if(file)
+        fclose(file);
+    return 0;
+}
@@ -0,0 +1,321 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef TGA_HAVE_PTHREADS
+#include <sched.h>
+#endif
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Dithered conversion of 24 and 32-bit images to 16 bits. Channels are scaled
+ * from 8 to 5 bits over the whole range (255 becomes 31), and the rounding
+ * error is either spread by an 8x8 Bayer pattern or diffused to neighbouring
+ * pixels with Floyd-Steinberg weights. Both run over stored rows. Alpha
+ * becomes the attribute bit at half opacity, as in tga_convert_depth.
+ *
+ * Ordered dithering rounds every pixel on its own to floor((31v + t) / 255),
+ * with a threshold t from the pattern that averages to a half, so flat areas
+ * keep their mean level. Rows are independent and split across threads.
+ *
+ * Error diffusion makes each row depend on the row above it, up to one pixel
+ * to the right. Threads take rows in order and each only waits until the row
+ * above is a few pixels ahead, so the rows advance as a staggered wavefront
+ * and the result is the same as a single pass.
+ */
+
+#define TGA_DITHER_CHUNK 256    /* Pixels unpacked at a time. */
+#define TGA_DITHER_STEP  64     /* Pixels between progress updates. */
+
+static const uint8_t tga_bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+typedef struct {
+    TGAImage *image;
+    TGAImage *out;
+    size_t bytes;
+    /* Per pattern row, a threshold for every channel of a chunk of pixels. */
+    uint16_t thresholds[8][TGA_DITHER_CHUNK * 4];
+} TGAOrderedJob;
+
+typedef struct {
+    TGAImage *image;
+    TGAImage *out;
+    size_t bytes;
+    size_t height;
+    size_t next_row;            /* Next row for a thread to take. */
+    size_t *progress;           /* Pixels finished, per row. */
+    unsigned buffers;
+    /*
+     * Error carried into a row, in 16ths, three channels per pixel and a
+     * pixel of padding on either side. Row y reads buffer y % buffers and
+     * fills the next; with one more buffer than threads, a buffer is only
+     * reused once every row that touched it is done.
+     */
+    int16_t **errors;
+    uint8_t **scratch;          /* A BGRA row per thread. */
+} TGADiffuseJob;
+
+/* x / 255 rounded down, exact for every x below 65535. */
+static inline uint32_t _floor_div255(uint32_t x)
+{
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+static inline void _put_pixel16(uint8_t *dst, uint32_t v)
+{
+    dst[0] = (uint8_t)(v & 0xFF);
+    dst[1] = (uint8_t)(v >> 8);
+}
+
+static void _ordered_rows(void *ctx, size_t begin, size_t end)
+{
+    TGAOrderedJob *job = ctx;
+    size_t width = job->image->_meta->width, bytes = job->bytes;
+    uint8_t bgra[TGA_DITHER_CHUNK * 4], q[TGA_DITHER_CHUNK * 4];
+
+    for(size_t y = begin; y < end; y++)
+    {
+        const uint8_t *in = job->image->data + y * _tga_row_stride(job->image);
+        uint8_t *dst = job->out->data + y * width * 2;
+        const uint16_t *t = job->thresholds[y & 7];
+        /* Chunks start on multiples of 8 pixels, so the pattern lines up. */
+        for(size_t i = 0; i < width; i += TGA_DITHER_CHUNK)
+        {
+            size_t count = width - i < TGA_DITHER_CHUNK ? width - i
+                                                        : TGA_DITHER_CHUNK;
+            _tga_unpack_bgra(bgra, in + i * bytes, count, bytes);
+            for(size_t c = 0; c < count * 4; c++)
+                q[c] = (uint8_t)_floor_div255(bgra[c] * 31u + t[c]);
+            for(size_t x = 0; x < count; x++)
+                _put_pixel16(dst + (i + x) * 2, (uint32_t)q[x * 4] |
+                             (uint32_t)q[x * 4 + 1] << 5 |
+                             (uint32_t)q[x * 4 + 2] << 10 |
+                             (uint32_t)(bgra[x * 4 + 3] >> 7) << 15);
+        }
+    }
+}
+
+static int _dither_ordered(TGAImage *image, TGAImage *out)
+{
+    TGAOrderedJob *job = _tga_malloc(sizeof(TGAOrderedJob));
+    size_t height = image->_meta->height;
+    unsigned threads = 0;
+
+    check(job, TGA_MEM_ERR, "Unable to allocate dither tables.");
+    job->image = image;
+    job->out = out;
+    job->bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    for(size_t y = 0; y < 8; y++)
+        for(size_t c = 0; c < TGA_DITHER_CHUNK * 4; c++)
+            job->thresholds[y][c] = (uint16_t)(
+                ((2 * tga_bayer8[y][(c / 4) & 7] + 1) * 255 + 64) / 128);
+    threads = _tga_threads_for(_tga_row_stride(image) * height);
+    _tga_parallel_for(height, threads, _ordered_rows, job);
+    free(job);
+    return 1;
+error:
+    return 0;
+}
+
+static size_t _take_row(TGADiffuseJob *job)
+{
+#ifdef TGA_HAVE_PTHREADS
+    return __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+#else
+    return job->next_row++;
+#endif
+}
+
+static void _publish(size_t *progress, size_t done)
+{
+#ifdef TGA_HAVE_PTHREADS
+    __atomic_store_n(progress, done, __ATOMIC_RELEASE);
+#else
+    *progress = done;
+#endif
+}
+
+/* Waits until the row behind progress has finished needed pixels. */
+static void _wait_for(size_t *progress, size_t needed)
+{
+#ifdef TGA_HAVE_PTHREADS
+    while(__atomic_load_n(progress, __ATOMIC_ACQUIRE) < needed)
+        sched_yield();
+#else
+    /* Rows run in order on one thread, so the row above is done. */
+    (void)progress;
+    (void)needed;
+#endif
+}
+
+static void _diffuse_row(TGADiffuseJob *job, size_t y, uint8_t *bgra)
+{
+    size_t width = job->image->_meta->width;
+    const uint8_t *in = job->image->data + y * _tga_row_stride(job->image);
+    uint8_t *dst = job->out->data + y * width * 2;
+    const int16_t *cur = job->errors[y % job->buffers] + 3;
+    int16_t *next = job->errors[(y + 1) % job->buffers];
+    int32_t carry[3] = { 0, 0, 0 };
+
+    /*
+     * The rows that used this buffer before are finished by now; waiting on
+     * the later one makes their writes visible to this thread.
+     */
+    if(y + 1 >= job->buffers)
+        _wait_for(&job->progress[y + 1 - job->buffers], width);
+    memset(next, 0, (width + 2) * 3 * sizeof(int16_t));
+    _tga_unpack_bgra(bgra, in, width, job->bytes);
+    for(size_t x0 = 0; x0 < width; x0 += TGA_DITHER_STEP)
+    {
+        size_t x1 = width - x0 < TGA_DITHER_STEP ? width : x0 + TGA_DITHER_STEP;
+        /* Pixel x takes error from pixels x - 1 to x + 1 of the row above. */
+        if(y > 0)
+            _wait_for(&job->progress[y - 1], x1 < width ? x1 + 1 : width);
+        for(size_t x = x0; x < x1; x++)
+        {
+            uint32_t pixel = (uint32_t)(bgra[x * 4 + 3] >> 7) << 15;
+            int16_t *below = next + x * 3;
+            for(size_t c = 0; c < 3; c++)
+            {
+                int32_t v = bgra[x * 4 + c] +
+                            ((cur[x * 3 + c] + carry[c] + 8) >> 4);
+                uint32_t q = 0;
+                int32_t e = 0;
+                v = v < 0 ? 0 : v > 255 ? 255 : v;
+                q = _tga_reduce8((uint8_t)v);
+                e = v - _tga_expand5(q);
+                carry[c] = 7 * e;
+                /* next is padded, so pixel x of the next row is at x + 1. */
+                below[c] = (int16_t)(below[c] + 3 * e);
+                below[c + 3] = (int16_t)(below[c + 3] + 5 * e);
+                below[c + 6] = (int16_t)(below[c + 6] + e);
+                pixel |= q << (5 * c);
+            }
+            _put_pixel16(dst + x * 2, pixel);
+        }
+        _publish(&job->progress[y], x1);
+    }
+}
+
+/* Each index is one thread, which takes rows until none are left. */
+static void _diffuse_rows(void *ctx, size_t begin, size_t end)
+{
+    TGADiffuseJob *job = ctx;
+    for(size_t i = begin; i < end; i++)
+        for(size_t y = _take_row(job); y < job->height; y = _take_row(job))
+            _diffuse_row(job, y, job->scratch[i]);
+}
+
+static int _dither_diffuse(TGAImage *image, TGAImage *out)
+{
+    TGADiffuseJob job;
+    int16_t *errors[TGA_MAX_THREADS + 1];
+    uint8_t *scratch[TGA_MAX_THREADS];
+    size_t width = image->_meta->width;
+    unsigned threads = 0;
+
+    memset(&job, 0, sizeof(job));
+    memset(errors, 0, sizeof(errors));
+    memset(scratch, 0, sizeof(scratch));
+    job.image = image;
+    job.out = out;
+    job.bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    job.height = image->_meta->height;
+    threads = _tga_threads_for(_tga_row_stride(image) * job.height);
+    if(threads > job.height)
+        threads = (unsigned)job.height;
+    job.buffers = threads + 1;
+    job.errors = errors;
+    job.scratch = scratch;
+    job.progress = _tga_malloc(job.height * sizeof(size_t));
+    check(job.progress, TGA_MEM_ERR, "Unable to allocate dither buffers.");
+    memset(job.progress, 0, job.height * sizeof(size_t));
+    for(unsigned i = 0; i < job.buffers; i++)
+    {
+        errors[i] = _tga_malloc((width + 2) * 3 * sizeof(int16_t));
+        check(errors[i], TGA_MEM_ERR, "Unable to allocate dither buffers.");
+        memset(errors[i], 0, (width + 2) * 3 * sizeof(int16_t));
+    }
+    for(unsigned i = 0; i < threads; i++)
+    {
+        scratch[i] = _tga_malloc(width * 4);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate dither buffers.");
+    }
+    _tga_parallel_for(threads, threads, _diffuse_rows, &job);
+
+    free(job.progress);
+    for(unsigned i = 0; i < job.buffers; i++)
+        free(errors[i]);
+    for(unsigned i = 0; i < threads; i++)
+        free(scratch[i]);
+    return 1;
+
+error:
+    free(job.progress);
+    for(unsigned i = 0; i < job.buffers; i++)
+        free(errors[i]);
+    for(unsigned i = 0; i < threads; i++)
+        free(scratch[i]);
+    return 0;
+}
+
+/*
+ * Returns a 16-bit copy of a truecolor image, ready for write_tga_image.
+ * TGA_DITHER_NONE rounds each channel to nearest like tga_convert_depth, and
+ * 16-bit images are copied as they are. The ID field, offsets, origin and
+ * compression setting carry over.
+ */
+TGAImage *tga_convert_to_16(TGAImage *image, TGADither dither)
+{
+    TGAImage *out = NULL;
+    int done = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(dither == TGA_DITHER_NONE || dither == TGA_DITHER_ORDERED ||
+            dither == TGA_DITHER_FLOYD_STEINBERG, TGA_ARG_ERR,
+            "Unknown dithering mode %d.", (int)dither);
+    check(image->_meta->image_type == TGA_TRUECOLOR, TGA_TYPE_ERR,
+            "Only truecolor images can change depth.");
+    if(dither == TGA_DITHER_NONE || image->_meta->pixel_depth == 16)
+        return tga_convert_depth(image, 16);
+    check(image->_meta->pixel_depth == 24 || image->_meta->pixel_depth == 32,
+            TGA_UNSUPPORTED, "Unsupported source depth %u.",
+            image->_meta->pixel_depth);
+
+    out = _tga_derive_image(image, 16, image->_meta->width,
+                            image->_meta->height);
+    check(out, tga_error(), "Unable to create converted image.");
+    out->_meta->image_descriptor = (uint8_t)(
+        (image->_meta->image_descriptor & (TGA_ORIGIN_RIGHT | TGA_ORIGIN_TOP)) |
+        _tga_converted_attribute_bits(image->_meta->image_descriptor & 15,
+                                      image->_meta->pixel_depth, 16));
+    if(image->_meta->width == 0 || image->_meta->height == 0)
+        return out;
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    if(dither == TGA_DITHER_ORDERED)
+        done = _dither_ordered(image, out);
+    else
+        done = _dither_diffuse(image, out);
+    check(done, tga_error(), "Unable to dither image.");
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
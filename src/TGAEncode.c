@@ -1,100 +1,926 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define TGA_HAVE_WRITEV 1
+#endif
+
 #include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+#define TGA_RLE_MAX_PACKET  128
+/* Bands are sized to hold roughly this many bytes of source pixels. */
+#define TGA_RLE_BAND_BYTES  ((size_t)1 << 20)
+/* Rows sampled to estimate the RLE size of a TGA_COMPRESS_AUTO write. */
+#define TGA_AUTO_SAMPLE_ROWS 32
+#define TGA_AUTO_CHUNK      512
+/* Descriptor writes at least this large reserve their space up front. */
+#define TGA_FALLOCATE_MIN   ((size_t)1 << 20)
+/* Header, ID field, color map and footer around a batch of RLE bands. */
+#define TGA_SINK_SEGMENTS   (TGA_MAX_THREADS + 4)
+
+/*
+ * Destination of an encoded image: a stdio stream, a file descriptor or a
+ * growing memory buffer. Parts of the file are queued as segments and written
+ * together by _sink_flush, so the header, ID field, color map, pixels and
+ * footer of an image that is not RLE encoded in several batches go out in a
+ * single call. Queued segments must stay valid until flushed.
+ */
+typedef struct {
+    FILE *file;
+    int fd;                     /* Used when file is NULL and fd >= 0. */
+    uint8_t *memory;            /* Used otherwise. */
+    size_t capacity;
+    size_t written;             /* Bytes flushed so far. */
+    size_t count;
+    const uint8_t *segments[TGA_SINK_SEGMENTS];
+    size_t lengths[TGA_SINK_SEGMENTS];
+    uint8_t header[TGA_HEADER_SIZE];
+    uint8_t footer[TGA_FOOTER_SIZE];
+} TGASink;
+
+/* Header fields are little-endian and unaligned. */
+static inline void _put_uint16(uint8_t *data, uint16_t value)
+{
+    data[0] = (uint8_t)(value & 0xFF);
+    data[1] = (uint8_t)(value >> 8);
+}
+
+#ifdef TGA_HAVE_WRITEV
+/* Writes every segment with writev, resuming after partial writes. */
+static int _writev_all(int fd, struct iovec *iov, size_t count)
+{
+    while(count > 0)
+    {
+        ssize_t written = writev(fd, iov, (int)count);
+        check(written >= 0 || errno == EINTR, TGA_WRITE_ERR,
+                "Unable to write image data.");
+        stat_add(write_calls, 1);
+        if(written < 0)
+            continue;
+        stat_add(bytes_written, (size_t)written);
+        /* Skip what was written, resuming partial writes mid-buffer. */
+        while(count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return 1;
+error:
+    return 0;
+}
+#endif/*TGA_HAVE_WRITEV*/
+
+static int _sink_reserve(TGASink *sink, size_t total)
+{
+    uint8_t *grown = NULL;
+    size_t capacity = sink->capacity ? sink->capacity : 4096;
+    if(total <= sink->capacity)
+        return 1;
+    while(capacity < total)
+        capacity = capacity > SIZE_MAX / 2 ? total : capacity * 2;
+    grown = realloc(sink->memory, capacity);
+    check(grown, TGA_MEM_ERR, "Unable to grow output buffer.");
+    stat_add(alloc_count, 1);
+    stat_add(alloc_bytes, capacity);
+    sink->memory = grown;
+    sink->capacity = capacity;
+    return 1;
+error:
+    return 0;
+}
 
-static int _write_tga_header(TGAImage *image, FILE *file)
+/* Writes out every queued segment. */
+static int _sink_flush(TGASink *sink)
 {
-    uint8_t data[TGA_HEADER_SIZE] = {0};
+    size_t total = 0;
+    for(size_t i = 0; i < sink->count; i++)
+        total += sink->lengths[i];
+    if(total == 0)
+    {
+        sink->count = 0;
+        return 1;
+    }
+
+    if(!sink->file && sink->fd < 0)
+    {
+        check(_sink_reserve(sink, sink->written + total), tga_error(),
+                "Unable to grow output buffer.");
+        for(size_t i = 0, at = sink->written; i < sink->count; i++)
+        {
+            memcpy(sink->memory + at, sink->segments[i], sink->lengths[i]);
+            at += sink->lengths[i];
+        }
+        stat_add(bytes_written, total);
+    }
+    else
+    {
+#ifdef TGA_HAVE_WRITEV
+        struct iovec iov[TGA_SINK_SEGMENTS];
+        long position = 0;
+        int fd = sink->fd;
+        for(size_t i = 0; i < sink->count; i++)
+        {
+            /* writev takes non-const buffers but only reads them. */
+            iov[i].iov_base = (void *)(uintptr_t)sink->segments[i];
+            iov[i].iov_len = sink->lengths[i];
+        }
+        if(sink->file)
+        {
+            /* Write behind the stream, flushing what it buffered first. */
+            check(fflush(sink->file) == 0, TGA_WRITE_ERR,
+                    "Unable to flush file.");
+            position = ftell(sink->file);
+            check(position >= 0, TGA_GEN_IO_ERR, "Unable to get file position.");
+            fd = fileno(sink->file);
+        }
+        check(_writev_all(fd, iov, sink->count), tga_error(),
+                "Unable to write image data.");
+        /* The stream's idea of the offset is stale after writing behind it. */
+        if(sink->file)
+            check(_tga_fseek(sink->file, position + (long)total, SEEK_SET) == 0,
+                    TGA_GEN_IO_ERR, "Unable to seek past image data.");
+#else
+        check(sink->file, TGA_UNSUPPORTED,
+                "Writing to descriptors is not supported on this platform.");
+        for(size_t i = 0; i < sink->count; i++)
+            if(sink->lengths[i])
+                check(_tga_fwrite(sink->segments[i], sink->lengths[i], 1,
+                        sink->file) == 1, TGA_WRITE_ERR,
+                        "Unable to write image data.");
+#endif
+    }
+    sink->written += total;
+    sink->count = 0;
+    return 1;
+error:
+    return 0;
+}
+
+/* Queues data for the next flush, flushing first if the queue is full. */
+static int _sink_queue(TGASink *sink, const void *data, size_t length)
+{
+    if(sink->count == TGA_SINK_SEGMENTS)
+        check(_sink_flush(sink), tga_error(), "Unable to write image data.");
+    sink->segments[sink->count] = data;
+    sink->lengths[sink->count] = length;
+    sink->count++;
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Size of the color map written after the ID field. Images read from a
+ * truecolor or monochrome file keep the map fields of the header but not the
+ * map, and are written without one.
+ */
+static size_t _written_color_map_bytes(TGAImage *image)
+{
+    return image->color_map ? _tga_color_map_bytes(image) : 0;
+}
+
+static int _write_tga_header(TGAImage *image, TGASink *sink, uint8_t type)
+{
+    uint8_t *data = sink->header;
+    int c_map = 0;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    check(file, TGA_INV_FILE_PNT, "Invalid file pointer passed.");
-    check(fseek(file, 0, SEEK_SET) == 0, TGA_GEN_IO_ERR,
-            "Unable to seek to beginning of file.");
+    c_map = _written_color_map_bytes(image) != 0;
     data[0] = image->_meta->id_length;
-    data[1] = image->_meta->c_map_type;
-    data[2] = image->_meta->image_type;
-    *((uint16_t*)(data+3)) = image->_meta->c_map_start;
-    *((uint16_t*)(data+5)) = image->_meta->c_map_length;
-    data[7] = image->_meta->c_map_depth;
-    *((uint16_t*)(data+8)) = image->_meta->x_offset;
-    *((uint16_t*)(data+10)) = image->_meta->y_offset;
-    *((uint16_t*)(data+12)) = image->_meta->width;
-    *((uint16_t*)(data+14)) = image->_meta->height;
+    data[1] = c_map ? image->_meta->c_map_type : 0;
+    data[2] = type;
+    _put_uint16(data+3, c_map ? image->_meta->c_map_start : 0);
+    _put_uint16(data+5, c_map ? image->_meta->c_map_length : 0);
+    data[7] = c_map ? image->_meta->c_map_depth : 0;
+    _put_uint16(data+8, image->_meta->x_offset);
+    _put_uint16(data+10, image->_meta->y_offset);
+    _put_uint16(data+12, image->_meta->width);
+    _put_uint16(data+14, image->_meta->height);
     data[16] = image->_meta->pixel_depth;
     data[17] = image->_meta->image_descriptor;
-
-    check(fwrite(data, TGA_HEADER_SIZE, 1, file) == 1, TGA_WRITE_ERR,
-            "Unable to write TGA Header.");
-    return 1;
+    return _sink_queue(sink, data, TGA_HEADER_SIZE);
 error:
     return 0;
 }
 
-static int _write_tga_id_field(TGAImage *image, FILE *file)
+static int _write_tga_id_field(TGAImage *image, TGASink *sink)
 {
-    check(file, TGA_INV_FILE_PNT, "Invalid FILE Pointer.");
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     check(image->_meta->id_length != 0 && image->id_field, TGA_INTERNAL_ERR,
             "TGA Image ID Null or 0. This should not have been called.");
-    if(ftell(file) != TGA_HEADER_SIZE)
-        check(fseek(file, TGA_HEADER_SIZE, SEEK_SET) == 0, TGA_GEN_IO_ERR,
-                "Unable to seek to beginning of ID Field.");
-    check(fwrite(image->id_field, image->_meta->id_length, 1, file) == 1,
-            TGA_WRITE_ERR, "Unable to write ID Field to file.");
+    return _sink_queue(sink, image->id_field, image->_meta->id_length);
+error:
+    return 0;
+}
+
+static int _write_tga_color_map(TGAImage *image, TGASink *sink)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(_written_color_map_bytes(image) != 0, TGA_INTERNAL_ERR,
+            "TGA Color Map Null or 0. This should not have been called.");
+    return _sink_queue(sink, image->color_map, _written_color_map_bytes(image));
+error:
+    return 0;
+}
+
+/*
+ * TGA 2.0 footer. No extension or developer area is written, so both offsets
+ * are zero, followed by the signature and its terminating ".\0".
+ */
+static int _write_tga_footer(TGASink *sink)
+{
+    memset(sink->footer, 0, TGA_FOOTER_SIZE);
+    memcpy(sink->footer + 8, TRUEVISION_SIG, sizeof(TRUEVISION_SIG));
+    return _sink_queue(sink, sink->footer, TGA_FOOTER_SIZE);
+}
+
+static inline uint32_t _load_pixel(const uint8_t *pixel, size_t bytes)
+{
+    switch(bytes)
+    {
+        case 1:
+            return pixel[0];
+        case 2:
+            return (uint32_t)pixel[0] | (uint32_t)pixel[1] << 8;
+        case 3:
+            return (uint32_t)pixel[0] | (uint32_t)pixel[1] << 8 |
+                   (uint32_t)pixel[2] << 16;
+        default:
+            return (uint32_t)pixel[0] | (uint32_t)pixel[1] << 8 |
+                   (uint32_t)pixel[2] << 16 | (uint32_t)pixel[3] << 24;
+    }
+}
+
+/*
+ * Encodes a single scanline, returning the number of bytes written to out.
+ * Two or more equal pixels become a run packet; everything else is collected
+ * into raw packets that stop where the next run begins.
+ */
+size_t _tga_rle_encode_row(const uint8_t *row, size_t width, size_t bytes,
+                           uint8_t *out, TGARleCounts *counts)
+{
+    uint8_t *start = out;
+    size_t x = 0;
+
+    while(x < width)
+    {
+        uint32_t value = _load_pixel(row + x * bytes, bytes);
+        size_t end = x + 1;
+
+        while(end < width && end - x < TGA_RLE_MAX_PACKET &&
+              _load_pixel(row + end * bytes, bytes) == value)
+            end++;
+
+        if(end - x > 1)
+        {
+            *out++ = (uint8_t)(0x80 | (end - x - 1));
+            memcpy(out, row + x * bytes, bytes);
+            out += bytes;
+            counts->run_packets++;
+            counts->run_pixels += end - x;
+        }
+        else
+        {
+            /* value now tracks the pixel at end. */
+            value = end < width ? _load_pixel(row + end * bytes, bytes) : 0;
+            while(end < width && end - x < TGA_RLE_MAX_PACKET)
+            {
+                if(end + 1 < width)
+                {
+                    uint32_t next = _load_pixel(row + (end + 1) * bytes, bytes);
+                    if(next == value)
+                        break;
+                    value = next;
+                }
+                end++;
+            }
+            *out++ = (uint8_t)(end - x - 1);
+            memcpy(out, row + x * bytes, (end - x) * bytes);
+            out += (end - x) * bytes;
+            counts->raw_packets++;
+            counts->raw_pixels += end - x;
+        }
+        x = end;
+    }
+    return (size_t)(out - start);
+}
+
+/*
+ * Worst case for a row: charging each raw packet header to the run packet
+ * that ends it, every pixel costs at most half a byte more than raw, plus the
+ * headers of full 128 pixel raw packets and the row's final packet.
+ */
+size_t _tga_rle_row_bound(size_t width, size_t bytes)
+{
+    return width * bytes + width / 2 + width / TGA_RLE_MAX_PACKET + 2;
+}
+
+typedef struct {
+    const uint8_t *data;
+    size_t width;
+    size_t height;
+    size_t bytes;
+    size_t stride;
+    size_t band_rows;
+    size_t first_band;          /* First band of the current batch. */
+    uint8_t **buffers;          /* One per band of the batch. */
+    size_t *lengths;
+    TGARleCounts *counts;
+    uint32_t *row_bytes;        /* Encoded size of every row. */
+} TGARleJob;
+
+static void _rle_encode_bands(void *ctx, size_t begin, size_t end)
+{
+    TGARleJob *job = ctx;
+    for(size_t i = begin; i < end; i++)
+    {
+        size_t row = (job->first_band + i) * job->band_rows;
+        size_t last = row + job->band_rows;
+        uint8_t *out = job->buffers[i];
+
+        if(last > job->height)
+            last = job->height;
+        for(; row < last; row++)
+        {
+            size_t size = _tga_rle_encode_row(job->data + row * job->stride,
+                                              job->width, job->bytes, out,
+                                              &job->counts[i]);
+            job->row_bytes[row] = (uint32_t)size;
+            out += size;
+        }
+        job->lengths[i] = (size_t)(out - job->buffers[i]);
+    }
+}
+
+/*
+ * RLE pixel data. Packets never cross a scanline (as TGA 2.0 requires), so rows
+ * encode independently: the image is cut into bands of rows, each thread
+ * encodes one band into a private buffer, and every batch of bands is written
+ * in order. The encoded row sizes are kept as the image's scan line table.
+ */
+static int _write_tga_rle_data(TGAImage *image, TGASink *sink, size_t total,
+                               uint64_t *encoded)
+{
+    TGARleJob job = {0};
+    uint8_t *buffers[TGA_MAX_THREADS] = {0};
+    size_t lengths[TGA_MAX_THREADS] = {0};
+    TGARleCounts counts[TGA_MAX_THREADS];
+    size_t bands = 0;
+    size_t worst = 0;
+    uint64_t offset = 0;
+    unsigned threads = _tga_threads_for(total);
+
+    job.data = image->data;
+    job.width = image->_meta->width;
+    job.height = image->_meta->height;
+    job.bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    job.stride = _tga_row_stride(image);
+    job.band_rows = TGA_RLE_BAND_BYTES / job.stride;
+    if(job.band_rows == 0)
+        job.band_rows = 1;
+    if(job.band_rows > job.height)
+        job.band_rows = job.height;
+    job.buffers = buffers;
+    job.lengths = lengths;
+    job.counts = counts;
+    bands = (job.height + job.band_rows - 1) / job.band_rows;
+    if(threads > bands)
+        threads = (unsigned)bands;
+
+    free(image->_meta->scanline_offsets);
+    image->_meta->scanline_offsets = _tga_malloc(job.height * sizeof(uint32_t));
+    check(image->_meta->scanline_offsets, TGA_MEM_ERR,
+            "Unable to allocate scan line table.");
+    job.row_bytes = image->_meta->scanline_offsets;
+
+    worst = job.band_rows * _tga_rle_row_bound(job.width, job.bytes);
+    for(unsigned i = 0; i < threads; i++)
+    {
+        buffers[i] = _tga_malloc(worst);
+        check(buffers[i], TGA_MEM_ERR, "Unable to allocate RLE buffer.");
+    }
+
+    for(job.first_band = 0; job.first_band < bands; job.first_band += threads)
+    {
+        size_t batch = bands - job.first_band;
+        if(batch > threads)
+            batch = threads;
+        memset(counts, 0, sizeof(counts));
+        _tga_parallel_for(batch, threads, _rle_encode_bands, &job);
+        for(size_t i = 0; i < batch; i++)
+            check(_sink_queue(sink, buffers[i], lengths[i]), tga_error(),
+                    "Unable to write image data.");
+        /* The buffers are reused by the next batch. */
+        check(_sink_flush(sink), tga_error(), "Unable to write image data.");
+        for(size_t i = 0; i < batch; i++)
+        {
+            *encoded += lengths[i];
+            stat_add(rle_run_packets, counts[i].run_packets);
+            stat_add(rle_run_pixels, counts[i].run_pixels);
+            stat_add(rle_raw_packets, counts[i].raw_packets);
+            stat_add(rle_raw_pixels, counts[i].raw_pixels);
+        }
+    }
+
+    /* Turn the row sizes into file offsets, giving up past 4 GiB. */
+    offset = (uint64_t)TGA_HEADER_SIZE + image->_meta->id_length +
+             _written_color_map_bytes(image);
+    for(size_t row = 0; row < job.height; row++)
+    {
+        uint32_t size = job.row_bytes[row];
+        if(offset > UINT32_MAX)
+        {
+            free(image->_meta->scanline_offsets);
+            image->_meta->scanline_offsets = NULL;
+            break;
+        }
+        job.row_bytes[row] = (uint32_t)offset;
+        offset += size;
+    }
+
+    for(unsigned i = 0; i < threads; i++)
+        free(buffers[i]);
     return 1;
 error:
+    for(unsigned i = 0; i < threads; i++)
+        free(buffers[i]);
+    free(image->_meta->scanline_offsets);
+    image->_meta->scanline_offsets = NULL;
     return 0;
 }
 
-static int _write_tga_image_data(TGAImage *image, FILE *file)
+/*
+ * Sets equal[x] to 1 where pixel x + 1 of row matches pixel x, for count
+ * pixels. The comparisons are branch-free so the loops vectorize.
+ */
+static void _equal_pairs(const uint8_t *row, size_t count, size_t bytes,
+                         uint8_t *restrict equal)
+{
+    switch(bytes)
+    {
+        case 1:
+            for(size_t x = 0; x < count; x++)
+                equal[x] = row[x + 1] == row[x];
+            break;
+        case 2:
+            for(size_t x = 0; x < count; x++)
+                equal[x] = (row[x * 2 + 2] == row[x * 2]) &
+                           (row[x * 2 + 3] == row[x * 2 + 1]);
+            break;
+        case 3:
+            for(size_t x = 0; x < count; x++)
+                equal[x] = (row[x * 3 + 3] == row[x * 3]) &
+                           (row[x * 3 + 4] == row[x * 3 + 1]) &
+                           (row[x * 3 + 5] == row[x * 3 + 2]);
+            break;
+        default:
+            for(size_t x = 0; x < count; x++)
+                equal[x] = (row[x * 4 + 4] == row[x * 4]) &
+                           (row[x * 4 + 5] == row[x * 4 + 1]) &
+                           (row[x * 4 + 6] == row[x * 4 + 2]) &
+                           (row[x * 4 + 7] == row[x * 4 + 3]);
+            break;
+    }
+}
+
+/*
+ * Estimated RLE size of a row from its run boundaries. Each stretch of equal
+ * pixels becomes run packets and the stretches of other pixels between them
+ * raw packets, split at 128 pixels as _tga_rle_encode_row splits them.
+ */
+static size_t _estimate_rle_row(const uint8_t *row, size_t width,
+                                size_t bytes)
+{
+    /* equal[i + 1] is set if pixel x + i matches the next one. */
+    uint8_t equal[1 + TGA_AUTO_CHUNK] = { 0 };
+    size_t run_packets = 0, raw_packets = 0, raw = 0, run = 0, stretch = 0;
+
+    for(size_t x = 0; x < width; x += TGA_AUTO_CHUNK)
+    {
+        size_t count = width - x < TGA_AUTO_CHUNK ? width - x : TGA_AUTO_CHUNK;
+        if(x + count == width)
+        {
+            _equal_pairs(row + x * bytes, count - 1, bytes, equal + 1);
+            equal[count] = 0;
+        }
+        else
+            _equal_pairs(row + x * bytes, count, bytes, equal + 1);
+        for(size_t i = 0; i < count; i++)
+        {
+            uint8_t left = equal[i], right = equal[i + 1];
+            if(right)
+            {
+                /* run counts the pairs inside the current run packet. */
+                if(!left || run == TGA_RLE_MAX_PACKET - 1)
+                    run_packets++, run = left ? 0 : 1;
+                else
+                    run++;
+            }
+            if(!left && !right)
+            {
+                if(stretch == 0 || stretch == TGA_RLE_MAX_PACKET)
+                    raw_packets++, stretch = 0;
+                stretch++;
+                raw++;
+            }
+            else
+                stretch = 0;
+        }
+        equal[0] = equal[count];
+    }
+    return run_packets * (1 + bytes) + raw_packets + raw * bytes;
+}
+
+/*
+ * Whether RLE encoding should make the pixel data smaller, judged from an
+ * estimate over evenly spaced rows that is scaled up to the whole image.
+ */
+static int _prefer_rle(TGAImage *image, size_t total, uint64_t *estimate)
 {
-    uint8_t depth = 0;
-    uint32_t total = 0;
+    size_t width = image->_meta->width, height = image->_meta->height;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    size_t samples = height < TGA_AUTO_SAMPLE_ROWS ? height
+                                                   : TGA_AUTO_SAMPLE_ROWS;
+    uint64_t sampled = 0;
+
+    *estimate = 0;
+    if(total == 0 || !_tga_pixels(image))
+        return 0;
+    for(size_t i = 0; i < samples; i++)
+    {
+        size_t y = (2 * i + 1) * height / (2 * samples);
+        sampled += _estimate_rle_row(image->data + y * _tga_row_stride(image),
+                                     width, bytes);
+    }
+    *estimate = (sampled * height + samples / 2) / samples;
+    return *estimate < total;
+}
+
+static int _write_tga_image_data(TGAImage *image, TGASink *sink, int encode,
+                                 uint64_t *encoded)
+{
+    size_t total = 0;
 
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    check(file, TGA_INV_FILE_PNT, "Invalid File Pointer.");
 
     if(image->_meta->image_type == TGA_NO_DATA ||
         image->_meta->image_type == TGA_UNKNOWN_TYPE)
         return 1; /* No Data to be written, according to meta-data. */
 
-    depth = (uint8_t)((image->_meta->pixel_depth + 7) / 8);
-    total = image->_meta->width * image->_meta->height * depth;
+    check(_tga_pixel_bytes(image->_meta->width, image->_meta->height,
+            image->_meta->pixel_depth, &total), TGA_WRITE_ERR,
+            "Image dimensions are too large.");
     if(total == 0)
         return 1;
 
-    check(image->data, TGA_INV_IMAGE_PNT, "Data missing.");
-    check(fwrite(image->data, total, 1, file) == 1, TGA_WRITE_ERR,
-            "Unable to write image data to file.");
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Data missing.");
+    if(encode)
+        return _write_tga_rle_data(image, sink, total, encoded);
+
+    free(image->_meta->scanline_offsets);
+    image->_meta->scanline_offsets = NULL;
+    if(_tga_row_stride(image) == _tga_row_bytes(image))
+        return _sink_queue(sink, image->data, total);
+    /* A view into a wider image is queued a row at a time. */
+    for(size_t y = 0; y < image->_meta->height; y++)
+        check(_sink_queue(sink, image->data + y * _tga_row_stride(image),
+                _tga_row_bytes(image)), tga_error(),
+                "Unable to write image data.");
     return 1;
 error:
     return 0;
 }
 
-int write_tga_image(TGAImage *image, const char* filename)
+/*
+ * Size of the file a raw (uncompressed) write produces, or 0 if that is not
+ * known in advance because the pixels may be RLE encoded.
+ */
+static size_t _raw_file_size(TGAImage *image)
 {
-    FILE *file = NULL;
+    size_t pixels = 0;
+    if(image->_meta->compression != TGA_COMPRESS_NONE ||
+        !_tga_pixel_bytes(image->_meta->width, image->_meta->height,
+                          image->_meta->pixel_depth, &pixels))
+        return 0;
+    return TGA_HEADER_SIZE + image->_meta->id_length +
+           _written_color_map_bytes(image) + pixels +
+           (image->version == 2 ? TGA_FOOTER_SIZE : 0);
+}
+
+static int _write_tga(TGAImage *image, TGASink *sink)
+{
+    uint8_t type = 0;
+    int encode = 0;
+    size_t total = 0;
+    uint64_t estimate = 0, encoded = 0;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     check(image->_meta->image_type == TGA_TRUECOLOR ||
             image->_meta->image_type == TGA_MONOCHROME, TGA_UNSUPPORTED,
             "Currently, only writing for TRUECOLOR TGA Images is supported.");
     check(image->version == 1 || image->version == 2, TGA_UNSUPPORTED,
             "Unsupported TGA Version.");
+
+    encode = image->_meta->compression == TGA_COMPRESS_RLE;
+    if(image->_meta->compression == TGA_COMPRESS_AUTO &&
+        _tga_pixel_bytes(image->_meta->width, image->_meta->height,
+                         image->_meta->pixel_depth, &total))
+        encode = _prefer_rle(image, total, &estimate);
+    type = image->_meta->image_type;
+    if(encode)
+        type = type == TGA_TRUECOLOR ? TGA_ENCODED_TRUECOLOR :
+                                       TGA_ENCODED_MONOCHROME;
+
+    check(staged(TGA_STAGE_HEADER, _write_tga_header(image, sink, type)),
+            tga_error(), "Unable to write TGA Header.");
+    if(image->_meta->id_length > 0)
+        check(staged(TGA_STAGE_ID, _write_tga_id_field(image, sink)),
+                tga_error(), "Unable to write TGA ID Field.");
+    if(_written_color_map_bytes(image))
+        check(staged(TGA_STAGE_COLOR_MAP, _write_tga_color_map(image, sink)),
+                tga_error(), "Unable to write TGA Color Map.");
+    check(staged(TGA_STAGE_PIXELS, _write_tga_image_data(image, sink, encode,
+            &encoded)), tga_error(), "Unable to write TGA Data.");
+    if(image->version == 2)
+        check(staged(TGA_STAGE_FOOTER, _write_tga_footer(sink)),
+                tga_error(), "Unable to write TGA Footer.");
+    check(_sink_flush(sink), tga_error(), "Unable to write TGA Image.");
+
+    if(image->_meta->compression == TGA_COMPRESS_AUTO)
+    {
+        stat_add(auto_raw_writes, !encode);
+        stat_add(auto_rle_writes, encode);
+        if(encode)
+        {
+            stat_add(auto_rle_estimated, estimate);
+            stat_add(auto_rle_bytes, encoded);
+            stat_add(auto_rle_error, estimate > encoded ? estimate - encoded
+                                                        : encoded - estimate);
+        }
+    }
+    return 1;
+error:
+    return 0;
+}
+
+int write_tga_image(TGAImage *image, const char* filename)
+{
+    TGASink sink = {0};
+    int closed = 0;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     check(filename && filename[0] != '\0', TGA_INV_FILE_NAME,
             "Invalid or Null filename.");
-    file = fopen(filename, "wb");
-    check(file, TGA_WRITE_ERR, "Unable to open file for writing.");
+    sink.file = fopen(filename, "wb");
+    check(sink.file, TGA_WRITE_ERR, "Unable to open file for writing.");
+    check(_write_tga(image, &sink), tga_error(), "Unable to write image.");
+    closed = fclose(sink.file);
+    sink.file = NULL;
+    check(closed == 0, TGA_WRITE_ERR, "Unable to close written file.");
+    return 1;
+error:
+    if(sink.file)
+        fclose(sink.file);
+    return 0;
+}
 
-    check(_write_tga_header(image, file), tga_error(),
-            "Unable to write TGA Header.");
+/*
+ * Writes the image at the descriptor's current offset. Unless the pixels are
+ * RLE encoded in several batches this is a single writev. Large raw images
+ * have their space reserved first when fd is a regular file, which keeps the
+ * file from fragmenting as it is written.
+ */
+int write_tga_image_fd(TGAImage *image, int fd)
+{
+    TGASink sink = {0};
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(fd >= 0, TGA_INV_FILE_PNT, "Invalid file descriptor.");
+#ifdef TGA_HAVE_WRITEV
+    {
+        size_t size = _raw_file_size(image);
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        struct stat st;
+        if(size >= TGA_FALLOCATE_MIN && offset >= 0 && fstat(fd, &st) == 0 &&
+            S_ISREG(st.st_mode))
+            (void)posix_fallocate(fd, offset, (off_t)size); /* Only a hint. */
+    }
+#endif
+    sink.fd = fd;
+    return _write_tga(image, &sink);
+error:
+    return 0;
+}
+
+/*
+ * Encodes the image into a newly allocated buffer, which the caller releases
+ * with free(). Raw images are encoded with a single allocation.
+ */
+int write_tga_image_to_memory(TGAImage *image, uint8_t **buffer,
+                              size_t *length)
+{
+    TGASink sink = {0};
+    check(buffer && length, TGA_ARG_ERR, "Invalid output pointers.");
+    *buffer = NULL;
+    *length = 0;
+    sink.fd = -1;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(_sink_reserve(&sink, _raw_file_size(image)), tga_error(),
+            "Unable to allocate output buffer.");
+    check(_write_tga(image, &sink), tga_error(), "Unable to encode image.");
+    *buffer = sink.memory;
+    *length = sink.written;
+    return 1;
+error:
+    free(sink.memory);
+    return 0;
+}
+
+/*
+ * Streaming writer for the row pipeline. image supplies the header and is
+ * never given pixels. Blocks are written as they arrive, except that with
+ * reverse set RLE blocks are held until close (their offsets are unknown
+ * until every later row is encoded) and raw blocks are written in place.
+ */
+struct TGARowWriter {
+    TGASink sink;
+    TGAImage *image;
+    uint64_t data_start;
+    size_t row_bytes;           /* Bytes of a raw row. */
+    int encoded;
+    int reverse;
+    uint8_t **blocks;           /* Held back RLE blocks, in arrival order. */
+    size_t *lengths;
+    size_t count;
+    size_t capacity;
+};
+
+TGARowWriter *_tga_row_writer_open(TGAImage *image, const char *filename,
+                                   int reverse)
+{
+    TGARowWriter *writer = NULL;
+    uint8_t type = image->_meta->image_type;
+
+    check(type == TGA_TRUECOLOR || type == TGA_MONOCHROME, TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be written.");
+    check(filename && filename[0] != '\0', TGA_INV_FILE_NAME,
+            "Invalid or Null filename.");
+    writer = _tga_malloc(sizeof(TGARowWriter));
+    check(writer, TGA_MEM_ERR, "Unable to allocate row writer.");
+    memset(writer, 0, sizeof(*writer));
+    writer->image = image;
+    writer->reverse = reverse;
+    writer->encoded = image->_meta->compression == TGA_COMPRESS_RLE;
+    writer->row_bytes = _tga_row_bytes(image);
+    writer->data_start = (uint64_t)TGA_HEADER_SIZE + image->_meta->id_length +
+                         _written_color_map_bytes(image);
+    if(writer->encoded)
+        type = type == TGA_TRUECOLOR ? TGA_ENCODED_TRUECOLOR :
+                                       TGA_ENCODED_MONOCHROME;
+    writer->sink.file = fopen(filename, "wb");
+    check(writer->sink.file, TGA_WRITE_ERR, "Unable to open file for writing.");
+
+    check(staged(TGA_STAGE_HEADER, _write_tga_header(image, &writer->sink,
+            type)), tga_error(), "Unable to write TGA Header.");
     if(image->_meta->id_length > 0)
-        check(_write_tga_id_field(image, file), tga_error(),
-                "Unable to write TGA ID Field.");
-    check(_write_tga_image_data(image, file), tga_error(),
-            "Unable to write TGA Data to file.");
+        check(staged(TGA_STAGE_ID, _write_tga_id_field(image, &writer->sink)),
+                tga_error(), "Unable to write TGA ID Field.");
+    if(_written_color_map_bytes(image))
+        check(staged(TGA_STAGE_COLOR_MAP, _write_tga_color_map(image,
+                &writer->sink)), tga_error(), "Unable to write TGA Color Map.");
+    check(_sink_flush(&writer->sink), tga_error(), "Unable to write header.");
+    return writer;
+error:
+    _tga_row_writer_close(writer, 0);
+    return NULL;
+}
+
+/*
+ * Writes length bytes of pixel data for the rows from first_row on, in stored
+ * order. data is only used until the call returns.
+ */
+int _tga_row_writer_put(TGARowWriter *writer, const uint8_t *data,
+                        size_t length, size_t first_row)
+{
+    if(writer->reverse && writer->encoded)
+    {
+        if(writer->count == writer->capacity)
+        {
+            size_t capacity = writer->capacity ? writer->capacity * 2 : 16;
+            uint8_t **blocks = realloc(writer->blocks,
+                                       capacity * sizeof(uint8_t *));
+            size_t *lengths = NULL;
+            check(blocks, TGA_MEM_ERR, "Unable to grow block list.");
+            writer->blocks = blocks;
+            lengths = realloc(writer->lengths, capacity * sizeof(size_t));
+            check(lengths, TGA_MEM_ERR, "Unable to grow block list.");
+            writer->lengths = lengths;
+            writer->capacity = capacity;
+        }
+        writer->blocks[writer->count] = _tga_malloc(length ? length : 1);
+        check(writer->blocks[writer->count], TGA_MEM_ERR,
+                "Unable to hold encoded rows.");
+        memcpy(writer->blocks[writer->count], data, length);
+        writer->lengths[writer->count++] = length;
+        return 1;
+    }
+    if(writer->reverse)
+        check(_tga_fseek(writer->sink.file, (long)(writer->data_start +
+                first_row * writer->row_bytes), SEEK_SET) == 0,
+                TGA_GEN_IO_ERR, "Unable to seek to row %zu.", first_row);
+    check(_sink_queue(&writer->sink, data, length) &&
+            _sink_flush(&writer->sink), tga_error(),
+            "Unable to write image data.");
     return 1;
 error:
-    if(file)
-        fclose(file);
     return 0;
 }
+
+/* Closes the file and frees the writer; returns 0 if closing failed. */
+static int _row_writer_free(TGARowWriter *writer)
+{
+    int closed = writer->sink.file ? fclose(writer->sink.file) : 0;
+    for(size_t i = 0; i < writer->count; i++)
+        free(writer->blocks[i]);
+    free(writer->blocks);
+    free(writer->lengths);
+    free(writer);
+    return closed == 0;
+}
+
+/*
+ * Writes the held back blocks and the footer, then frees the writer. Without
+ * finish the writer is only freed, leaving a partial file.
+ */
+int _tga_row_writer_close(TGARowWriter *writer, int finish)
+{
+    TGAImage *image = NULL;
+    int closed = 0;
+    if(!writer)
+        return 0;
+    image = writer->image;
+    if(finish)
+    {
+        for(size_t i = writer->count; i > 0; i--)
+            check(_sink_queue(&writer->sink, writer->blocks[i - 1],
+                    writer->lengths[i - 1]), tga_error(),
+                    "Unable to write image data.");
+        if(writer->reverse && !writer->encoded)
+            check(_tga_fseek(writer->sink.file, (long)(writer->data_start +
+                    image->_meta->height * writer->row_bytes), SEEK_SET) == 0,
+                    TGA_GEN_IO_ERR, "Unable to seek past image data.");
+        if(image->version == 2)
+            check(staged(TGA_STAGE_FOOTER, _write_tga_footer(&writer->sink)),
+                    tga_error(), "Unable to write TGA Footer.");
+        check(_sink_flush(&writer->sink), tga_error(),
+                "Unable to write TGA Image.");
+    }
+    closed = _row_writer_free(writer);
+    writer = NULL;
+    check(closed || !finish, TGA_WRITE_ERR, "Unable to close written file.");
+    return finish;
+error:
+    if(writer)
+        (void)_row_writer_free(writer);
+    return 0;
+}
+
+uint8_t tga_set_compression(TGAImage *image, TGACompression compression)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(compression == TGA_COMPRESS_NONE || compression == TGA_COMPRESS_RLE ||
+            compression == TGA_COMPRESS_AUTO, TGA_ARG_ERR,
+            "Unknown compression mode %d.", (int)compression);
+    image->_meta->compression = (uint8_t)compression;
+    return 1;
+error:
+    return 0;
+}
+
+TGACompression tga_get_compression(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    return (TGACompression)image->_meta->compression;
+error:
+    return TGA_COMPRESS_NONE;
+}
+
+const uint32_t *tga_get_scanline_offsets(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    return image->_meta->scanline_offsets;
+error:
+    return NULL;
+}
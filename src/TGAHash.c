@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAHash.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * XXH64, following the reference description of the algorithm. Input is read
+ * as little-endian 64-bit lanes so hashes are the same on every platform.
+ */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t _rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t _read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 |
+           (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t _read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t _round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = _rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t _merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= _round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void _tga_hash_init(TGAHashState *state, uint64_t seed)
+{
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+    state->total = 0;
+    state->seed = seed;
+    state->buffered = 0;
+}
+
+void _tga_hash_update(TGAHashState *state, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + length;
+
+    state->total += length;
+    if(state->buffered + length < 32)
+    {
+        memcpy(state->buffer + state->buffered, p, length);
+        state->buffered += length;
+        return;
+    }
+    if(state->buffered)
+    {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, p, fill);
+        for(int i = 0; i < 4; i++)
+            state->v[i] = _round(state->v[i], _read64(state->buffer + i * 8));
+        p += fill;
+        state->buffered = 0;
+    }
+    for(; end - p >= 32; p += 32)
+    {
+        state->v[0] = _round(state->v[0], _read64(p));
+        state->v[1] = _round(state->v[1], _read64(p + 8));
+        state->v[2] = _round(state->v[2], _read64(p + 16));
+        state->v[3] = _round(state->v[3], _read64(p + 24));
+    }
+    state->buffered = (size_t)(end - p);
+    memcpy(state->buffer, p, state->buffered);
+}
+
+uint64_t _tga_hash_final(const TGAHashState *state)
+{
+    const uint8_t *p = state->buffer;
+    const uint8_t *end = p + state->buffered;
+    uint64_t h = 0;
+
+    if(state->total >= 32)
+    {
+        h = _rotl64(state->v[0], 1) + _rotl64(state->v[1], 7) +
+            _rotl64(state->v[2], 12) + _rotl64(state->v[3], 18);
+        for(int i = 0; i < 4; i++)
+            h = _merge_round(h, state->v[i]);
+    }
+    else
+        h = state->seed + PRIME64_5;
+    h += state->total;
+
+    for(; end - p >= 8; p += 8)
+        h = _rotl64(h ^ _round(0, _read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if(end - p >= 4)
+    {
+        h = _rotl64(h ^ (_read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for(; p < end; p++)
+        h = _rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t _tga_hash64(const void *data, size_t length, uint64_t seed)
+{
+    TGAHashState state;
+    _tga_hash_init(&state, seed);
+    _tga_hash_update(&state, data, length);
+    return _tga_hash_final(&state);
+}
+
+static void _hash_update_u64(TGAHashState *state, uint64_t value)
+{
+    uint8_t bytes[8];
+    for(int i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    _tga_hash_update(state, bytes, sizeof(bytes));
+}
+
+/*
+ * Fields the pixel hash depends on besides the pixels. The expanded format
+ * hides the stored depth, so 24-bit and opaque 32-bit copies of an image match.
+ */
+static void _hash_header(TGAHashState *state, TGAImage *image,
+                         TGAHashFormat format)
+{
+    uint8_t fields[6];
+    fields[0] = (uint8_t)(image->_meta->width & 0xFF);
+    fields[1] = (uint8_t)(image->_meta->width >> 8);
+    fields[2] = (uint8_t)(image->_meta->height & 0xFF);
+    fields[3] = (uint8_t)(image->_meta->height >> 8);
+    fields[4] = (uint8_t)format;
+    fields[5] = format == TGA_HASH_BGRA32 ? 32 : image->_meta->pixel_depth;
+    _tga_hash_init(state, 0);
+    _tga_hash_update(state, fields, sizeof(fields));
+}
+
+/* Converts a stored row to the canonical layout: left to right, as format. */
+static const uint8_t *_canonical_row(TGAPixelHasher *hasher, size_t row,
+                                     uint8_t *scratch)
+{
+    TGAImage *image = hasher->image;
+    size_t width = image->_meta->width;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    const uint8_t *in = image->data + row * _tga_row_stride(image);
+    int mirrored = (image->_meta->image_descriptor & TGA_ORIGIN_RIGHT) != 0;
+
+    if(hasher->format == TGA_HASH_NATIVE || bytes == 4)
+    {
+        if(!mirrored)
+            return in;
+        for(size_t x = 0; x < width; x++)
+            memcpy(scratch + (width - 1 - x) * bytes, in + x * bytes, bytes);
+        return scratch;
+    }
+
+    for(size_t x = 0; x < width; x++)
+    {
+        const uint8_t *p = in + x * bytes;
+        uint8_t *out = scratch + (mirrored ? width - 1 - x : x) * 4;
+        if(bytes == 1)
+        {
+            out[0] = out[1] = out[2] = p[0];
+            out[3] = 255;
+        }
+        else if(bytes == 2)
+        {
+            uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8;
+            out[0] = _tga_expand5(v & 31);
+            out[1] = _tga_expand5((v >> 5) & 31);
+            out[2] = _tga_expand5((v >> 10) & 31);
+            out[3] = (v & 0x8000) ? 255 : 0;
+        }
+        else
+        {
+            out[0] = p[0];
+            out[1] = p[1];
+            out[2] = p[2];
+            out[3] = 255;
+        }
+    }
+    return scratch;
+}
+
+static size_t _canonical_stride(TGAPixelHasher *hasher)
+{
+    size_t bytes = _tga_bytes_per_pixel(hasher->image->_meta->pixel_depth);
+    if(hasher->format == TGA_HASH_BGRA32)
+        bytes = 4;
+    return (size_t)hasher->image->_meta->width * bytes;
+}
+
+static void _hash_row(TGAPixelHasher *hasher, size_t row, uint8_t *scratch)
+{
+    const uint8_t *data = _canonical_row(hasher, row, scratch);
+    hasher->rows[_tga_stored_row(hasher->image, row)] =
+        _tga_hash64(data, _canonical_stride(hasher), 0);
+}
+
+int _tga_pixel_hasher_init(TGAPixelHasher *hasher, TGAImage *image,
+                           TGAHashFormat format)
+{
+    size_t height = image->_meta->height;
+    size_t width = image->_meta->width;
+
+    hasher->image = image;
+    hasher->format = format;
+    hasher->rows = NULL;
+    hasher->scratch = NULL;
+    check(format == TGA_HASH_NATIVE || format == TGA_HASH_BGRA32, TGA_ARG_ERR,
+            "Unknown hash format %d.", (int)format);
+    check(image->_meta->pixel_depth >= 1 && image->_meta->pixel_depth <= 32,
+            TGA_UNSUPPORTED, "Unsupported pixel depth %u.",
+            image->_meta->pixel_depth);
+    check(format == TGA_HASH_NATIVE || !tga_has_color_map(image),
+            TGA_UNSUPPORTED, "Color-mapped images only hash natively.");
+    hasher->rows = _tga_malloc((height ? height : 1) * sizeof(uint64_t));
+    hasher->scratch = _tga_malloc(width ? width * 4 : 1);
+    check(hasher->rows && hasher->scratch, TGA_MEM_ERR,
+            "Unable to allocate pixel hash state.");
+    return 1;
+error:
+    _tga_pixel_hasher_free(hasher);
+    return 0;
+}
+
+void _tga_pixel_hasher_row(TGAPixelHasher *hasher, size_t row)
+{
+    _hash_row(hasher, row, hasher->scratch);
+}
+
+uint64_t _tga_pixel_hasher_final(TGAPixelHasher *hasher)
+{
+    TGAHashState state;
+    _hash_header(&state, hasher->image, hasher->format);
+    for(size_t y = 0; y < hasher->image->_meta->height; y++)
+        _hash_update_u64(&state, hasher->rows[y]);
+    return _tga_hash_final(&state);
+}
+
+void _tga_pixel_hasher_free(TGAPixelHasher *hasher)
+{
+    free(hasher->rows);
+    free(hasher->scratch);
+    hasher->rows = NULL;
+    hasher->scratch = NULL;
+}
+
+typedef struct {
+    TGAPixelHasher *hasher;
+    size_t chunk_rows;
+    uint8_t **scratch;
+} TGAHashJob;
+
+static void _hash_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAHashJob *job = ctx;
+    size_t height = job->hasher->image->_meta->height;
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        size_t row = chunk * job->chunk_rows;
+        size_t last = row + job->chunk_rows < height ? row + job->chunk_rows
+                                                     : height;
+        for(; row < last; row++)
+            _hash_row(job->hasher, row, job->scratch[chunk]);
+    }
+}
+
+/*
+ * Hashes the pixels as they would be displayed. The result does not depend on
+ * whether the image was stored RLE compressed, on its origin bits or its ID
+ * field. Returns 0 on error.
+ */
+uint64_t tga_pixel_hash(TGAImage *image, TGAHashFormat format)
+{
+    TGAPixelHasher hasher = { NULL, TGA_HASH_NATIVE, NULL, NULL };
+    TGAHashJob job = { &hasher, 0, NULL };
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    unsigned threads = 1;
+    size_t height = 0;
+    uint64_t hash = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    height = image->_meta->height;
+    check(height == 0 || image->_meta->width == 0 || _tga_pixels(image),
+            TGA_INV_IMAGE_PNT, "Image data missing.");
+    check(_tga_pixel_hasher_init(&hasher, image, format), tga_error(),
+            "Unable to start pixel hash.");
+
+    threads = _tga_threads_for(_tga_row_stride(image) * height);
+    if(threads > height)
+        threads = height ? (unsigned)height : 1;
+    scratch[0] = hasher.scratch;
+    for(unsigned i = 1; i < threads; i++)
+    {
+        scratch[i] = _tga_malloc((size_t)image->_meta->width * 4);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+    }
+    job.chunk_rows = (height + threads - 1) / threads;
+    job.scratch = scratch;
+    if(image->_meta->width && height)
+        _tga_parallel_for(threads, threads, _hash_chunks, &job);
+    hash = _tga_pixel_hasher_final(&hasher);
+
+error:
+    for(unsigned i = 1; i < threads; i++)
+        free(scratch[i]);
+    _tga_pixel_hasher_free(&hasher);
+    return hash;
+}
+
+/*
+ * Hash of the fields tga_pixel_hash covers besides the pixels. Images whose
+ * header hashes differ cannot have equal pixel hashes, so candidates can be
+ * rejected before any pixel data is read.
+ */
+uint64_t tga_header_hash(TGAImage *image, TGAHashFormat format)
+{
+    TGAHashState state;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(format == TGA_HASH_NATIVE || format == TGA_HASH_BGRA32, TGA_ARG_ERR,
+            "Unknown hash format %d.", (int)format);
+    _hash_header(&state, image, format);
+    return _tga_hash_final(&state);
+error:
+    return 0;
+}
@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+/*
+ * Image statistics. Everything except the distinct colour count is derived
+ * from per-channel histograms, so the pixel loops do nothing but count.
+ * Consecutive pixels are counted into TGA_HIST_COPIES separate copies of each
+ * histogram in turn: neighbouring pixels often share a value, and with a
+ * single table every increment would wait on the store of the one before.
+ * The copies are summed once at the end. 16-bit pixels are counted by their
+ * 5-bit fields as stored, without expanding them to 8 bits.
+ *
+ * Distinct colours are counted exactly with a bitmap for 8 and 16-bit images
+ * and estimated with a HyperLogLog sketch for 24 and 32-bit ones.
+ */
+
+#define TGA_HIST_COPIES     4
+#define TGA_HLL_BITS        14      /* 16384 registers, about 0.8% error. */
+#define TGA_HLL_SIZE        ((size_t)1 << TGA_HLL_BITS)
+#define TGA_BITMAP_WORDS    (65536 / 64)
+
+/*
+ * Per-chunk counters. A chunk has at most 65535 rows, and each copy counts
+ * at most a quarter of a row's pixels plus the three left over, so no
+ * counter exceeds 65535 * 16386 (about 2^30) and 32 bits cannot overflow.
+ */
+typedef struct {
+    uint32_t hist[TGA_HIST_COPIES][4][256];
+    uint64_t bitmap[TGA_BITMAP_WORDS];
+    uint8_t hll[TGA_HLL_SIZE];
+} TGAStatsAccum;
+
+typedef struct {
+    TGAImage *image;
+    unsigned flags;
+    size_t stride;
+    size_t bytes;
+    size_t chunk_rows;
+    uint32_t value_mask;        /* Drops the 16-bit alpha bit if unused. */
+    TGAStatsAccum **accums;     /* One per chunk. */
+} TGAStatsJob;
+
+static inline void _count_channels(const uint8_t *restrict row, size_t width,
+                                   size_t channels,
+                                   uint32_t (*restrict hist)[4][256])
+{
+    size_t x = 0;
+    for(; x + TGA_HIST_COPIES <= width; x += TGA_HIST_COPIES)
+        for(size_t k = 0; k < TGA_HIST_COPIES; k++)
+            for(size_t c = 0; c < channels; c++)
+                hist[k][c][row[(x + k) * channels + c]]++;
+    for(; x < width; x++)
+        for(size_t c = 0; c < channels; c++)
+            hist[0][c][row[x * channels + c]]++;
+}
+
+/* 16-bit pixels hold 5 bits each of blue, green and red and one alpha bit. */
+static void _count_1555(const uint8_t *restrict row, size_t width,
+                        uint32_t (*restrict hist)[4][256])
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        size_t k = x % TGA_HIST_COPIES;
+        uint32_t v = (uint32_t)row[x * 2] | (uint32_t)row[x * 2 + 1] << 8;
+        hist[k][0][v & 31]++;
+        hist[k][1][(v >> 5) & 31]++;
+        hist[k][2][(v >> 10) & 31]++;
+        hist[k][3][v >> 15]++;
+    }
+}
+
+static void _count_row(const uint8_t *row, size_t width, size_t bytes,
+                       uint32_t (*hist)[4][256])
+{
+    switch(bytes)
+    {
+        case 1:
+            _count_channels(row, width, 1, hist);
+            break;
+        case 2:
+            _count_1555(row, width, hist);
+            break;
+        case 3:
+            _count_channels(row, width, 3, hist);
+            break;
+        default:
+            _count_channels(row, width, 4, hist);
+            break;
+    }
+}
+
+static inline uint32_t _pixel_value(const uint8_t *pixel, size_t bytes)
+{
+    uint32_t v = pixel[0];
+    for(size_t i = 1; i < bytes; i++)
+        v |= (uint32_t)pixel[i] << (8 * i);
+    return v;
+}
+
+/* Sets the bit of every 8 or 16-bit value in the row. */
+static void _mark_values(const uint8_t *row, size_t width, size_t bytes,
+                         uint32_t mask, uint64_t *bitmap)
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t v = _pixel_value(row + x * bytes, bytes) & mask;
+        bitmap[v >> 6] |= (uint64_t)1 << (v & 63);
+    }
+}
+
+/* The SplitMix64 finalizer, enough to spread packed pixels over 64 bits. */
+static inline uint64_t _mix64(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+/*
+ * Adds the row's pixels to the sketch. The top bits of a pixel's hash pick a
+ * register, which keeps the longest run of trailing zeros seen in the rest.
+ * Runs of equal pixels only need hashing once.
+ */
+static void _sketch_values(const uint8_t *row, size_t width, size_t bytes,
+                           uint8_t *hll)
+{
+    const uint64_t sentinel = (uint64_t)1 << (64 - TGA_HLL_BITS);
+    uint32_t previous = 0;
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t v = _pixel_value(row + x * bytes, bytes);
+        uint64_t h = 0, w = 0;
+        uint8_t rank = 1;
+        if(x > 0 && v == previous)
+            continue;
+        previous = v;
+        h = _mix64(v);
+        w = (h & (sentinel - 1)) | sentinel;
+        for(; !(w & 1); w >>= 1)
+            rank++;
+        if(rank > hll[h >> (64 - TGA_HLL_BITS)])
+            hll[h >> (64 - TGA_HLL_BITS)] = rank;
+    }
+}
+
+static void _stats_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAStatsJob *job = ctx;
+    size_t width = job->image->_meta->width;
+    size_t height = job->image->_meta->height;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        TGAStatsAccum *acc = job->accums[chunk];
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        for(; y < last; y++)
+        {
+            const uint8_t *row = job->image->data + y * job->stride;
+            if(job->flags & TGA_IMAGE_STATS_HISTOGRAMS)
+                _count_row(row, width, job->bytes, acc->hist);
+            if(!(job->flags & TGA_IMAGE_STATS_UNIQUE))
+                continue;
+            if(job->bytes <= 2)
+                _mark_values(row, width, job->bytes, job->value_mask,
+                             acc->bitmap);
+            else
+                _sketch_values(row, width, job->bytes, acc->hll);
+        }
+    }
+}
+
+static uint64_t _bitmap_count(const uint64_t *bitmap)
+{
+    uint64_t count = 0;
+    for(size_t i = 0; i < TGA_BITMAP_WORDS; i++)
+        for(uint64_t w = bitmap[i]; w; w &= w - 1)
+            count++;
+    return count;
+}
+
+/* HyperLogLog estimate, with linear counting for small cardinalities. */
+static uint64_t _hll_estimate(const uint8_t *hll)
+{
+    double m = (double)TGA_HLL_SIZE, sum = 0.0, estimate = 0.0;
+    size_t zeros = 0;
+    for(size_t i = 0; i < TGA_HLL_SIZE; i++)
+    {
+        sum += ldexp(1.0, -(int)hll[i]);
+        zeros += hll[i] == 0;
+    }
+    estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if(estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / (double)zeros);
+    return (uint64_t)(estimate + 0.5);
+}
+
+/* Fills the histogram-derived fields from the summed histograms. */
+static void _finish_channels(TGAImageStats *stats, size_t bins[4],
+                             int has_alpha)
+{
+    for(size_t c = 0; c < stats->channels; c++)
+    {
+        const uint64_t *hist = stats->histogram[c];
+        double sum = 0.0;
+        size_t lo = 0, hi = bins[c] - 1;
+        while(lo < hi && hist[lo] == 0)
+            lo++;
+        while(hi > lo && hist[hi] == 0)
+            hi--;
+        for(size_t v = lo; v <= hi; v++)
+            sum += (double)hist[v] * (double)v;
+        stats->min[c] = (uint8_t)lo;
+        stats->max[c] = (uint8_t)hi;
+        stats->mean[c] = sum / (double)stats->pixels;
+    }
+    stats->alpha_coverage = 1.0;
+    if(has_alpha)
+        stats->alpha_coverage = (double)(stats->pixels -
+            stats->histogram[3][0]) / (double)stats->pixels;
+}
+
+/*
+ * Computes the statistics selected by flags (TGA_IMAGE_STATS_*) in a single
+ * pass over the pixels. Large images are split across tga_get_thread_count
+ * threads; every thread counts into its own histograms and sketch, which are
+ * merged at the end.
+ */
+int tga_compute_stats(TGAImage *image, unsigned flags, TGAImageStats *stats)
+{
+    TGAStatsJob job = {0};
+    TGAStatsAccum *accums[TGA_MAX_THREADS] = {0};
+    size_t width = 0, height = 0;
+    size_t bins[4] = {256, 256, 256, 256};
+    unsigned threads = 0, chunks = 0;
+    uint8_t attributes = 0;
+    int has_alpha = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(stats, TGA_ARG_ERR, "Invalid stats pointer.");
+    check(!(flags & ~(unsigned)TGA_IMAGE_STATS_ALL), TGA_ARG_ERR,
+            "Unknown statistics flags: %#x.", flags);
+    check(image->_meta->image_type == TGA_TRUECOLOR ||
+            image->_meta->image_type == TGA_MONOCHROME, TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images have statistics.");
+
+    memset(stats, 0, sizeof(*stats));
+    width = image->_meta->width;
+    height = image->_meta->height;
+    job.bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    attributes = image->_meta->image_descriptor & 15;
+    has_alpha = job.bytes == 4 || (job.bytes == 2 && attributes != 0);
+    stats->channels = job.bytes == 1 ? 1 : job.bytes == 3 ? 3 : 4;
+    stats->pixels = (uint64_t)width * height;
+    if(stats->pixels == 0)
+        return 1;
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    job.image = image;
+    job.flags = flags;
+    job.stride = _tga_row_stride(image);
+    job.value_mask = job.bytes == 2 && !has_alpha ? 0x7FFF : 0xFFFF;
+    threads = _tga_threads_for(job.stride * height);
+    if(threads > height)
+        threads = (unsigned)height;
+    chunks = threads;
+    job.chunk_rows = (height + chunks - 1) / chunks;
+    job.accums = accums;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        accums[i] = _tga_malloc(sizeof(TGAStatsAccum));
+        check(accums[i], TGA_MEM_ERR, "Unable to allocate histograms.");
+        memset(accums[i], 0, sizeof(TGAStatsAccum));
+    }
+
+    _tga_parallel_for(chunks, threads, _stats_chunks, &job);
+
+    for(unsigned i = 1; i < chunks; i++)
+    {
+        for(size_t w = 0; w < TGA_BITMAP_WORDS; w++)
+            accums[0]->bitmap[w] |= accums[i]->bitmap[w];
+        for(size_t r = 0; r < TGA_HLL_SIZE; r++)
+            if(accums[i]->hll[r] > accums[0]->hll[r])
+                accums[0]->hll[r] = accums[i]->hll[r];
+    }
+    if(flags & TGA_IMAGE_STATS_HISTOGRAMS)
+    {
+        for(unsigned i = 0; i < chunks; i++)
+            for(size_t k = 0; k < TGA_HIST_COPIES; k++)
+                for(size_t c = 0; c < stats->channels; c++)
+                    for(size_t v = 0; v < 256; v++)
+                        stats->histogram[c][v] += accums[i]->hist[k][c][v];
+        if(job.bytes == 2)
+        {
+            bins[0] = bins[1] = bins[2] = 32;
+            bins[3] = 2;
+        }
+        _finish_channels(stats, bins, has_alpha);
+    }
+    if(flags & TGA_IMAGE_STATS_UNIQUE)
+    {
+        stats->unique_exact = job.bytes <= 2;
+        stats->unique_colors = stats->unique_exact ?
+            _bitmap_count(accums[0]->bitmap) : _hll_estimate(accums[0]->hll);
+        if(stats->unique_colors > stats->pixels)
+            stats->unique_colors = stats->pixels;
+        if(stats->unique_colors == 0)
+            stats->unique_colors = 1;
+    }
+
+    for(unsigned i = 0; i < chunks; i++)
+        free(accums[i]);
+    return 1;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(accums[i]);
+    return 0;
+}
@@ -4,11 +4,12 @@
 #include <TGAImage.h>
 #include "Private/TGAPrivate.h"
 
-TGAError tga_err = TGA_NO_ERR;
-char tga_err_string[TGA_ERR_MAX] = {0};
+TGA_THREAD_LOCAL TGAError tga_err = TGA_NO_ERR;
+TGA_THREAD_LOCAL char tga_err_string[TGA_ERR_MAX] = {0};
 
 static int _coordinate_sanity(TGAImage *image, uint16_t x, uint16_t y)
 {
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
     check(x < tga_get_width(image), TGA_ARG_ERR, "X coordinate is larger than"
             " image width. X: %d, WIDTH: %d", x, tga_get_width(image));
     check(y < tga_get_height(image), TGA_ARG_ERR, "Y coordinate is larger "
@@ -37,17 +38,15 @@ static void _normalize_coordinates(TGAImage *image, uint16_t *x, uint16_t *y)
 static int _allocate_tga_data(TGAImage *image, uint8_t depth,
                               uint16_t width, uint16_t height)
 {
-    int bytes = (depth + 7)/8;
+    size_t size = 0;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGA Image.");
-    image->data = malloc(bytes * sizeof(uint8_t) * width * height);
-    check(image->data, TGA_MEM_ERR, "Out of memory.");
-    memset(image->data, 0, bytes * sizeof(uint8_t) * width * height);
+    check(_tga_pixel_bytes(width, height, depth, &size), TGA_MEM_ERR,
+            "Image of %ux%u at %u bits is too large.", width, height, depth);
+    check(_tga_alloc_pixels(image, size, true), tga_error(), "Out of memory.");
     return 1;
 
 error:
-    if(image->data)
-        free(image->data);
-    image->data = NULL;
+    _tga_free_pixels(image);
     return 0;
 }
 
@@ -55,13 +54,28 @@ error:
 TGAImage *new_tga_image(TGAColorType ct, uint8_t depth,
                         uint16_t width, uint16_t height)
 {
-    TGAImage *image = malloc(sizeof(TGAImage));
+    TGAImage *image = _tga_malloc(sizeof(TGAImage));
     check(image, TGA_MEM_ERR, "Unable to allocate memory for new TGAImage.");
-    image->_meta = malloc(sizeof(struct _NY_TgaMeta));
+    image->_meta = _tga_malloc(sizeof(struct _NY_TgaMeta));
     check(image->_meta, TGA_MEM_ERR, "Unable to allocate memory for TGA Metadata.");
     image->id_field = NULL;
+    image->data = NULL;
+    image->color_map = NULL;
     image->version = 2;
     memset(image->__padding, '\0', sizeof(image->__padding));
+    image->_meta->data_size = 0;
+    image->_meta->data_mapped = 0;
+    image->_meta->scanline_offsets = NULL;
+    image->_meta->cache_entry = NULL;
+    image->_meta->color_correction = NULL;
+    image->_meta->lazy = NULL;
+    image->_meta->shared = NULL;
+    image->_meta->row_stride = 0;
+    image->_meta->developer_tags = NULL;
+    image->_meta->developer_tag_count = 0;
+    image->_meta->gamma_numerator = 0;
+    image->_meta->gamma_denominator = 0;
+    image->_meta->compression = TGA_COMPRESS_NONE;
 
     if(ct != TGA_NO_DATA)
         if(!_allocate_tga_data(image, depth, width, height))
@@ -86,7 +100,6 @@ TGAImage *new_tga_image(TGAColorType ct, uint8_t depth,
     {
         image->_meta->image_descriptor |= (depth == 16) ? 1 : 15;
     }*/
-    memset(image->_meta->__padding, '\0', sizeof(image->_meta->__padding));
 
     return image;
 
@@ -102,20 +115,145 @@ error:
     return NULL;
 }
 
+/* Images handed out by tga_cache_get are only released, never freed here. */
 void free_tga_image(TGAImage *image)
 {
+    if(image && image->_meta && image->_meta->cache_entry)
+    {
+        _tga_cache_release(image);
+        return;
+    }
     if(image)
     {
+        _tga_free_pixels(image);
         if(image->_meta)
+        {
+            free(image->_meta->scanline_offsets);
+            free(image->_meta->color_correction);
+            free(image->_meta->developer_tags);
+            if(image->_meta->lazy && image->_meta->lazy->src.file)
+                fclose(image->_meta->lazy->src.file);
+            free(image->_meta->lazy);
             free(image->_meta);
+        }
         if(image->id_field)
             free(image->id_field);
-        if(image->data)
-            free(image->data);
+        if(image->color_map)
+            free(image->color_map);
         free(image);
     }
 }
 
+/*
+ * New image with the metadata of image and no pixels. Pointers owned by the
+ * metadata are copied or left unset, never shared.
+ */
+static TGAImage *_tga_copy_meta(TGAImage *image)
+{
+    TGAImage *out = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    size_t c_map_size = _tga_color_map_bytes(image);
+    check(out, tga_error(), "Unable to create image.");
+    *out->_meta = *image->_meta;
+    out->_meta->data_size = 0;
+    out->_meta->data_mapped = 0;
+    out->_meta->scanline_offsets = NULL;
+    out->_meta->cache_entry = NULL;
+    out->_meta->color_correction = NULL;
+    out->_meta->lazy = NULL;
+    out->_meta->shared = NULL;
+    out->_meta->row_stride = 0;
+    out->_meta->developer_tags = NULL;
+    out->_meta->developer_tag_count = 0;
+    out->version = image->version;
+
+    if(image->_meta->id_length && image->id_field)
+    {
+        out->id_field = _tga_malloc(image->_meta->id_length);
+        check(out->id_field, TGA_MEM_ERR, "Unable to copy ID field.");
+        memcpy(out->id_field, image->id_field, image->_meta->id_length);
+    }
+    if(c_map_size && image->color_map)
+    {
+        out->color_map = _tga_malloc(c_map_size);
+        check(out->color_map, TGA_MEM_ERR, "Unable to copy color map.");
+        memcpy(out->color_map, image->color_map, c_map_size);
+    }
+    if(image->_meta->color_correction)
+    {
+        out->_meta->color_correction = _tga_malloc(TGA_COLOR_CORRECTION_SIZE);
+        check(out->_meta->color_correction, TGA_MEM_ERR,
+                "Unable to copy color correction table.");
+        memcpy(out->_meta->color_correction, image->_meta->color_correction,
+               TGA_COLOR_CORRECTION_SIZE);
+    }
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
+/*
+ * Copy of an image that shares its pixels until either is changed, when the
+ * changed one takes a copy of its own.
+ */
+TGAImage *tga_clone(TGAImage *image)
+{
+    TGAImage *out = NULL;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    out = _tga_copy_meta(image);
+    check(out, tga_error(), "Unable to clone image.");
+    if(_tga_pixels(image))
+    {
+        check(_tga_share_pixels(image, out, 0), tga_error(),
+                "Unable to share pixels.");
+        out->_meta->row_stride = image->_meta->row_stride;
+    }
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
+/*
+ * View of the w x h rectangle at (x, y), in top-left coordinates, sharing the
+ * pixels of image. The view keeps the origin and row stride of its parent, so
+ * no pixels are copied until one of the two is changed.
+ */
+TGAImage *tga_subimage(TGAImage *image, uint16_t x, uint16_t y, uint16_t w,
+                       uint16_t h)
+{
+    TGAImage *out = NULL;
+    size_t row = 0, column = 0;
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(w > 0 && h > 0 && (uint32_t)x + w <= image->_meta->width &&
+            (uint32_t)y + h <= image->_meta->height, TGA_ARG_ERR,
+            "Rectangle %ux%u at (%u, %u) is outside the %ux%u image.", w, h,
+            x, y, image->_meta->width, image->_meta->height);
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+    out = _tga_copy_meta(image);
+    check(out, tga_error(), "Unable to create view.");
+    out->_meta->width = w;
+    out->_meta->height = h;
+
+    /* Stored position of the view's first stored pixel. */
+    row = image->_meta->image_descriptor & TGA_ORIGIN_TOP ? y :
+          (size_t)image->_meta->height - y - h;
+    column = image->_meta->image_descriptor & TGA_ORIGIN_RIGHT ?
+             (size_t)image->_meta->width - x - w : x;
+    check(_tga_share_pixels(image, out, row * _tga_row_stride(image) +
+            column * _tga_bytes_per_pixel(image->_meta->pixel_depth)),
+            tga_error(), "Unable to share pixels.");
+    if(_tga_row_stride(image) != _tga_row_bytes(out))
+        out->_meta->row_stride = (uint32_t)_tga_row_stride(image);
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
 uint8_t tga_get_id_field_length(TGAImage *image)
 {
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
@@ -223,17 +361,41 @@ error:
 uint32_t tga_get_extension_offset(TGAImage *image)
 {
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
-    return 0;
-error:
     return image->_meta->extension_offset;
+error:
+    return 0;
 }
 
 uint32_t tga_get_developer_offset(TGAImage *image)
 {
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    return image->_meta->developer_offset;
+error:
     return 0;
+}
+
+/* Gamma from the extension area, or 0 if the file does not give one. */
+double tga_get_gamma(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    if(image->_meta->gamma_denominator == 0)
+        return 0.0;
+    return (double)image->_meta->gamma_numerator /
+           image->_meta->gamma_denominator;
 error:
-    return image->_meta->developer_offset;
+    return 0.0;
+}
+
+/*
+ * The extension area's colour correction table: 256 entries of 16-bit alpha,
+ * red, green and blue. NULL if the file has none.
+ */
+const uint16_t *tga_get_color_correction(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
+    return image->_meta->color_correction;
+error:
+    return NULL;
 }
 
 void tga_get_origin_coordinates(TGAImage *image, int *x, int *y)
@@ -266,9 +428,8 @@ uint8_t tga_is_monochrome(TGAImage *image)
 /* IMPLEMENTED: TGA_TRUECOLOR, TGA_MONOCHROME */
 static uint8_t *_get_pixel_point_at(TGAImage *image, uint16_t x, uint16_t y)
 {
-    uint8_t depth = (uint8_t)((tga_get_pixel_depth(image)+7)/8);
-    uint32_t row_width = tga_get_width(image)*depth;
-    return image->data + (y * row_width) + (x * depth);
+    size_t depth = _tga_bytes_per_pixel(tga_get_pixel_depth(image));
+    return image->data + (y * _tga_row_stride(image)) + (x * depth);
 }
 
 uint8_t tga_get_red_at(TGAImage *image, uint16_t x, uint16_t y)
@@ -391,6 +552,8 @@ uint8_t tga_set_red_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t red)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     if(tga_is_monochrome(image))
         fail(TGA_TYPE_ERR, "Can't set red channel on monochrome image.");
 
@@ -424,6 +587,8 @@ uint8_t tga_set_green_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t green)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     if(tga_is_monochrome(image))
         fail(TGA_TYPE_ERR, "Can't set green channel on monochrome image.");
 
@@ -458,6 +623,8 @@ uint8_t tga_set_blue_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t blue)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     if(tga_is_monochrome(image))
         fail(TGA_TYPE_ERR, "Can't set blue channel on monochrome image.");
 
@@ -491,6 +658,8 @@ uint8_t tga_set_alpha_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t alpha)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     if(tga_is_monochrome(image))
         fail(TGA_TYPE_ERR, "Can't set alpha channel on monochrome image.");
 
@@ -522,6 +691,8 @@ uint8_t tga_set_mono_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t mono)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Passed.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     if(!tga_is_monochrome(image))
         fail(TGA_TYPE_ERR,"Can't set monochrome value on non-monochrome image");
     uint8_t *pixel = _get_pixel_point_at(image, x, y);
@@ -538,9 +709,12 @@ error:
 uint8_t *tga_create_pixel_for_image(TGAImage *image,
                                     uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 {
+    uint8_t depth = 0;
+    uint8_t *pixel = NULL;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
-    uint8_t depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
-    uint8_t *pixel = malloc(sizeof(uint8_t) * depth);
+    depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
+    pixel = _tga_malloc(sizeof(uint8_t) * depth);
+    check(pixel, TGA_MEM_ERR, "Unable to allocate pixel.");
     memset(pixel, 0, sizeof(uint8_t)*depth);
     if(tga_is_monochrome(image))
         fail(TGA_TYPE_ERR, "Can't create pixel for monochrome image. "
@@ -598,12 +772,16 @@ void tga_free_pixel(uint8_t *pixel)
 
 uint8_t *tga_get_pixel_copy_at(TGAImage *image, uint16_t x, uint16_t y)
 {
+    uint8_t depth = 0;
+    uint8_t *pixel = NULL;
+    uint8_t *new_pixel = NULL;
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
-    uint8_t depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
-    uint8_t *pixel = _get_pixel_point_at(image, x, y);
-    uint8_t *new_pixel = malloc(sizeof(uint8_t) * depth);
+    depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
+    pixel = _get_pixel_point_at(image, x, y);
+    new_pixel = _tga_malloc(sizeof(uint8_t) * depth);
+    check(new_pixel, TGA_MEM_ERR, "Unable to allocate pixel.");
     switch(depth)
     {
         case 1:
@@ -638,11 +816,13 @@ uint8_t tga_set_pixel_at(TGAImage *image, uint16_t x, uint16_t y, uint8_t *pix)
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     check(pix, TGA_ARG_ERR, "Pixel data is NULL.");
 
-    uint8_t depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
-    uint64_t data_offset = (y * tga_get_width(image) * depth) + (x * depth);
-    for(int i = 0; i < depth; i++)
+    size_t depth = _tga_bytes_per_pixel(tga_get_pixel_depth(image));
+    size_t data_offset = (y * _tga_row_stride(image)) + (x * depth);
+    for(size_t i = 0; i < depth; i++)
     {
         image->data[data_offset + i] = pix[i];
     }
@@ -657,14 +837,16 @@ uint8_t tga_set_pixel_block(TGAImage *image, uint16_t x, uint16_t y,
     check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
     _normalize_coordinates(image, &x, &y);
     check(_coordinate_sanity(image, x, y), tga_error(), tga_error_str());
+    check(_tga_writable_pixels(image), tga_error(),
+            "Unable to copy shared pixels.");
     check(pixel, TGA_ARG_ERR, "Pixel data is NULL.");
 
-    uint8_t depth = (uint8_t)((tga_get_pixel_depth(image) + 7) / 8);
-    uint64_t line_offset = 0;
-    for(uint16_t line = y; line < height+y; line++)
+    size_t depth = _tga_bytes_per_pixel(tga_get_pixel_depth(image));
+    size_t line_offset = 0;
+    for(uint32_t line = y; line < (uint32_t)height + y; line++)
     {
-        line_offset = (line*tga_get_width(image)*depth);
-        for(uint16_t loc = x; loc < width+x; loc++)
+        line_offset = line * _tga_row_stride(image);
+        for(uint32_t loc = x; loc < (uint32_t)width + x; loc++)
         {
             memcpy(image->data + line_offset + (loc * depth), pixel, depth);
         }
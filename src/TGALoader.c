@@ -0,0 +1,735 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+#ifdef TGA_HAVE_IO_URING
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#endif
+
+#define TGA_LOADER_DEFAULT_DEPTH 8
+#define TGA_LOADER_MAX_READ (1u << 30) /* Largest single read request */
+
+typedef enum {
+    TGA_JOB_QUEUED,     /* Submitted, not started */
+    TGA_JOB_READING,    /* File I/O in progress */
+    TGA_JOB_READ,       /* File contents in memory, waiting for a decoder */
+    TGA_JOB_DECODING,
+    TGA_JOB_DONE
+} TGAJobState;
+
+typedef struct _TGALoadJob {
+    struct _TGALoadJob *next;
+    char *path;
+    void *user;
+    TGAJobState state;
+    int fd;
+    uint8_t *buffer;
+    size_t length;
+    size_t done;
+    TGAImage *image;
+    TGAError error;
+    char error_str[TGA_ERR_MAX];
+} TGALoadJob;
+
+#ifdef TGA_HAVE_IO_URING
+/* Minimal io_uring ring, driven through the raw system calls. */
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned to_submit;
+    int failed;             /* io_uring_enter failed; reads use pread */
+} TGARing;
+#endif
+
+struct NyTGA_Loader {
+    TGALoadJob *head;       /* Unconsumed jobs, in submission order */
+    TGALoadJob *tail;
+    unsigned depth;
+    unsigned started;       /* Jobs started but not yet consumed */
+    unsigned in_flight;     /* Reads currently queued on the ring */
+    int shutdown;
+#ifdef TGA_HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t *threads;
+    unsigned thread_count;
+    pthread_t io_thread;
+#endif
+#ifdef TGA_HAVE_IO_URING
+    TGARing ring;
+    int io_started;         /* io_thread was created and must be joined */
+#endif
+    int use_io_uring;
+};
+
+static void _job_fail(TGALoadJob *job)
+{
+    job->image = NULL;
+    job->error = tga_error() != TGA_NO_ERR ? tga_error() : TGA_READ_ERR;
+    snprintf(job->error_str, sizeof(job->error_str), "%s", tga_error_str());
+    tga_clear_error();
+}
+
+/* Loads a job completely on the calling thread. */
+static void _job_load_sync(TGALoadJob *job)
+{
+    FILE *file = fopen(job->path, "rb");
+    job->image = NULL;
+    check(file, TGA_INV_FILE_NAME, "Unable to open %s.", job->path);
+    job->image = read_tga_image(file);
+    fclose(file);
+    check(job->image, tga_error(), "%s", tga_error_str());
+    return;
+error:
+    _job_fail(job);
+}
+
+#ifdef TGA_HAVE_PTHREADS
+static void _job_decode(TGALoadJob *job)
+{
+    job->image = read_tga_image_from_memory(job->buffer, job->length);
+    if(!job->image)
+        _job_fail(job);
+    free(job->buffer);
+    job->buffer = NULL;
+}
+
+/* First job in the given state, NULL if there is none. */
+static TGALoadJob *_find_job(TGALoader *loader, TGAJobState state)
+{
+    TGALoadJob *job = loader->head;
+    while(job && job->state != state)
+        job = job->next;
+    return job;
+}
+
+/* Whether another job may be started without exceeding the read-ahead. */
+static int _may_start(TGALoader *loader)
+{
+    return loader->started < loader->depth * 2;
+}
+#endif/*TGA_HAVE_PTHREADS*/
+
+#ifdef TGA_HAVE_IO_URING
+static int _ring_setup(TGARing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    long fd = -1;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = -1;
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0)
+        return 0;
+    ring->fd = (int)fd;
+    /* IORING_OP_READ arrived in the same kernel as this feature bit. */
+    if(!(params.features & IORING_FEAT_RW_CUR_POS))
+        goto error;
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED)
+        goto error;
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED)
+            goto error;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto error;
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ptr +
+                                  params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ptr +
+                                  params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+                                         params.cq_off.cqes);
+    return 1;
+
+error:
+    if(ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr && ring->cq_ptr != MAP_FAILED &&
+       ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if(ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    return 0;
+}
+
+static void _ring_free(TGARing *ring)
+{
+    if(ring->fd < 0)
+        return;
+    munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Queues a read of the remainder of the job's file. */
+static void _ring_queue_read(TGARing *ring, TGALoadJob *job)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    size_t remaining = job->length - job->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = job->fd;
+    sqe->off = job->done;
+    sqe->addr = (uint64_t)(uintptr_t)(job->buffer + job->done);
+    sqe->len = (uint32_t)(remaining < TGA_LOADER_MAX_READ ?
+                          remaining : TGA_LOADER_MAX_READ);
+    sqe->user_data = (uint64_t)(uintptr_t)job;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/* Opens the file and allocates its buffer. The read itself is queued later. */
+static int _job_open(TGALoadJob *job)
+{
+    struct stat st;
+    job->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    check(job->fd >= 0, TGA_INV_FILE_NAME, "Unable to open %s.", job->path);
+    check(fstat(job->fd, &st) == 0, TGA_GEN_IO_ERR, "Unable to stat %s.",
+            job->path);
+    check(st.st_size > 0, TGA_READ_ERR, "%s is empty.", job->path);
+    job->length = (size_t)st.st_size;
+    job->done = 0;
+    job->buffer = _tga_malloc(job->length);
+    check(job->buffer, TGA_MEM_ERR, "Unable to allocate read buffer.");
+    return 1;
+error:
+    if(job->fd >= 0)
+        close(job->fd);
+    job->fd = -1;
+    _job_fail(job);
+    return 0;
+}
+
+/* Reads the remainder of the job's file with blocking reads. */
+static void _job_read_rest(TGALoadJob *job)
+{
+    ssize_t res = 0;
+    while(job->done < job->length)
+    {
+        size_t remaining = job->length - job->done;
+        res = pread(job->fd, job->buffer + job->done,
+                    remaining < TGA_LOADER_MAX_READ ?
+                    remaining : TGA_LOADER_MAX_READ, (off_t)job->done);
+        if(res < 0 && errno == EINTR)
+            continue;
+        check(res >= 0, TGA_READ_ERR, "Unable to read %s: %s", job->path,
+                strerror(errno));
+        check(res > 0, TGA_READ_ERR, "Unexpected end of file in %s.",
+                job->path);
+        job->done += (size_t)res;
+        stat_add(read_calls, 1);
+        stat_add(bytes_read, res);
+    }
+    close(job->fd);
+    job->fd = -1;
+    return;
+error:
+    close(job->fd);
+    job->fd = -1;
+    free(job->buffer);
+    job->buffer = NULL;
+    _job_fail(job);
+}
+
+/* Handles one completion. Returns 1 if the job's file is fully read. */
+static int _job_complete_read(TGARing *ring, TGALoadJob *job, int res)
+{
+    check(res >= 0, TGA_READ_ERR, "Unable to read %s: %s", job->path,
+            strerror(-res));
+    check(res > 0, TGA_READ_ERR, "Unexpected end of file in %s.", job->path);
+    job->done += (size_t)res;
+    stat_add(read_calls, 1);
+    stat_add(bytes_read, res);
+    if(job->done < job->length && !ring->failed)
+    {
+        _ring_queue_read(ring, job); /* Short read, ask for the rest. */
+        return 0;
+    }
+    if(job->done < job->length)
+    {
+        _job_read_rest(job);
+        return 1;
+    }
+    close(job->fd);
+    job->fd = -1;
+    return 1;
+error:
+    close(job->fd);
+    job->fd = -1;
+    free(job->buffer);
+    job->buffer = NULL;
+    _job_fail(job);
+    return 1;
+}
+
+/*
+ * Hands a job whose read has ended to the decode threads, or to the caller if
+ * it failed. Must be called with the lock held.
+ */
+static void _job_read_ended(TGALoader *loader, TGALoadJob *job)
+{
+    if(job->buffer)
+    {
+        job->state = TGA_JOB_READ;
+        pthread_cond_broadcast(&loader->work);
+    }
+    else
+    {
+        job->state = TGA_JOB_DONE;
+        pthread_cond_broadcast(&loader->done);
+    }
+}
+
+/*
+ * Stops using the ring once io_uring_enter fails with anything but EINTR, as
+ * retrying a persistent error (EBUSY, ENOMEM, ...) would spin forever. Reads
+ * that were never submitted are done with pread instead. Those the kernel
+ * already accepted may still write to their buffers, so they are left to
+ * complete and are reaped as before.
+ */
+static void _ring_abandon(TGALoader *loader)
+{
+    TGARing *ring = &loader->ring;
+    unsigned tail = *ring->sq_tail;
+    TGALoadJob *job = NULL;
+
+    ring->failed = 1;
+    for(unsigned i = tail - ring->to_submit; i != tail; i++)
+    {
+        job = (TGALoadJob *)(uintptr_t)
+              ring->sqes[ring->sq_array[i & ring->sq_mask]].user_data;
+        _job_read_rest(job);
+        pthread_mutex_lock(&loader->lock);
+        loader->in_flight--;
+        _job_read_ended(loader, job);
+        pthread_mutex_unlock(&loader->lock);
+    }
+    __atomic_store_n(ring->sq_tail, tail - ring->to_submit, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+}
+
+/*
+ * The I/O thread keeps up to `depth` reads queued on the ring and hands
+ * finished buffers to the decode threads, so decoding of one file overlaps
+ * with the reads of the following ones.
+ */
+static void *_io_thread(void *arg)
+{
+    TGALoader *loader = arg;
+    TGARing *ring = &loader->ring;
+    TGALoadJob *job = NULL;
+    unsigned head, tail;
+    int finished;
+    long res;
+
+    pthread_mutex_lock(&loader->lock);
+    for(;;)
+    {
+        while(!loader->shutdown && loader->in_flight < loader->depth &&
+              _may_start(loader) && (job = _find_job(loader, TGA_JOB_QUEUED)))
+        {
+            job->state = TGA_JOB_READING;
+            loader->started++;
+            pthread_mutex_unlock(&loader->lock);
+            finished = !_job_open(job);
+            if(!finished && ring->failed)
+            {
+                _job_read_rest(job);
+                finished = 1;
+            }
+            else if(!finished)
+                _ring_queue_read(ring, job);
+            pthread_mutex_lock(&loader->lock);
+            if(finished)
+                _job_read_ended(loader, job);
+            else
+                loader->in_flight++;
+        }
+        if(loader->in_flight == 0)
+        {
+            if(loader->shutdown)
+                break;
+            pthread_cond_wait(&loader->work, &loader->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&loader->lock);
+
+        if(!ring->failed)
+        {
+            do
+                res = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                              1, IORING_ENTER_GETEVENTS, NULL, 0);
+            while(res < 0 && errno == EINTR);
+            if(res < 0)
+                _ring_abandon(loader);
+            else if(res > 0)
+                ring->to_submit -= (unsigned)res < ring->to_submit ?
+                                   (unsigned)res : ring->to_submit;
+        }
+        else
+        {
+            /* Poll for the reads the kernel accepted before the failure. */
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&loader->lock);
+        for(; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            job = (TGALoadJob *)(uintptr_t)cqe->user_data;
+            pthread_mutex_unlock(&loader->lock);
+            finished = _job_complete_read(ring, job, cqe->res);
+            pthread_mutex_lock(&loader->lock);
+            if(!finished)
+                continue;
+            loader->in_flight--;
+            _job_read_ended(loader, job);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+#endif/*TGA_HAVE_IO_URING*/
+
+#ifdef TGA_HAVE_PTHREADS
+/*
+ * Worker threads decode buffers read by the I/O thread. Without io_uring they
+ * perform the whole load themselves, one file per worker.
+ */
+static void *_worker_thread(void *arg)
+{
+    TGALoader *loader = arg;
+    TGALoadJob *job = NULL;
+
+    pthread_mutex_lock(&loader->lock);
+    for(;;)
+    {
+        job = NULL;
+        if(loader->use_io_uring)
+            job = _find_job(loader, TGA_JOB_READ);
+        else if(_may_start(loader))
+            job = _find_job(loader, TGA_JOB_QUEUED);
+        if(!job)
+        {
+            if(loader->shutdown)
+                break;
+            pthread_cond_wait(&loader->work, &loader->lock);
+            continue;
+        }
+        if(!loader->use_io_uring)
+            loader->started++;
+        job->state = TGA_JOB_DECODING;
+        pthread_mutex_unlock(&loader->lock);
+        if(loader->use_io_uring)
+            _job_decode(job);
+        else
+            _job_load_sync(job);
+        pthread_mutex_lock(&loader->lock);
+        job->state = TGA_JOB_DONE;
+        pthread_cond_broadcast(&loader->done);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+#endif/*TGA_HAVE_PTHREADS*/
+
+TGALoader *tga_loader_new(const TGALoaderOptions *options)
+{
+    TGALoader *loader = _tga_malloc(sizeof(TGALoader));
+    unsigned threads = 0;
+    unsigned flags = options ? options->flags : 0;
+#ifdef TGA_HAVE_PTHREADS
+    unsigned i = 0;
+    int locks = 0;
+#endif
+
+    check(loader, TGA_MEM_ERR, "Unable to allocate loader.");
+    memset(loader, 0, sizeof(*loader));
+    loader->depth = options && options->queue_depth ?
+                    options->queue_depth : TGA_LOADER_DEFAULT_DEPTH;
+    threads = options && options->threads ?
+              options->threads : _tga_cpu_count();
+    (void)flags;
+    (void)threads;
+
+#ifdef TGA_HAVE_PTHREADS
+    check(pthread_mutex_init(&loader->lock, NULL) == 0, TGA_INTERNAL_ERR,
+            "Unable to create loader lock.");
+    locks++;
+    check(pthread_cond_init(&loader->work, NULL) == 0, TGA_INTERNAL_ERR,
+            "Unable to create loader condition.");
+    locks++;
+    check(pthread_cond_init(&loader->done, NULL) == 0, TGA_INTERNAL_ERR,
+            "Unable to create loader condition.");
+    locks++;
+
+#ifdef TGA_HAVE_IO_URING
+    if(!(flags & TGA_LOADER_NO_IO_URING))
+        loader->use_io_uring = _ring_setup(&loader->ring, loader->depth);
+    else
+        loader->ring.fd = -1;
+#endif
+    /* Without a ring every worker performs its own blocking read, so there
+     * must be at least one worker per read in flight. */
+    if(!loader->use_io_uring && threads < loader->depth)
+        threads = loader->depth;
+
+    loader->threads = _tga_malloc(sizeof(pthread_t) * threads);
+    check(loader->threads, TGA_MEM_ERR, "Unable to allocate loader threads.");
+    for(i = 0; i < threads; i++)
+    {
+        check(pthread_create(&loader->threads[i], NULL, _worker_thread,
+                             loader) == 0, TGA_INTERNAL_ERR,
+                "Unable to start loader thread.");
+        loader->thread_count++;
+    }
+#ifdef TGA_HAVE_IO_URING
+    if(loader->use_io_uring)
+    {
+        if(pthread_create(&loader->io_thread, NULL, _io_thread, loader) != 0)
+        {
+            _ring_free(&loader->ring);
+            loader->use_io_uring = 0;
+            fail(TGA_INTERNAL_ERR, "Unable to start loader I/O thread.");
+        }
+        loader->io_started = 1;
+    }
+#endif
+#endif/*TGA_HAVE_PTHREADS*/
+    return loader;
+
+error:
+#ifdef TGA_HAVE_PTHREADS
+    if(loader && locks == 3)
+    {
+        tga_loader_free(loader);
+        return NULL;
+    }
+    if(loader && locks > 0)
+        pthread_mutex_destroy(&loader->lock);
+    if(loader && locks > 1)
+        pthread_cond_destroy(&loader->work);
+#endif
+    free(loader);
+    return NULL;
+}
+
+int tga_loader_submit(TGALoader *loader, const char *path, void *user)
+{
+    TGALoadJob *job = NULL;
+    check(loader, TGA_ARG_ERR, "Invalid loader.");
+    check(path && path[0] != '\0', TGA_INV_FILE_NAME, "Invalid path.");
+
+    job = _tga_malloc(sizeof(TGALoadJob));
+    check(job, TGA_MEM_ERR, "Unable to allocate load request.");
+    memset(job, 0, sizeof(*job));
+    job->path = _tga_malloc(strlen(path) + 1);
+    check(job->path, TGA_MEM_ERR, "Unable to allocate load request.");
+    strcpy(job->path, path);
+    job->user = user;
+    job->fd = -1;
+    job->state = TGA_JOB_QUEUED;
+
+#ifdef TGA_HAVE_PTHREADS
+    pthread_mutex_lock(&loader->lock);
+#endif
+    if(loader->tail)
+        loader->tail->next = job;
+    else
+        loader->head = job;
+    loader->tail = job;
+#ifdef TGA_HAVE_PTHREADS
+    pthread_cond_broadcast(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+#endif
+    return 1;
+
+error:
+    if(job)
+        free(job->path);
+    free(job);
+    return 0;
+}
+
+/* Pops the head job into result. Must be called with the lock held. */
+static void _pop_result(TGALoader *loader, TGALoadResult *result)
+{
+    TGALoadJob *job = loader->head;
+    loader->head = job->next;
+    if(!loader->head)
+        loader->tail = NULL;
+    loader->started--;
+    result->image = job->image;
+    result->user = job->user;
+    result->error = job->image ? TGA_NO_ERR : job->error;
+    memcpy(result->error_str, job->error_str, sizeof(result->error_str));
+    free(job->path);
+    free(job);
+#ifdef TGA_HAVE_PTHREADS
+    pthread_cond_broadcast(&loader->work);
+#endif
+}
+
+/* Returns 1 and fills in result if the next image is ready, 0 otherwise. */
+int tga_loader_poll(TGALoader *loader, TGALoadResult *result)
+{
+    int ready = 0;
+    check(loader && result, TGA_ARG_ERR, "Invalid loader or result.");
+#ifdef TGA_HAVE_PTHREADS
+    pthread_mutex_lock(&loader->lock);
+    ready = loader->head && loader->head->state == TGA_JOB_DONE;
+    if(ready)
+        _pop_result(loader, result);
+    pthread_mutex_unlock(&loader->lock);
+#else
+    /* Without threads the work happens here, one file per call. */
+    if(loader->head)
+    {
+        _job_load_sync(loader->head);
+        loader->started++;
+        _pop_result(loader, result);
+        ready = 1;
+    }
+#endif
+    return ready;
+error:
+    return 0;
+}
+
+/* Blocks until the next image is ready. Returns 0 if nothing is pending. */
+int tga_loader_wait(TGALoader *loader, TGALoadResult *result)
+{
+#ifdef TGA_HAVE_PTHREADS
+    int ready = 0;
+    check(loader && result, TGA_ARG_ERR, "Invalid loader or result.");
+    pthread_mutex_lock(&loader->lock);
+    while(loader->head && loader->head->state != TGA_JOB_DONE)
+        pthread_cond_wait(&loader->done, &loader->lock);
+    ready = loader->head != NULL;
+    if(ready)
+        _pop_result(loader, result);
+    pthread_mutex_unlock(&loader->lock);
+    return ready;
+error:
+    return 0;
+#else
+    return tga_loader_poll(loader, result);
+#endif
+}
+
+int tga_loader_uses_io_uring(TGALoader *loader)
+{
+    return loader ? loader->use_io_uring : 0;
+}
+
+/* Stops the loader, waiting for reads in flight. Unread images are freed. */
+void tga_loader_free(TGALoader *loader)
+{
+    TGALoadJob *job = NULL;
+#ifdef TGA_HAVE_PTHREADS
+    unsigned i = 0;
+#endif
+    if(!loader)
+        return;
+
+#ifdef TGA_HAVE_PTHREADS
+    pthread_mutex_lock(&loader->lock);
+    loader->shutdown = 1;
+    pthread_cond_broadcast(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+#ifdef TGA_HAVE_IO_URING
+    /* Creating the workers may have failed before the I/O thread started. */
+    if(loader->io_started)
+        pthread_join(loader->io_thread, NULL);
+    _ring_free(&loader->ring);
+#endif
+    /* Workers may still be waiting for buffers the I/O thread finished. */
+    pthread_mutex_lock(&loader->lock);
+    pthread_cond_broadcast(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+    for(i = 0; i < loader->thread_count; i++)
+        pthread_join(loader->threads[i], NULL);
+    free(loader->threads);
+    pthread_cond_destroy(&loader->done);
+    pthread_cond_destroy(&loader->work);
+    pthread_mutex_destroy(&loader->lock);
+#endif
+
+    while((job = loader->head))
+    {
+        loader->head = job->next;
+        free_tga_image(job->image);
+        free(job->buffer);
+        free(job->path);
+        free(job);
+    }
+    free(loader);
+}
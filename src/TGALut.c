@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Tone curves applied through 256-entry tables, one per channel. The kernels
+ * are byte-indexed loops over a fixed channel count. 16-bit pixels are never
+ * widened: each 8-bit table is folded into a 32-entry table for the 5-bit
+ * fields (and a 2-entry one for the alpha bit), so every field is one lookup.
+ */
+
+typedef struct {
+    TGAImage *image;
+    const uint8_t (*lut)[256];
+} TGALutJob;
+
+static double _srgb_to_linear(double v)
+{
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static double _linear_to_srgb(double v)
+{
+    return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+static uint8_t _to_byte(double v)
+{
+    v = v * 255.0 + 0.5;
+    return (uint8_t)(v < 0.0 ? 0.0 : v > 255.0 ? 255.0 : v);
+}
+
+/*
+ * Fills lut with the given curve. The sRGB curves leave alpha alone and need
+ * no image; GAMMA and COLOR_CORRECTION read the image's extension area and
+ * fail if it does not carry the value.
+ */
+int tga_build_lut(TGAImage *image, TGATransfer transfer, uint8_t lut[4][256])
+{
+    double gamma = 0.0;
+    const uint16_t *table = NULL;
+
+    check(lut, TGA_ARG_ERR, "Invalid table pointer.");
+    switch(transfer)
+    {
+        case TGA_TRANSFER_SRGB_TO_LINEAR:
+        case TGA_TRANSFER_LINEAR_TO_SRGB:
+            for(size_t v = 0; v < 256; v++)
+            {
+                double x = (double)v / 255.0, y = 0.0;
+                y = transfer == TGA_TRANSFER_SRGB_TO_LINEAR ?
+                    _srgb_to_linear(x) : _linear_to_srgb(x);
+                lut[0][v] = lut[1][v] = lut[2][v] = _to_byte(y);
+                lut[3][v] = (uint8_t)v;
+            }
+            return 1;
+        case TGA_TRANSFER_GAMMA:
+            check(_tga_sanity(image), TGA_INV_IMAGE_PNT,
+                    "Invalid TGAImage Pointer.");
+            gamma = tga_get_gamma(image);
+            check(gamma > 0.0, TGA_ARG_ERR, "Image has no gamma value.");
+            for(size_t v = 0; v < 256; v++)
+            {
+                double y = pow((double)v / 255.0, gamma);
+                lut[0][v] = lut[1][v] = lut[2][v] = _to_byte(y);
+                lut[3][v] = (uint8_t)v;
+            }
+            return 1;
+        case TGA_TRANSFER_COLOR_CORRECTION:
+            check(_tga_sanity(image), TGA_INV_IMAGE_PNT,
+                    "Invalid TGAImage Pointer.");
+            table = image->_meta->color_correction;
+            check(table, TGA_ARG_ERR, "Image has no color correction table.");
+            /* Entries are A, R, G, B; tables are in storage order. */
+            for(size_t v = 0; v < 256; v++)
+                for(size_t c = 0; c < 4; c++)
+                    lut[c][v] = (uint8_t)(((uint32_t)table[v * 4 + 3 - c] +
+                                           128) / 257);
+            return 1;
+        default:
+            fail(TGA_ARG_ERR, "Unknown transfer %d.", (int)transfer);
+    }
+error:
+    return 0;
+}
+
+static inline void _lut_channels(uint8_t *restrict row, size_t width,
+                                 size_t channels,
+                                 const uint8_t (*restrict lut)[256])
+{
+    for(size_t x = 0; x < width; x++)
+        for(size_t c = 0; c < channels; c++)
+            row[x * channels + c] = lut[c][row[x * channels + c]];
+}
+
+static void _lut_1555(uint8_t *restrict row, size_t width,
+                      const uint8_t (*restrict lut)[256])
+{
+    uint16_t fields[4][32];
+    for(uint32_t v = 0; v < 32; v++)
+        for(size_t c = 0; c < 3; c++)
+            fields[c][v] = (uint16_t)(_tga_reduce8(lut[c][_tga_expand5(v)]) <<
+                                      (5 * c));
+    fields[3][0] = (uint16_t)((lut[3][0] >> 7) << 15);
+    fields[3][1] = (uint16_t)((lut[3][255] >> 7) << 15);
+
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t v = (uint32_t)row[x * 2] | (uint32_t)row[x * 2 + 1] << 8;
+        v = (uint32_t)fields[0][v & 31] | fields[1][(v >> 5) & 31] |
+            fields[2][(v >> 10) & 31] | fields[3][v >> 15];
+        row[x * 2] = (uint8_t)(v & 0xFF);
+        row[x * 2 + 1] = (uint8_t)(v >> 8);
+    }
+}
+
+void _tga_lut_rows(TGAImage *image, const uint8_t lut[4][256], size_t first,
+                   size_t count)
+{
+    size_t width = image->_meta->width;
+    size_t stride = _tga_row_stride(image);
+    for(size_t y = first; y < first + count; y++)
+    {
+        uint8_t *row = image->data + y * stride;
+        switch(_tga_bytes_per_pixel(image->_meta->pixel_depth))
+        {
+            case 1:
+                _lut_channels(row, width, 1, lut);
+                break;
+            case 2:
+                _lut_1555(row, width, lut);
+                break;
+            case 3:
+                _lut_channels(row, width, 3, lut);
+                break;
+            default:
+                _lut_channels(row, width, 4, lut);
+                break;
+        }
+    }
+}
+
+static void _lut_range(void *ctx, size_t begin, size_t end)
+{
+    TGALutJob *job = ctx;
+    _tga_lut_rows(job->image, job->lut, begin, end - begin);
+}
+
+/* Maps every pixel of a truecolor or monochrome image through lut in place. */
+int tga_apply_lut(TGAImage *image, const uint8_t lut[4][256])
+{
+    TGALutJob job = {image, lut};
+    size_t height = 0;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(lut, TGA_ARG_ERR, "Invalid table pointer.");
+    check(image->_meta->image_type == TGA_TRUECOLOR ||
+            image->_meta->image_type == TGA_MONOCHROME, TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be corrected.");
+    height = image->_meta->height;
+    if(image->_meta->width == 0 || height == 0)
+        return 1;
+    check(_tga_writable_pixels(image), TGA_INV_IMAGE_PNT,
+            "Image data missing.");
+    _tga_parallel_for(height, _tga_threads_for(_tga_row_stride(image) * height),
+                      _lut_range, &job);
+    return 1;
+error:
+    return 0;
+}
@@ -0,0 +1,241 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+#if defined(__linux__) && !defined(TGA_NO_HUGE_PAGES)
+#include <sys/mman.h>
+#define TGA_USE_MMAP 1
+#endif
+
+#define TGA_HUGE_PAGE_SIZE      ((size_t)2 << 20)
+/* Below this size the TLB savings do not pay for the mmap system calls. */
+#define TGA_HUGE_PAGE_THRESHOLD ((size_t)32 << 20)
+
+#ifdef TGA_USE_MMAP
+/*
+ * Maps size bytes for pixel data. Explicit huge pages (MAP_HUGETLB) are used
+ * when the administrator has reserved them. Otherwise the mapping is aligned
+ * to a huge page boundary and marked for transparent huge pages, so full-frame
+ * passes over very large images take far fewer TLB misses.
+ */
+static void *_tga_map_pixels(size_t size)
+{
+    uint8_t *ptr = NULL;
+    size_t head = 0;
+#ifdef MAP_HUGETLB
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(ptr != MAP_FAILED)
+        return ptr;
+#endif
+    /* Over-map by one huge page, then trim to an aligned range. */
+    ptr = mmap(NULL, size + TGA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED)
+        return NULL;
+    head = (TGA_HUGE_PAGE_SIZE - (uintptr_t)ptr % TGA_HUGE_PAGE_SIZE) %
+           TGA_HUGE_PAGE_SIZE;
+    if(head)
+        munmap(ptr, head);
+    munmap(ptr + head + size, TGA_HUGE_PAGE_SIZE - head);
+    ptr += head;
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+#endif/*TGA_USE_MMAP*/
+
+/*
+ * Pixels shared between clones and views. An image either owns its pixel
+ * allocation outright (_meta->shared is NULL) or holds one reference to a
+ * buffer, whose allocation is released with the last reference.
+ */
+struct TGAPixelBuffer {
+    uint8_t *base;
+    size_t size;
+    uint8_t mapped;
+    unsigned refs;
+    TGAMutex lock;
+};
+
+/* Serialises the first share of an image, which may be a cached one. */
+static TGAMutex _tga_share_lock = TGA_MUTEX_INITIALIZER;
+
+static void _tga_unmap_or_free(uint8_t *data, size_t size, uint8_t mapped)
+{
+#ifdef TGA_USE_MMAP
+    if(mapped)
+    {
+        munmap(data, size);
+        return;
+    }
+#endif
+    (void)size;
+    (void)mapped;
+    free(data);
+}
+
+/* Drops a reference; returns the references left. */
+static unsigned _tga_buffer_release(struct TGAPixelBuffer *buffer)
+{
+    unsigned refs = 0;
+    _tga_mutex_lock(&buffer->lock);
+    refs = --buffer->refs;
+    _tga_mutex_unlock(&buffer->lock);
+    if(refs == 0)
+    {
+        _tga_unmap_or_free(buffer->base, buffer->size, buffer->mapped);
+        _tga_mutex_destroy(&buffer->lock);
+        free(buffer);
+    }
+    return refs;
+}
+
+/*
+ * Allocates the pixel buffer of an image. Any previous buffer is released.
+ * Anonymous mappings are already zero-filled, so zero only costs a memset for
+ * heap allocations.
+ */
+int _tga_alloc_pixels(TGAImage *image, size_t size, bool zero)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGA Image.");
+    _tga_free_pixels(image);
+
+#ifdef TGA_USE_MMAP
+    if(size >= TGA_HUGE_PAGE_THRESHOLD)
+    {
+        size_t mapped = (size + TGA_HUGE_PAGE_SIZE - 1) &
+                        ~(TGA_HUGE_PAGE_SIZE - 1);
+        check(mapped >= size, TGA_MEM_ERR, "Image too large.");
+        image->data = _tga_map_pixels(mapped);
+        if(image->data)
+        {
+            stat_add(alloc_count, 1);
+            stat_add(alloc_bytes, mapped);
+            image->_meta->data_size = mapped;
+            image->_meta->data_mapped = 1;
+            return 1;
+        }
+    }
+#endif
+
+    image->data = _tga_malloc(size ? size : 1);
+    check(image->data, TGA_MEM_ERR, "Unable to allocate %zu bytes of image "
+            "data.", size);
+    if(zero)
+        memset(image->data, 0, size);
+    image->_meta->data_size = size;
+    image->_meta->data_mapped = 0;
+    return 1;
+
+error:
+    return 0;
+}
+
+void _tga_free_pixels(TGAImage *image)
+{
+    if(!image || !image->data)
+        return;
+    if(image->_meta && image->_meta->shared)
+        _tga_buffer_release(image->_meta->shared);
+    else if(image->_meta)
+        _tga_unmap_or_free(image->data, image->_meta->data_size,
+                           image->_meta->data_mapped);
+    else
+        free(image->data);
+    image->data = NULL;
+    if(image->_meta)
+    {
+        image->_meta->data_size = 0;
+        image->_meta->data_mapped = 0;
+        image->_meta->shared = NULL;
+        image->_meta->row_stride = 0;
+    }
+}
+
+/*
+ * Makes `to` share `from`'s pixel buffer (copy-on-write), starting offset
+ * bytes into it. The first share turns from's own allocation into a shared
+ * buffer.
+ */
+int _tga_share_pixels(TGAImage *from, TGAImage *to, size_t offset)
+{
+    struct TGAPixelBuffer *buffer = NULL;
+    check(from->data, TGA_INV_IMAGE_PNT, "Image data missing.");
+    _tga_mutex_lock(&_tga_share_lock);
+    buffer = from->_meta->shared;
+    if(!buffer)
+    {
+        buffer = _tga_malloc(sizeof(struct TGAPixelBuffer));
+        if(!buffer)
+            _tga_mutex_unlock(&_tga_share_lock);
+        check(buffer, TGA_MEM_ERR, "Unable to allocate shared pixel buffer.");
+        buffer->base = from->data;
+        buffer->size = from->_meta->data_size;
+        buffer->mapped = from->_meta->data_mapped;
+        buffer->refs = 1;
+        _tga_mutex_init(&buffer->lock);
+        from->_meta->shared = buffer;
+        from->_meta->data_size = 0;
+        from->_meta->data_mapped = 0;
+    }
+    _tga_mutex_lock(&buffer->lock);
+    buffer->refs++;
+    _tga_mutex_unlock(&buffer->lock);
+    _tga_mutex_unlock(&_tga_share_lock);
+    _tga_free_pixels(to);
+    to->_meta->shared = buffer;
+    to->data = from->data + offset;
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Pixels of the image, ready to be changed: packed, and not shared with any
+ * clone or view. Shared pixels are copied first (copy-on-write).
+ */
+uint8_t *_tga_writable_pixels(TGAImage *image)
+{
+    struct TGAPixelBuffer *buffer = NULL;
+    uint8_t *old = NULL;
+    size_t stride = 0, row = 0, height = 0;
+    unsigned refs = 0;
+
+    if(!_tga_pixels(image))
+        return NULL;
+    buffer = image->_meta->shared;
+    if(!buffer)
+        return image->data;
+    _tga_mutex_lock(&buffer->lock);
+    refs = buffer->refs;
+    _tga_mutex_unlock(&buffer->lock);
+    if(refs == 1 && image->_meta->row_stride == 0)
+        return image->data;
+
+    old = image->data;
+    stride = _tga_row_stride(image);
+    row = _tga_row_bytes(image);
+    height = image->_meta->height;
+    image->data = NULL;
+    image->_meta->shared = NULL;
+    image->_meta->row_stride = 0;
+    if(!_tga_alloc_pixels(image, row * height, false))
+    {
+        image->data = old;
+        image->_meta->shared = buffer;
+        image->_meta->row_stride = (uint32_t)(stride == row ? 0 : stride);
+        return NULL;
+    }
+    for(size_t y = 0; y < height; y++)
+        memcpy(image->data + y * row, old + y * stride, row);
+    _tga_buffer_release(buffer);
+    return image->data;
+}
@@ -0,0 +1,467 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Row pipeline. A file is streamed from a TGARowReader to a TGARowWriter in
+ * blocks of rows small enough that a block's input, working copy and output
+ * stay in L2 together, and every stage runs over a block before the next
+ * one is read, so a chain of stages costs one read and one write of the
+ * pixels rather than a pass per stage. The decoded image is never held.
+ * The exception is RLE output with a vertical flip: the file's first rows
+ * are the last ones decoded, and their packet sizes are not known until
+ * then, so the writer keeps the encoded blocks in memory until the end.
+ *
+ * Pixel stages work on rows unpacked to 8-bit BGRA (or the single byte of
+ * monochrome pixels), in the order they were added; the last depth
+ * conversion decides the depth the rows are packed to. Origin changes are
+ * not stages: rows are mirrored as they are packed, and the writer takes the
+ * blocks of a vertically flipped image last row first (raw blocks are
+ * written in place, RLE blocks held as above).
+ *
+ * With several threads, batches of blocks are decoded in order on the
+ * calling thread, processed and RLE encoded one block per thread, and
+ * written in order.
+ */
+
+/* Rows per block are chosen so a block unpacks to about this many bytes. */
+#define TGA_PIPELINE_BLOCK_BYTES ((size_t)64 << 10)
+#define TGA_PIPELINE_MAX_STAGES  16
+
+typedef enum {
+    TGA_PIPE_CONVERT,
+    TGA_PIPE_PREMULTIPLY,
+    TGA_PIPE_LUT
+} TGAPipeOp;
+
+typedef struct {
+    TGAPipeOp op;
+    uint8_t depth;              /* TGA_PIPE_CONVERT */
+    uint8_t lut[4][256];        /* TGA_PIPE_LUT, in storage order */
+} TGAPipeStage;
+
+struct NyTGA_Pipeline {
+    TGAPipeStage stages[TGA_PIPELINE_MAX_STAGES];
+    size_t stage_count;
+    uint8_t set_origin;
+    uint8_t origin;             /* TGA_ORIGIN_* bits when set_origin */
+    uint8_t compression;
+};
+
+/* Buffers of one block in flight. */
+typedef struct {
+    uint8_t *in;                /* Decoded stored rows. */
+    uint8_t *out;               /* Rows in the output's format and order. */
+    uint8_t *encoded;           /* RLE packets, when compressing. */
+    uint8_t *work;              /* Two BGRA rows. */
+    size_t rows;
+    size_t length;              /* Bytes to write from out or encoded. */
+    TGARleCounts counts;
+} TGAPipeBlock;
+
+typedef struct {
+    const TGAPipeline *pipeline;
+    size_t width;
+    size_t in_bytes;
+    size_t out_bytes;
+    int mono;
+    int unpack;                 /* Rows go through BGRA. */
+    int flip_x;
+    int flip_y;
+    int encode;
+    /* Per stage: run it at all, and for conversions, round to its depth. */
+    uint8_t active[TGA_PIPELINE_MAX_STAGES];
+    TGAPipeBlock *blocks;
+} TGAPipeJob;
+
+TGAPipeline *tga_pipeline_new(void)
+{
+    TGAPipeline *pipeline = _tga_malloc(sizeof(TGAPipeline));
+    check(pipeline, TGA_MEM_ERR, "Unable to allocate pipeline.");
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->compression = TGA_COMPRESS_NONE;
+    return pipeline;
+error:
+    return NULL;
+}
+
+void tga_pipeline_free(TGAPipeline *pipeline)
+{
+    free(pipeline);
+}
+
+static TGAPipeStage *_add_stage(TGAPipeline *pipeline, TGAPipeOp op)
+{
+    TGAPipeStage *stage = NULL;
+    check(pipeline, TGA_ARG_ERR, "Invalid pipeline pointer.");
+    check(pipeline->stage_count < TGA_PIPELINE_MAX_STAGES, TGA_ARG_ERR,
+            "A pipeline holds at most %d stages.", TGA_PIPELINE_MAX_STAGES);
+    stage = &pipeline->stages[pipeline->stage_count++];
+    memset(stage, 0, sizeof(*stage));
+    stage->op = op;
+    return stage;
+error:
+    return NULL;
+}
+
+/* Stores the output with the given origin, like tga_set_origin. */
+int tga_pipeline_set_origin(TGAPipeline *pipeline, uint8_t right, uint8_t top)
+{
+    check(pipeline, TGA_ARG_ERR, "Invalid pipeline pointer.");
+    pipeline->set_origin = 1;
+    pipeline->origin = (uint8_t)((right ? TGA_ORIGIN_RIGHT : 0) |
+                                 (top ? TGA_ORIGIN_TOP : 0));
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Raw or RLE output. TGA_COMPRESS_AUTO is not accepted: the header is written
+ * before any rows are seen to estimate from.
+ */
+int tga_pipeline_set_compression(TGAPipeline *pipeline,
+                                 TGACompression compression)
+{
+    check(pipeline, TGA_ARG_ERR, "Invalid pipeline pointer.");
+    check(compression != TGA_COMPRESS_AUTO, TGA_UNSUPPORTED,
+            "Pipelines cannot choose their compression automatically.");
+    check(compression == TGA_COMPRESS_NONE || compression == TGA_COMPRESS_RLE,
+            TGA_ARG_ERR, "Unknown compression mode %d.", (int)compression);
+    pipeline->compression = (uint8_t)compression;
+    return 1;
+error:
+    return 0;
+}
+
+/* Converts truecolor pixels to 16, 24 or 32 bits, like tga_convert_depth. */
+int tga_pipeline_convert_depth(TGAPipeline *pipeline, uint8_t depth)
+{
+    TGAPipeStage *stage = NULL;
+    check(depth == 16 || depth == 24 || depth == 32, TGA_ARG_ERR,
+            "Unsupported target depth %u.", depth);
+    stage = _add_stage(pipeline, TGA_PIPE_CONVERT);
+    check(stage, tga_error(), "Unable to add stage.");
+    stage->depth = depth;
+    return 1;
+error:
+    return 0;
+}
+
+/* Multiplies colour channels by alpha, rounded to nearest. */
+int tga_pipeline_premultiply(TGAPipeline *pipeline)
+{
+    check(_add_stage(pipeline, TGA_PIPE_PREMULTIPLY), tga_error(),
+            "Unable to add stage.");
+    return 1;
+error:
+    return 0;
+}
+
+/* Maps pixels through per-channel tables, like tga_apply_lut. */
+int tga_pipeline_apply_lut(TGAPipeline *pipeline, const uint8_t lut[4][256])
+{
+    TGAPipeStage *stage = NULL;
+    check(lut, TGA_ARG_ERR, "Invalid table pointer.");
+    stage = _add_stage(pipeline, TGA_PIPE_LUT);
+    check(stage, tga_error(), "Unable to add stage.");
+    memcpy(stage->lut, lut, sizeof(stage->lut));
+    return 1;
+error:
+    return 0;
+}
+
+/* Rounds BGRA pixels to what depth can hold, for stages that follow. */
+static void _quantize(uint8_t *row, size_t width, uint8_t depth)
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        uint8_t *p = row + x * 4;
+        if(depth == 16)
+        {
+            for(size_t c = 0; c < 3; c++)
+                p[c] = _tga_expand5(_tga_reduce8(p[c]));
+            p[3] = (uint8_t)(0 - (p[3] >> 7));
+        }
+        else if(depth == 24)
+            p[3] = 255;
+    }
+}
+
+static void _premultiply(uint8_t *row, size_t width)
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t a = row[x * 4 + 3];
+        for(size_t c = 0; c < 3; c++)
+            row[x * 4 + c] = (uint8_t)_tga_div255(row[x * 4 + c] * a);
+    }
+}
+
+static void _lut(uint8_t *row, size_t width, size_t channels,
+                 const uint8_t (*lut)[256])
+{
+    for(size_t x = 0; x < width; x++)
+        for(size_t c = 0; c < channels; c++)
+            row[x * channels + c] = lut[c][row[x * channels + c]];
+}
+
+static void _run_stages(const TGAPipeJob *job, uint8_t *row)
+{
+    const TGAPipeline *pipeline = job->pipeline;
+    for(size_t i = 0; i < pipeline->stage_count; i++)
+    {
+        const TGAPipeStage *stage = &pipeline->stages[i];
+        if(!job->active[i])
+            continue;
+        switch(stage->op)
+        {
+            case TGA_PIPE_CONVERT:
+                _quantize(row, job->width, stage->depth);
+                break;
+            case TGA_PIPE_PREMULTIPLY:
+                _premultiply(row, job->width);
+                break;
+            case TGA_PIPE_LUT:
+                _lut(row, job->width, job->mono ? 1 : 4,
+                     (const uint8_t (*)[256])stage->lut);
+                break;
+        }
+    }
+}
+
+/* Turns one decoded block into output rows and, if compressing, packets. */
+static void _process_block(const TGAPipeJob *job, TGAPipeBlock *block)
+{
+    size_t width = job->width;
+    size_t in_row = width * job->in_bytes, out_row = width * job->out_bytes;
+    uint8_t *work = block->work, *spare = block->work + width * 4;
+
+    for(size_t r = 0; r < block->rows; r++)
+    {
+        const uint8_t *in = block->in + r * in_row;
+        uint8_t *out = block->out +
+                       (job->flip_y ? block->rows - 1 - r : r) * out_row;
+        if(job->unpack)
+        {
+            _tga_unpack_bgra(work, in, width, job->in_bytes);
+            _run_stages(job, work);
+            if(job->flip_x)
+                _tga_reverse_pixels(spare, work, width, 4);
+            _tga_pack_bgra(out, job->flip_x ? spare : work, width,
+                           job->out_bytes);
+            continue;
+        }
+        if(job->flip_x)
+            _tga_reverse_pixels(out, in, width, job->in_bytes);
+        else
+            memcpy(out, in, in_row);
+        if(job->mono)
+            _run_stages(job, out);
+    }
+
+    block->length = block->rows * out_row;
+    if(job->encode)
+    {
+        uint8_t *packets = block->encoded;
+        memset(&block->counts, 0, sizeof(block->counts));
+        for(size_t r = 0; r < block->rows; r++)
+            packets += _tga_rle_encode_row(block->out + r * out_row, width,
+                                           job->out_bytes, packets,
+                                           &block->counts);
+        block->length = (size_t)(packets - block->encoded);
+    }
+}
+
+static void _process_blocks(void *ctx, size_t begin, size_t end)
+{
+    TGAPipeJob *job = ctx;
+    for(size_t i = begin; i < end; i++)
+        _process_block(job, &job->blocks[i]);
+}
+
+/*
+ * Works out the output format and which stages do anything, checking the
+ * stages against the source image. Premultiplying only applies while the
+ * pixels declare alpha bits, as in tga_resize. A conversion rounds the
+ * pixels itself only when a later stage reads them; for the last one,
+ * packing the rows does it.
+ */
+static int _plan(const TGAPipeline *pipeline, TGAImage *image,
+                 TGAPipeJob *job, uint8_t *depth, uint8_t *bits)
+{
+    size_t count = pipeline->stage_count;
+    int changes_pixels = 0;
+    job->mono = image->_meta->image_type == TGA_MONOCHROME ||
+                image->_meta->image_type == TGA_ENCODED_MONOCHROME;
+    *depth = image->_meta->pixel_depth;
+    *bits = image->_meta->image_descriptor & 15;
+    check(job->mono || *depth == 16 || *depth == 24 || *depth == 32,
+            TGA_UNSUPPORTED, "Unsupported source depth %u.", *depth);
+    check(count <= TGA_PIPELINE_MAX_STAGES, TGA_ARG_ERR, "Invalid pipeline.");
+    for(size_t i = 0; i < count; i++)
+    {
+        const TGAPipeStage *stage = &pipeline->stages[i];
+        uint8_t active = 1;
+        check(!job->mono || stage->op == TGA_PIPE_LUT, TGA_TYPE_ERR,
+                "Monochrome images only take table stages.");
+        if(stage->op == TGA_PIPE_CONVERT)
+        {
+            *bits = _tga_converted_attribute_bits(*bits, *depth, stage->depth);
+            *depth = stage->depth;
+            active = i + 1 < count;
+        }
+        else if(stage->op == TGA_PIPE_PREMULTIPLY)
+            active = *bits != 0;
+        job->active[i] = active;
+        changes_pixels |= active;
+    }
+    job->in_bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    job->out_bytes = _tga_bytes_per_pixel(*depth);
+    job->unpack = !job->mono && (changes_pixels ||
+                                 job->in_bytes != job->out_bytes);
+    return 1;
+error:
+    return 0;
+}
+
+/*
+ * Reads input, runs the stages and writes output, a block of rows at a time.
+ * The ID field, offsets and version carry over; the output keeps the input's
+ * origin unless tga_pipeline_set_origin was called. Truecolor and monochrome
+ * images, raw or RLE, are supported.
+ */
+int tga_pipeline_run(const TGAPipeline *pipeline, const char *input,
+                     const char *output)
+{
+    TGASource src = { NULL, NULL, 0, 0 };
+    TGARowReader reader;
+    TGARowWriter *writer = NULL;
+    TGAImage *image = NULL;
+    TGAPipeJob job = {0};
+    TGAPipeBlock blocks[TGA_MAX_THREADS];
+    size_t height = 0, block_rows = 0, count = 0, total = 0;
+    unsigned threads = 0, slots = 0;
+    uint8_t depth = 0, bits = 0, origin = 0;
+    int finished = 0;
+
+    memset(blocks, 0, sizeof(blocks));
+    check(pipeline, TGA_ARG_ERR, "Invalid pipeline pointer.");
+    check(input && input[0] != '\0', TGA_INV_FILE_NAME,
+            "Invalid or Null filename.");
+    src.file = fopen(input, "rb");
+    check(src.file, TGA_INV_FILE_NAME, "Unable to open %.128s.", input);
+    image = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    check(image, tga_error(), "Unable to create new TGAImage.");
+    check(_tga_row_reader_open(&reader, image, &src), tga_error(),
+            "Unable to read %.128s.", input);
+    check(_plan(pipeline, image, &job, &depth, &bits), tga_error(),
+            "Pipeline does not apply to %.128s.", input);
+
+    origin = pipeline->set_origin ? pipeline->origin :
+             image->_meta->image_descriptor & (TGA_ORIGIN_RIGHT | TGA_ORIGIN_TOP);
+    job.pipeline = pipeline;
+    job.width = image->_meta->width;
+    job.flip_x = ((origin ^ image->_meta->image_descriptor) &
+                  TGA_ORIGIN_RIGHT) != 0;
+    job.flip_y = ((origin ^ image->_meta->image_descriptor) &
+                  TGA_ORIGIN_TOP) != 0;
+    job.encode = pipeline->compression == TGA_COMPRESS_RLE;
+    job.blocks = blocks;
+    height = image->_meta->height;
+
+    /* The image now describes the output; it never holds pixels. */
+    image->_meta->image_type = job.mono ? TGA_MONOCHROME : TGA_TRUECOLOR;
+    image->_meta->pixel_depth = depth;
+    image->_meta->image_descriptor = (uint8_t)(origin | bits);
+    image->_meta->compression = pipeline->compression;
+    writer = _tga_row_writer_open(image, output, job.flip_y);
+    check(writer, tga_error(), "Unable to create %.128s.", output ? output : "");
+
+    if(job.width && height)
+    {
+        size_t unpacked = job.width * 4;
+        block_rows = TGA_PIPELINE_BLOCK_BYTES / unpacked;
+        block_rows = block_rows ? block_rows : 1;
+        block_rows = block_rows < height ? block_rows : height;
+        count = (height + block_rows - 1) / block_rows;
+        total = job.width * height * (job.in_bytes + job.out_bytes);
+        threads = _tga_threads_for(total);
+        slots = threads < count ? threads : (unsigned)count;
+        for(unsigned i = 0; i < slots; i++)
+        {
+            TGAPipeBlock *block = &blocks[i];
+            block->in = _tga_malloc(block_rows * job.width * job.in_bytes);
+            block->out = _tga_malloc(block_rows * job.width * job.out_bytes);
+            block->work = _tga_malloc(unpacked * 2);
+            check(block->in && block->out && block->work, TGA_MEM_ERR,
+                    "Unable to allocate pipeline buffers.");
+            if(job.encode)
+            {
+                block->encoded = _tga_malloc(block_rows *
+                        _tga_rle_row_bound(job.width, job.out_bytes));
+                check(block->encoded, TGA_MEM_ERR,
+                        "Unable to allocate pipeline buffers.");
+            }
+        }
+    }
+
+    for(size_t first = 0; first < count; first += slots)
+    {
+        size_t batch = count - first < slots ? count - first : slots;
+        for(size_t i = 0; i < batch; i++)
+        {
+            size_t y0 = (first + i) * block_rows;
+            blocks[i].rows = height - y0 < block_rows ? height - y0
+                                                      : block_rows;
+            check(staged(TGA_STAGE_PIXELS, _tga_row_reader_read(&reader,
+                    blocks[i].in, blocks[i].rows)), tga_error(),
+                    "Unable to read %.128s.", input);
+        }
+        _tga_parallel_for(batch, slots, _process_blocks, &job);
+        for(size_t i = 0; i < batch; i++)
+        {
+            size_t y0 = (first + i) * block_rows;
+            size_t first_row = job.flip_y ? height - y0 - blocks[i].rows : y0;
+            check(_tga_row_writer_put(writer, job.encode ? blocks[i].encoded :
+                    blocks[i].out, blocks[i].length, first_row), tga_error(),
+                    "Unable to write %.128s.", output);
+            stat_add(rle_run_packets, blocks[i].counts.run_packets);
+            stat_add(rle_run_pixels, blocks[i].counts.run_pixels);
+            stat_add(rle_raw_packets, blocks[i].counts.raw_packets);
+            stat_add(rle_raw_pixels, blocks[i].counts.raw_pixels);
+        }
+    }
+
+    /* The writer is freed whether or not it closes cleanly. */
+    finished = _tga_row_writer_close(writer, 1);
+    writer = NULL;
+    check(finished, tga_error(), "Unable to finish %.128s.", output);
+    for(unsigned i = 0; i < slots; i++)
+    {
+        free(blocks[i].in);
+        free(blocks[i].out);
+        free(blocks[i].work);
+        free(blocks[i].encoded);
+    }
+    free_tga_image(image);
+    fclose(src.file);
+    return 1;
+
+error:
+    _tga_row_writer_close(writer, 0);
+    for(unsigned i = 0; i < slots; i++)
+    {
+        free(blocks[i].in);
+        free(blocks[i].out);
+        free(blocks[i].work);
+        free(blocks[i].encoded);
+    }
+    free_tga_image(image);
+    if(src.file)
+        fclose(src.file);
+    return 0;
+}
@@ -0,0 +1,368 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+
+/*
+ * Incremental ("push") decoder. Instead of pulling bytes from a seekable FILE
+ * like read_tga_image, the caller feeds the file in arbitrary chunks as they
+ * arrive and rows become available as soon as they are decoded. The footer is
+ * only examined once the whole stream has been fed, in tga_decoder_finish.
+ *
+ * Sections are expected in the layout read_tga_image assumes: header, ID
+ * field, color map (after c_map_start bytes) and pixel data, optionally
+ * followed by the extension/developer areas and footer.
+ */
+
+typedef enum {
+    TGA_PUSH_HEADER,
+    TGA_PUSH_ID,
+    TGA_PUSH_SKIP,          /* Bytes between the ID field and the color map */
+    TGA_PUSH_COLOR_MAP,
+    TGA_PUSH_PIXELS,
+    TGA_PUSH_TRAILER,       /* Everything after the pixel data */
+    TGA_PUSH_ERROR
+} TGAPushState;
+
+struct NyTGA_Decoder {
+    TGAImage *image;
+    TGAPushState state;
+    uint8_t header[TGA_HEADER_SIZE];
+    size_t filled;          /* Bytes consumed in the current section */
+    size_t section;         /* Size of the current section */
+    size_t depth;
+    size_t total;           /* Bytes of decoded pixel data */
+    size_t position;        /* Bytes of pixel data decoded so far */
+    size_t packet_bytes;    /* Output bytes left in the current RLE packet */
+    size_t run_filled;
+    uint8_t run_value[4];
+    uint8_t encoded;
+    uint8_t packet_run;
+    uint16_t rows_ready;
+    uint8_t tail[TGA_FOOTER_SIZE]; /* Last bytes of the trailer */
+    size_t trailer_length;
+};
+
+TGADecoder *tga_decoder_new(void)
+{
+    TGADecoder *dec = _tga_malloc(sizeof(TGADecoder));
+    check(dec, TGA_MEM_ERR, "Unable to allocate decoder.");
+    memset(dec, 0, sizeof(*dec));
+    dec->state = TGA_PUSH_HEADER;
+    dec->section = TGA_HEADER_SIZE;
+    return dec;
+error:
+    return NULL;
+}
+
+void tga_decoder_free(TGADecoder *dec)
+{
+    if(dec)
+    {
+        free_tga_image(dec->image);
+        free(dec);
+    }
+}
+
+/* Moves to the next section that has any bytes in it. */
+static void _next_section(TGADecoder *dec)
+{
+    TGAImage *image = dec->image;
+    dec->filled = 0;
+    switch(dec->state)
+    {
+        case TGA_PUSH_HEADER:
+            dec->state = TGA_PUSH_ID;
+            dec->section = image->_meta->id_length;
+            break;
+        case TGA_PUSH_ID:
+            dec->state = TGA_PUSH_SKIP;
+            dec->section = image->_meta->c_map_start;
+            break;
+        case TGA_PUSH_SKIP:
+            dec->state = TGA_PUSH_COLOR_MAP;
+            dec->section = _tga_color_map_bytes(image);
+            break;
+        case TGA_PUSH_COLOR_MAP:
+            dec->state = TGA_PUSH_PIXELS;
+            dec->section = dec->total;
+            break;
+        case TGA_PUSH_PIXELS:
+            dec->state = TGA_PUSH_TRAILER;
+            dec->section = SIZE_MAX;
+            return;
+        default:
+            return;
+    }
+    if(dec->section == 0)
+        _next_section(dec);
+}
+
+/* Validates the parsed header and allocates everything the image needs. */
+static int _start_image(TGADecoder *dec)
+{
+    TGAImage *image = new_tga_image(TGA_NO_DATA, 0, 0, 0);
+    check(image, tga_error(), "Unable to create new TGAImage.");
+    dec->image = image;
+    _tga_parse_header(image, dec->header);
+
+    switch(image->_meta->image_type)
+    {
+        case TGA_ENCODED_TRUECOLOR:
+        case TGA_ENCODED_MONOCHROME:
+            dec->encoded = 1;
+            break;
+        case TGA_TRUECOLOR:
+        case TGA_MONOCHROME:
+        case TGA_COLOR_MAPPED:
+            dec->encoded = 0;
+            break;
+        case TGA_ENCODED_COLOR_MAPPED:
+            fail(TGA_UNSUPPORTED, "Encoded Color Map Images are not "
+                    "supported yet.");
+        default:
+            fail(TGA_UNSUPPORTED, "Unsupported TGA Format.");
+    }
+    dec->depth = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    check(dec->depth >= 1 && dec->depth <= sizeof(dec->run_value),
+            TGA_UNSUPPORTED, "Unsupported pixel depth %u.",
+            image->_meta->pixel_depth);
+    check(_tga_pixel_bytes(image->_meta->width, image->_meta->height,
+            image->_meta->pixel_depth, &dec->total), TGA_MEM_ERR,
+            "Image dimensions are too large.");
+    check(_tga_alloc_pixels(image, dec->total, false), tga_error(),
+            "Unable to allocate image data.");
+
+    if(image->_meta->id_length)
+    {
+        image->id_field = _tga_malloc(image->_meta->id_length);
+        check(image->id_field, TGA_MEM_ERR,
+                "Unable to allocate memory for TGA ID Field.");
+    }
+    if(image->_meta->image_type == TGA_COLOR_MAPPED)
+    {
+        check(_tga_color_map_bytes(image) > 0, TGA_COLOR_MAP_ERR,
+                "Image claims color map, but map is of size 0.");
+        image->color_map = _tga_malloc(_tga_color_map_bytes(image));
+        check(image->color_map, TGA_MEM_ERR, "Unable to allocate color map.");
+    }
+    return 1;
+error:
+    return 0;
+}
+
+/* Decodes RLE packets from the input. Returns the number of bytes used. */
+static size_t _feed_encoded(TGADecoder *dec, const uint8_t *bytes, size_t n)
+{
+    uint8_t *data = dec->image->data;
+    size_t used = 0;
+    size_t take = 0;
+    size_t i = 0;
+
+    while(used < n && dec->position < dec->total)
+    {
+        if(dec->packet_bytes == 0)
+        {
+            /* Packet header: high bit selects run/raw, low bits the count */
+            dec->packet_run = bytes[used] & 128;
+            dec->packet_bytes = ((size_t)(bytes[used] & 127) + 1) * dec->depth;
+            dec->run_filled = 0;
+            used++;
+            check(dec->packet_bytes <= dec->total - dec->position,
+                    TGA_READ_ERR, "RLE packet runs past the end of the image.");
+            if(dec->packet_run)
+            {
+                stat_add(rle_run_packets, 1);
+                stat_add(rle_run_pixels, dec->packet_bytes / dec->depth);
+            }
+            else
+            {
+                stat_add(rle_raw_packets, 1);
+                stat_add(rle_raw_pixels, dec->packet_bytes / dec->depth);
+            }
+            continue;
+        }
+
+        if(dec->packet_run)
+        {
+            take = dec->depth - dec->run_filled;
+            take = take < n - used ? take : n - used;
+            memcpy(dec->run_value + dec->run_filled, bytes + used, take);
+            dec->run_filled += take;
+            used += take;
+            if(dec->run_filled < dec->depth)
+                break;
+            for(i = 0; i < dec->packet_bytes; i += dec->depth)
+                memcpy(data + dec->position + i, dec->run_value, dec->depth);
+            dec->position += dec->packet_bytes;
+            dec->packet_bytes = 0;
+        }
+        else
+        {
+            take = dec->packet_bytes < n - used ? dec->packet_bytes : n - used;
+            memcpy(data + dec->position, bytes + used, take);
+            dec->position += take;
+            dec->packet_bytes -= take;
+            used += take;
+        }
+    }
+    return used;
+error:
+    dec->state = TGA_PUSH_ERROR;
+    return n;
+}
+
+/* Remembers the last TGA_FOOTER_SIZE bytes of the trailer. */
+static void _feed_trailer(TGADecoder *dec, const uint8_t *bytes, size_t n)
+{
+    size_t keep = 0;
+    dec->trailer_length += n;
+    if(n >= TGA_FOOTER_SIZE)
+    {
+        memcpy(dec->tail, bytes + n - TGA_FOOTER_SIZE, TGA_FOOTER_SIZE);
+        return;
+    }
+    keep = TGA_FOOTER_SIZE - n;
+    memmove(dec->tail, dec->tail + n, keep);
+    memcpy(dec->tail + keep, bytes, n);
+}
+
+/*
+ * Consumes the n bytes passed in. Returns TGA_DECODE_ROW_READY if one or more
+ * rows were completed by this call, TGA_DECODE_DONE once all pixel data has
+ * arrived and TGA_DECODE_NEED_MORE otherwise. Bytes fed after the pixel data
+ * are kept for the footer check.
+ */
+TGADecodeStatus tga_decoder_feed(TGADecoder *dec, const uint8_t *bytes,
+                                 size_t n)
+{
+    uint16_t rows_before = 0;
+    size_t take = 0;
+    size_t stride = 0;
+
+    check(dec, TGA_ARG_ERR, "Invalid decoder.");
+    check(bytes || n == 0, TGA_ARG_ERR, "Invalid input buffer.");
+    check(dec->state != TGA_PUSH_ERROR, TGA_ARG_ERR,
+            "Decoder is in an error state.");
+    rows_before = dec->rows_ready;
+    stat_add(read_calls, 1);
+    stat_add(bytes_read, n);
+
+    while(n > 0)
+    {
+        if(dec->state == TGA_PUSH_TRAILER)
+        {
+            _feed_trailer(dec, bytes, n);
+            break;
+        }
+        if(dec->state == TGA_PUSH_PIXELS && dec->encoded)
+        {
+            take = _feed_encoded(dec, bytes, n);
+            check(dec->state != TGA_PUSH_ERROR, tga_error(), "%s",
+                    tga_error_str());
+        }
+        else
+        {
+            take = dec->section - dec->filled;
+            take = take < n ? take : n;
+            switch(dec->state)
+            {
+                case TGA_PUSH_HEADER:
+                    memcpy(dec->header + dec->filled, bytes, take);
+                    break;
+                case TGA_PUSH_ID:
+                    memcpy(dec->image->id_field + dec->filled, bytes, take);
+                    break;
+                case TGA_PUSH_COLOR_MAP:
+                    if(dec->image->color_map)
+                        memcpy(dec->image->color_map + dec->filled, bytes,
+                               take);
+                    break;
+                case TGA_PUSH_PIXELS:
+                    memcpy(dec->image->data + dec->position, bytes, take);
+                    dec->position += take;
+                    break;
+                default:
+                    break;
+            }
+            dec->filled += take;
+        }
+        bytes += take;
+        n -= take;
+
+        if(dec->state == TGA_PUSH_HEADER && dec->filled == TGA_HEADER_SIZE)
+        {
+            check(_start_image(dec), tga_error(), "%s", tga_error_str());
+            _next_section(dec);
+        }
+        else if(dec->state == TGA_PUSH_PIXELS)
+        {
+            if(dec->position == dec->total)
+                _next_section(dec);
+        }
+        else if(dec->state != TGA_PUSH_TRAILER && dec->filled == dec->section)
+        {
+            _next_section(dec);
+        }
+    }
+
+    if(dec->image && dec->position > 0)
+    {
+        stride = _tga_row_stride(dec->image);
+        dec->rows_ready = (uint16_t)(dec->position / stride);
+    }
+    if(dec->state == TGA_PUSH_TRAILER)
+        return TGA_DECODE_DONE;
+    return dec->rows_ready > rows_before ? TGA_DECODE_ROW_READY
+                                         : TGA_DECODE_NEED_MORE;
+error:
+    if(dec)
+        dec->state = TGA_PUSH_ERROR;
+    return TGA_DECODE_ERROR;
+}
+
+/*
+ * The image being decoded, or NULL until the header has arrived. Its metadata
+ * is complete once the header is parsed; only the first
+ * tga_decoder_rows_ready() rows of data (in file order) are valid before the
+ * decode is done. The decoder keeps ownership.
+ */
+TGAImage *tga_decoder_image(TGADecoder *dec)
+{
+    return dec ? dec->image : NULL;
+}
+
+uint16_t tga_decoder_rows_ready(TGADecoder *dec)
+{
+    return dec ? dec->rows_ready : 0;
+}
+
+/*
+ * Completes the decode once the whole stream has been fed, checking the
+ * trailing bytes for a version 2 footer. Ownership of the image passes to the
+ * caller; the decoder must still be freed.
+ */
+TGAImage *tga_decoder_finish(TGADecoder *dec)
+{
+    static const uint8_t no_footer[TGA_FOOTER_SIZE] = {0};
+    TGAImage *image = NULL;
+    check(dec, TGA_ARG_ERR, "Invalid decoder.");
+    check(dec->state != TGA_PUSH_ERROR, TGA_ARG_ERR,
+            "Decoder is in an error state.");
+    check(dec->state == TGA_PUSH_TRAILER, TGA_READ_ERR,
+            "Stream ended before the image data was complete.");
+
+    image = dec->image;
+    if(dec->trailer_length >= TGA_FOOTER_SIZE)
+        _tga_parse_footer(image, dec->tail);
+    else
+        _tga_parse_footer(image, no_footer);
+    if(image->_meta->image_type == TGA_ENCODED_TRUECOLOR)
+        image->_meta->image_type = TGA_TRUECOLOR;
+    else if(image->_meta->image_type == TGA_ENCODED_MONOCHROME)
+        image->_meta->image_type = TGA_MONOCHROME;
+    dec->image = NULL;
+    return image;
+error:
+    return NULL;
+}
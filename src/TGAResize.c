@@ -0,0 +1,446 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+#include "Private/TGAPixel.h"
+
+/*
+ * Resampling. The image is filtered separably: a horizontal pass turns every
+ * source row into a row of the new width, then a vertical pass combines those
+ * rows into the output rows. Both passes use fixed-point weights computed once
+ * per output column and row, so the inner loops are integer multiply-adds.
+ *
+ * The vertical pass walks the image in strips a few KiB wide: for each output
+ * row it adds each contributing row of the strip, scaled by its weight, into
+ * an accumulator. That loop has no dependencies between elements and
+ * vectorizes for every pixel layout, and the rows shared by consecutive output
+ * rows are still in cache when they are used again.
+ *
+ * Images are resampled in stored order. The filters are symmetric, so this
+ * gives the same picture as resampling in display order (up to rounding of
+ * the weights), and the output keeps the source's origin bits. Images
+ * declaring alpha bits are premultiplied while filtering so transparent
+ * pixels do not bleed their colour into edges.
+ */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TGA_RESIZE_PRECISION    22
+#define TGA_RESIZE_STRIP        4096    /* Bytes per vertical pass strip. */
+#define TGA_RESIZE_BAND         65536   /* Bytes of output rows per band. */
+
+typedef struct {
+    size_t taps;                /* Weights stored per output element. */
+    size_t *start;              /* First input element of each output. */
+    size_t *count;              /* Weights actually used of each output. */
+    int32_t *weights;
+} TGAWeights;
+
+typedef struct {
+    TGAImage *src;
+    TGAImage *out;
+    size_t channels;            /* Channels being filtered: 1, 3 or 4. */
+    int unpack;                 /* 16-bit pixels are filtered as BGRA. */
+    int premultiply;
+    TGAWeights wx;
+    TGAWeights wy;
+    uint8_t *tmp;               /* Horizontally filtered source rows. */
+    size_t tmp_stride;
+    size_t band_rows;           /* Output rows per vertical pass band. */
+    size_t chunk_rows;
+    uint8_t **scratch;
+} TGAResizeJob;
+
+static double _sinc(double x)
+{
+    if(fabs(x) < 1e-9)
+        return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double _filter_support(TGAFilter filter)
+{
+    switch(filter)
+    {
+        case TGA_FILTER_BICUBIC:
+            return 2.0;
+        case TGA_FILTER_LANCZOS:
+            return 3.0;
+        default:
+            return 1.0;
+    }
+}
+
+static double _filter_weight(TGAFilter filter, double x)
+{
+    x = fabs(x);
+    switch(filter)
+    {
+        case TGA_FILTER_BICUBIC:
+            /* Keys' cubic with a = -0.5. */
+            if(x < 1.0)
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            if(x < 2.0)
+                return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+            return 0.0;
+        case TGA_FILTER_LANCZOS:
+            return x < 3.0 ? _sinc(x) * _sinc(x / 3.0) : 0.0;
+        default:
+            return x < 1.0 ? 1.0 - x : 0.0;
+    }
+}
+
+static void _free_weights(TGAWeights *w)
+{
+    free(w->start);
+    free(w->count);
+    free(w->weights);
+}
+
+/*
+ * Weights mapping `in` elements to `out`. When shrinking, the filter is
+ * stretched to cover the input elements each output stands for. Weights are
+ * rounded to fixed point and the largest absorbs the rounding error, so a
+ * constant input stays exactly constant.
+ */
+static int _compute_weights(TGAWeights *w, TGAFilter filter, size_t in,
+                            size_t out)
+{
+    double scale = (double)in / (double)out;
+    double stretch = scale > 1.0 ? scale : 1.0;
+    double support = _filter_support(filter) * stretch;
+    double reach = ceil(support);
+    double *row = NULL;
+
+    w->taps = (size_t)reach * 2 + 1;
+    w->start = _tga_malloc(out * sizeof(size_t));
+    w->count = _tga_malloc(out * sizeof(size_t));
+    w->weights = _tga_malloc(out * w->taps * sizeof(int32_t));
+    row = _tga_malloc(w->taps * sizeof(double));
+    check(w->start && w->count && w->weights && row, TGA_MEM_ERR,
+            "Unable to allocate resampling weights.");
+
+    for(size_t i = 0; i < out; i++)
+    {
+        double center = ((double)i + 0.5) * scale, total = 0.0;
+        double low = floor(center - support + 0.5);
+        double high = floor(center + support + 0.5);
+        long first = (long)low, last = (long)high;
+        int32_t *fixed = w->weights + i * w->taps;
+        int32_t sum = 0;
+        size_t count = 0, largest = 0;
+
+        first = first < 0 ? 0 : first;
+        last = last > (long)in ? (long)in : last;
+        count = (size_t)(last - first);
+        count = count > w->taps ? w->taps : count;
+        for(size_t k = 0; k < count; k++)
+        {
+            double x = ((double)first + (double)k + 0.5 - center) / stretch;
+            row[k] = _filter_weight(filter, x);
+            total += row[k];
+        }
+        for(size_t k = 0; k < w->taps; k++)
+        {
+            fixed[k] = 0;
+            if(k >= count || total <= 0.0)
+                continue;
+            fixed[k] = (int32_t)lround(row[k] / total *
+                                       (1 << TGA_RESIZE_PRECISION));
+            sum += fixed[k];
+            largest = fixed[k] > fixed[largest] ? k : largest;
+        }
+        fixed[largest] += (1 << TGA_RESIZE_PRECISION) - sum;
+        w->start[i] = (size_t)first;
+        w->count[i] = count;
+    }
+    free(row);
+    return 1;
+
+error:
+    /* The caller frees whatever of w was allocated. */
+    free(row);
+    return 0;
+}
+
+static inline uint8_t _clamp_fixed(int32_t value)
+{
+    value >>= TGA_RESIZE_PRECISION;
+    return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+static inline void _filter_row(const uint8_t *restrict in,
+                               uint8_t *restrict out, const TGAWeights *w,
+                               size_t width, size_t channels)
+{
+    /* Locals, since stores to out could otherwise alias the table. */
+    const int32_t *restrict table = w->weights;
+    const size_t *restrict start = w->start;
+    const size_t *restrict count = w->count;
+    size_t taps = w->taps;
+
+    for(size_t x = 0; x < width; x++)
+    {
+        const int32_t *weights = table + x * taps;
+        const uint8_t *p = in + start[x] * channels;
+        int32_t acc[4] = {0};
+        for(size_t c = 0; c < channels; c++)
+            acc[c] = 1 << (TGA_RESIZE_PRECISION - 1);
+        for(size_t k = 0; k < count[x]; k++)
+        {
+            for(size_t c = 0; c < channels; c++)
+                acc[c] += weights[k] * p[k * channels + c];
+        }
+        for(size_t c = 0; c < channels; c++)
+            out[x * channels + c] = _clamp_fixed(acc[c]);
+    }
+}
+
+/* Channel counts are constants in each call so the inner loops unroll. */
+static void _horizontal_row(const uint8_t *in, uint8_t *out,
+                            const TGAWeights *w, size_t width, size_t channels)
+{
+    switch(channels)
+    {
+        case 1:
+            _filter_row(in, out, w, width, 1);
+            break;
+        case 3:
+            _filter_row(in, out, w, width, 3);
+            break;
+        default:
+            _filter_row(in, out, w, width, 4);
+            break;
+    }
+}
+
+static void _premultiply(uint8_t *row, size_t width)
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t a = row[x * 4 + 3];
+        for(size_t c = 0; c < 3; c++)
+            row[x * 4 + c] = (uint8_t)_tga_div255(row[x * 4 + c] * a);
+    }
+}
+
+static void _unpremultiply(uint8_t *row, size_t width)
+{
+    for(size_t x = 0; x < width; x++)
+    {
+        uint32_t a = row[x * 4 + 3];
+        for(size_t c = 0; c < 3; c++)
+        {
+            uint32_t v = a ? (row[x * 4 + c] * 255u + a / 2) / a : 0;
+            row[x * 4 + c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+    }
+}
+
+static void _horizontal_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAResizeJob *job = ctx;
+    TGAImage *src = job->src;
+    size_t height = src->_meta->height;
+    size_t stride = _tga_row_stride(src);
+    size_t bytes = _tga_bytes_per_pixel(src->_meta->pixel_depth);
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        uint8_t *row = job->scratch[chunk];
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        for(; y < last; y++)
+        {
+            const uint8_t *in = src->data + y * stride;
+            if(job->unpack || job->premultiply)
+            {
+                _tga_unpack_bgra(row, in, src->_meta->width, bytes);
+                if(job->premultiply)
+                    _premultiply(row, src->_meta->width);
+                in = row;
+            }
+            _horizontal_row(in, job->tmp + y * job->tmp_stride, &job->wx,
+                            job->out->_meta->width, job->channels);
+        }
+    }
+}
+
+/*
+ * Output rows are produced in bands. Each strip of a band is finished before
+ * the next strip starts, then rows that need converting (unpremultiplying or
+ * packing to 16 bits) are converted from the band buffer as a whole.
+ */
+static void _vertical_chunks(void *ctx, size_t begin, size_t end)
+{
+    TGAResizeJob *job = ctx;
+    TGAImage *out = job->out;
+    size_t height = out->_meta->height;
+    size_t stride = _tga_row_stride(out);
+    size_t bytes = _tga_bytes_per_pixel(out->_meta->pixel_depth);
+    size_t row_bytes = job->tmp_stride;
+    int convert = job->unpack || job->premultiply;
+
+    for(size_t chunk = begin; chunk < end; chunk++)
+    {
+        int32_t *restrict acc = (int32_t *)job->scratch[chunk];
+        uint8_t *band = job->scratch[chunk] + TGA_RESIZE_STRIP * sizeof(int32_t);
+        size_t y = chunk * job->chunk_rows;
+        size_t last = y + job->chunk_rows < height ? y + job->chunk_rows
+                                                   : height;
+        for(; y < last; y += job->band_rows)
+        {
+            size_t rows = last - y < job->band_rows ? last - y : job->band_rows;
+            for(size_t x0 = 0; x0 < row_bytes; x0 += TGA_RESIZE_STRIP)
+            {
+                size_t n = row_bytes - x0 < TGA_RESIZE_STRIP ? row_bytes - x0
+                                                             : TGA_RESIZE_STRIP;
+                for(size_t r = 0; r < rows; r++)
+                {
+                    size_t oy = y + r;
+                    const int32_t *weights = job->wy.weights + oy * job->wy.taps;
+                    const uint8_t *in = job->tmp + job->wy.start[oy] *
+                                        job->tmp_stride + x0;
+                    size_t count = job->wy.count[oy];
+                    uint8_t *restrict dst = convert ? band + r * row_bytes + x0
+                                                    : out->data + oy * stride + x0;
+
+                    for(size_t i = 0; i < n; i++)
+                        acc[i] = 1 << (TGA_RESIZE_PRECISION - 1);
+                    for(size_t k = 0; k < count; k++)
+                    {
+                        const uint8_t *restrict line = in + k * row_bytes;
+                        int32_t weight = weights[k];
+                        for(size_t i = 0; i < n; i++)
+                            acc[i] += weight * line[i];
+                    }
+                    for(size_t i = 0; i < n; i++)
+                        dst[i] = _clamp_fixed(acc[i]);
+                }
+            }
+            for(size_t r = 0; convert && r < rows; r++)
+            {
+                uint8_t *row = band + r * row_bytes;
+                if(job->premultiply)
+                    _unpremultiply(row, out->_meta->width);
+                _tga_pack_bgra(out->data + (y + r) * stride, row,
+                               out->_meta->width, bytes);
+            }
+        }
+    }
+}
+
+static bool _resizable(TGAImage *image, size_t *channels, int *unpack)
+{
+    uint8_t depth = image->_meta->pixel_depth;
+    *unpack = 0;
+    if(image->_meta->image_type == TGA_MONOCHROME && depth == 8)
+        *channels = 1;
+    else if(image->_meta->image_type != TGA_TRUECOLOR)
+        return false;
+    else if(depth == 16)
+    {
+        *channels = 4;
+        *unpack = 1;
+    }
+    else if(depth == 24 || depth == 32)
+        *channels = depth / 8;
+    else
+        return false;
+    return true;
+}
+
+/*
+ * Returns a copy of an image resampled to width x height with the given
+ * filter. Works on 8-bit monochrome and 16, 24 and 32-bit truecolor images;
+ * the copy keeps the source's depth, origin and header fields. Large images
+ * are split across tga_get_thread_count threads.
+ */
+TGAImage *tga_resize(TGAImage *src, uint16_t width, uint16_t height,
+                     TGAFilter filter)
+{
+    TGAResizeJob job = {0};
+    uint8_t *scratch[TGA_MAX_THREADS] = {0};
+    TGAImage *out = NULL;
+    size_t src_w = 0, src_h = 0, row = 0;
+    unsigned threads = 0, chunks = 0;
+
+    check(_tga_sanity(src), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(filter == TGA_FILTER_BILINEAR || filter == TGA_FILTER_BICUBIC ||
+            filter == TGA_FILTER_LANCZOS, TGA_ARG_ERR,
+            "Unknown filter %d.", (int)filter);
+    check(_resizable(src, &job.channels, &job.unpack), TGA_UNSUPPORTED,
+            "Only 8-bit monochrome and 16, 24 and 32-bit truecolor images "
+            "can be resized.");
+    src_w = src->_meta->width;
+    src_h = src->_meta->height;
+    check(width && height && src_w && src_h, TGA_ARG_ERR,
+            "Cannot resize %zux%zu to %ux%u.", src_w, src_h, width, height);
+    check(_tga_pixels(src), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    out = _tga_derive_image(src, src->_meta->pixel_depth, width, height);
+    check(out, tga_error(), "Unable to create resized image.");
+    if(width == src_w && height == src_h)
+    {
+        /* Every filter is the identity at scale 1. */
+        for(size_t y = 0; y < src_h; y++)
+            memcpy(out->data + y * _tga_row_stride(out),
+                   src->data + y * _tga_row_stride(src), _tga_row_bytes(out));
+        return out;
+    }
+    job.src = src;
+    job.out = out;
+    job.premultiply = job.channels == 4 &&
+                      (src->_meta->image_descriptor & 15) != 0;
+    check(_compute_weights(&job.wx, filter, src_w, width), tga_error(),
+            "Unable to compute horizontal weights.");
+    check(_compute_weights(&job.wy, filter, src_h, height), tga_error(),
+            "Unable to compute vertical weights.");
+    job.tmp_stride = (size_t)width * job.channels;
+    job.tmp = _tga_malloc(job.tmp_stride * src_h);
+    check(job.tmp, TGA_MEM_ERR, "Unable to allocate resampling buffer.");
+
+    /* Scratch holds a source row, or the accumulator and a band of rows. */
+    job.band_rows = TGA_RESIZE_BAND / job.tmp_stride;
+    job.band_rows = job.band_rows ? job.band_rows : 1;
+    row = src_w * 4;
+    if(row < TGA_RESIZE_STRIP * sizeof(int32_t) + job.band_rows * job.tmp_stride)
+        row = TGA_RESIZE_STRIP * sizeof(int32_t) + job.band_rows * job.tmp_stride;
+    threads = _tga_threads_for(job.tmp_stride * (src_h + height));
+    chunks = threads;
+    job.scratch = scratch;
+    for(unsigned i = 0; i < chunks; i++)
+    {
+        scratch[i] = _tga_malloc(row);
+        check(scratch[i], TGA_MEM_ERR, "Unable to allocate row buffer.");
+    }
+
+    job.chunk_rows = (src_h + chunks - 1) / chunks;
+    _tga_parallel_for((src_h + job.chunk_rows - 1) / job.chunk_rows, threads,
+                      _horizontal_chunks, &job);
+    job.chunk_rows = (height + chunks - 1) / chunks;
+    _tga_parallel_for((height + job.chunk_rows - 1) / job.chunk_rows, threads,
+                      _vertical_chunks, &job);
+
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    free(job.tmp);
+    _free_weights(&job.wx);
+    _free_weights(&job.wy);
+    return out;
+
+error:
+    for(unsigned i = 0; i < chunks; i++)
+        free(scratch[i]);
+    free(job.tmp);
+    _free_weights(&job.wx);
+    _free_weights(&job.wy);
+    free_tga_image(out);
+    return NULL;
+}
@@ -0,0 +1,114 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "Private/TGAPrivate.h"
+
+#ifndef TGA_NO_STATS
+TGA_THREAD_LOCAL TGAStats *tga_stats = NULL;
+TGAStageHook tga_stage_begin_hook = NULL;
+TGAStageHook tga_stage_end_hook = NULL;
+static void *tga_stage_hook_user = NULL;
+
+/* Start time of each stage that is currently running on this thread. */
+static TGA_THREAD_LOCAL uint64_t tga_stage_start[TGA_STAGE_COUNT];
+
+static uint64_t _tga_now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u +
+           (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u /
+           (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void _tga_stage_begin(TGAStage stage)
+{
+    if(tga_stage_begin_hook)
+        tga_stage_begin_hook(stage, tga_stage_hook_user);
+    if(tga_stats)
+        tga_stage_start[stage] = _tga_now_ns();
+}
+
+int _tga_stage_end(TGAStage stage, int result)
+{
+    if(tga_stats)
+        tga_stats->stage_ns[stage] += _tga_now_ns() - tga_stage_start[stage];
+    if(tga_stage_end_hook)
+        tga_stage_end_hook(stage, tga_stage_hook_user);
+    return result;
+}
+#endif/*TGA_NO_STATS*/
+
+void tga_set_stats(TGAStats *stats)
+{
+#ifndef TGA_NO_STATS
+    tga_stats = stats;
+#else
+    (void)stats;
+#endif
+}
+
+TGAStats *tga_get_stats(void)
+{
+#ifndef TGA_NO_STATS
+    return tga_stats;
+#else
+    return NULL;
+#endif
+}
+
+void tga_reset_stats(TGAStats *stats)
+{
+    if(stats)
+        memset(stats, 0, sizeof(*stats));
+}
+
+double tga_stats_average_run_length(const TGAStats *stats)
+{
+    if(!stats || stats->rle_run_packets == 0)
+        return 0.0;
+    return (double)stats->rle_run_pixels / (double)stats->rle_run_packets;
+}
+
+const char *tga_stage_name(TGAStage stage)
+{
+    switch(stage)
+    {
+        case TGA_STAGE_FOOTER: return "footer";
+        case TGA_STAGE_HEADER: return "header";
+        case TGA_STAGE_ID: return "id";
+        case TGA_STAGE_COLOR_MAP: return "color_map";
+        case TGA_STAGE_PIXELS: return "pixels";
+        default: return "unknown";
+    }
+}
+
+/* Hooks are process-wide; install them before any reads or writes start. */
+void tga_set_stage_hooks(TGAStageHook begin, TGAStageHook end, void *user)
+{
+#ifndef TGA_NO_STATS
+    tga_stage_begin_hook = begin;
+    tga_stage_end_hook = end;
+    tga_stage_hook_user = user;
+#else
+    (void)begin;
+    (void)end;
+    (void)user;
+#endif
+}
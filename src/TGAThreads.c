@@ -0,0 +1,119 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+unsigned _tga_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned)count : 1;
+#endif
+}
+
+/* Minimum work per thread before splitting an operation is worthwhile. */
+#define TGA_MIN_BYTES_PER_THREAD ((size_t)1 << 20)
+
+static unsigned tga_thread_count = 1;
+
+/* 0 selects one thread per CPU; 1 (the default) keeps everything serial. */
+void tga_set_thread_count(unsigned threads)
+{
+    tga_thread_count = threads;
+}
+
+unsigned tga_get_thread_count(void)
+{
+    unsigned threads = tga_thread_count ? tga_thread_count : _tga_cpu_count();
+    return threads < TGA_MAX_THREADS ? threads : TGA_MAX_THREADS;
+}
+
+unsigned _tga_threads_for(size_t bytes)
+{
+#ifdef TGA_HAVE_PTHREADS
+    unsigned threads = tga_get_thread_count();
+    size_t useful = bytes / TGA_MIN_BYTES_PER_THREAD;
+    if(useful < threads)
+        threads = (unsigned)(useful ? useful : 1);
+    return threads;
+#else
+    (void)bytes;
+    return 1;
+#endif
+}
+
+typedef struct {
+    TGAParallelFn fn;
+    void *ctx;
+    size_t begin;
+    size_t end;
+} TGAParallelRange;
+
+#ifdef TGA_HAVE_PTHREADS
+static void *_tga_parallel_thread(void *arg)
+{
+    TGAParallelRange *range = arg;
+    range->fn(range->ctx, range->begin, range->end);
+    return NULL;
+}
+#endif
+
+void _tga_parallel_for(size_t count, unsigned threads, TGAParallelFn fn,
+                       void *ctx)
+{
+#ifdef TGA_HAVE_PTHREADS
+    TGAParallelRange ranges[TGA_MAX_THREADS];
+    pthread_t handles[TGA_MAX_THREADS];
+    int started[TGA_MAX_THREADS];
+    size_t chunk = 0;
+    unsigned i = 0;
+
+    if(threads > TGA_MAX_THREADS)
+        threads = TGA_MAX_THREADS;
+    if(threads > count)
+        threads = (unsigned)count;
+    if(threads <= 1)
+    {
+        if(count)
+            fn(ctx, 0, count);
+        return;
+    }
+
+    chunk = (count + threads - 1) / threads;
+    for(i = 0; i < threads; i++)
+    {
+        ranges[i].fn = fn;
+        ranges[i].ctx = ctx;
+        ranges[i].begin = i * chunk < count ? i * chunk : count;
+        ranges[i].end = (i + 1) * chunk < count ? (i + 1) * chunk : count;
+        started[i] = 0;
+    }
+    for(i = 1; i < threads; i++)
+        started[i] = pthread_create(&handles[i], NULL, _tga_parallel_thread,
+                                    &ranges[i]) == 0;
+    fn(ctx, ranges[0].begin, ranges[0].end);
+    for(i = 1; i < threads; i++)
+    {
+        if(started[i])
+            pthread_join(handles[i], NULL);
+        else /* Could not start a thread, do its share here instead. */
+            fn(ctx, ranges[i].begin, ranges[i].end);
+    }
+#else
+    (void)threads;
+    if(count)
+        fn(ctx, 0, count);
+#endif
+}
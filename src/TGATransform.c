@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Private/TGAPrivate.h"
+#include "Private/TGAThreads.h"
+
+/*
+ * Rotations, transposes and flips. All operations are described in display
+ * (top-left) coordinates and produce images with the source's origin bits.
+ *
+ * The operations that swap width and height walk the output in square tiles.
+ * Within a tile, reading down a column of the source touches TGA_TILE rows,
+ * which stay in L1 until the tile moves on, rather than a new row (and a new
+ * cache line and page) for every output pixel. The copy loops take the pixel
+ * size as a constant so each size gets its own unrolled kernel.
+ *
+ * Flips swap rows or pixels in place.
+ */
+
+#define TGA_TILE            32      /* Tile edge in pixels. */
+#define TGA_SWAP_CHUNK      4096    /* Bytes swapped at a time by row flips. */
+
+typedef enum {
+    TGA_OP_TRANSPOSE,
+    TGA_OP_ROTATE90,
+    TGA_OP_ROTATE180,
+    TGA_OP_ROTATE270
+} TGATransformOp;
+
+typedef struct {
+    TGAImage *src;
+    TGAImage *out;
+    size_t bytes;
+    ptrdiff_t base;             /* Source offset of output stored (0, 0). */
+    ptrdiff_t step_x;           /* Source offset per output stored column. */
+    ptrdiff_t step_y;           /* Source offset per output stored row. */
+} TGATransformJob;
+
+typedef struct {
+    TGAImage *image;
+    int rows;
+    int columns;
+} TGAFlipJob;
+
+/* Stored offset of display pixel (x, y) of an image. */
+static ptrdiff_t _stored_offset(TGAImage *image, ptrdiff_t x, ptrdiff_t y)
+{
+    ptrdiff_t width = image->_meta->width, height = image->_meta->height;
+    uint8_t descriptor = image->_meta->image_descriptor;
+    ptrdiff_t sx = (descriptor & TGA_ORIGIN_RIGHT) ? width - 1 - x : x;
+    ptrdiff_t sy = (descriptor & TGA_ORIGIN_TOP) ? y : height - 1 - y;
+    return sy * (ptrdiff_t)_tga_row_stride(image) +
+           sx * (ptrdiff_t)_tga_bytes_per_pixel(image->_meta->pixel_depth);
+}
+
+/*
+ * Source offset of the pixel shown at output stored position (ox, oy). Every
+ * operation is affine in (ox, oy), so three evaluations give the whole map.
+ */
+static ptrdiff_t _source_offset(TGATransformOp op, TGAImage *src,
+                                TGAImage *out, ptrdiff_t ox, ptrdiff_t oy)
+{
+    ptrdiff_t w = out->_meta->width, h = out->_meta->height;
+    uint8_t descriptor = out->_meta->image_descriptor;
+    ptrdiff_t x = (descriptor & TGA_ORIGIN_RIGHT) ? w - 1 - ox : ox;
+    ptrdiff_t y = (descriptor & TGA_ORIGIN_TOP) ? oy : h - 1 - oy;
+
+    switch(op)
+    {
+        case TGA_OP_ROTATE90: /* Clockwise. */
+            return _stored_offset(src, y, src->_meta->height - 1 - x);
+        case TGA_OP_ROTATE180:
+            return _stored_offset(src, src->_meta->width - 1 - x,
+                                  src->_meta->height - 1 - y);
+        case TGA_OP_ROTATE270:
+            return _stored_offset(src, src->_meta->width - 1 - y, x);
+        default:
+            return _stored_offset(src, y, x);
+    }
+}
+
+static inline void _gather(uint8_t *restrict dst, const uint8_t *restrict src,
+                           ptrdiff_t step, size_t count, size_t bytes)
+{
+    for(size_t i = 0; i < count; i++)
+        memcpy(dst + i * bytes, src + (ptrdiff_t)i * step, bytes);
+}
+
+static void _gather_pixels(uint8_t *dst, const uint8_t *src, ptrdiff_t step,
+                           size_t count, size_t bytes)
+{
+    switch(bytes)
+    {
+        case 1:
+            _gather(dst, src, step, count, 1);
+            break;
+        case 2:
+            _gather(dst, src, step, count, 2);
+            break;
+        case 3:
+            _gather(dst, src, step, count, 3);
+            break;
+        default:
+            _gather(dst, src, step, count, 4);
+            break;
+    }
+}
+
+/* Each unit of work is one row of tiles. */
+static void _transform_bands(void *ctx, size_t begin, size_t end)
+{
+    TGATransformJob *job = ctx;
+    size_t width = job->out->_meta->width, height = job->out->_meta->height;
+    size_t stride = _tga_row_stride(job->out);
+
+    for(size_t band = begin; band < end; band++)
+    {
+        size_t y0 = band * TGA_TILE;
+        size_t y1 = y0 + TGA_TILE < height ? y0 + TGA_TILE : height;
+        for(size_t x0 = 0; x0 < width; x0 += TGA_TILE)
+        {
+            size_t count = width - x0 < TGA_TILE ? width - x0 : TGA_TILE;
+            for(size_t y = y0; y < y1; y++)
+            {
+                const uint8_t *src = job->src->data +
+                    (job->base + (ptrdiff_t)x0 * job->step_x +
+                     (ptrdiff_t)y * job->step_y);
+                _gather_pixels(job->out->data + y * stride + x0 * job->bytes,
+                               src, job->step_x, count, job->bytes);
+            }
+        }
+    }
+}
+
+static bool _transformable(TGAImage *image)
+{
+    return image->_meta->image_type == TGA_TRUECOLOR ||
+           image->_meta->image_type == TGA_MONOCHROME;
+}
+
+static TGAImage *_transform(TGAImage *image, TGATransformOp op)
+{
+    TGATransformJob job = {0};
+    TGAImage *out = NULL;
+    size_t width = 0, height = 0, bands = 0;
+    int swap = op != TGA_OP_ROTATE180;
+
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(_transformable(image), TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be transformed.");
+    width = swap ? image->_meta->height : image->_meta->width;
+    height = swap ? image->_meta->width : image->_meta->height;
+    out = _tga_derive_image(image, image->_meta->pixel_depth, (uint16_t)width,
+                            (uint16_t)height);
+    check(out, tga_error(), "Unable to create transformed image.");
+    if(width == 0 || height == 0)
+        return out;
+    check(_tga_pixels(image), TGA_INV_IMAGE_PNT, "Image data missing.");
+
+    job.src = image;
+    job.out = out;
+    job.bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    job.base = _source_offset(op, image, out, 0, 0);
+    job.step_x = _source_offset(op, image, out, 1, 0) - job.base;
+    job.step_y = _source_offset(op, image, out, 0, 1) - job.base;
+    bands = (height + TGA_TILE - 1) / TGA_TILE;
+    _tga_parallel_for(bands, _tga_threads_for(_tga_row_stride(out) * height),
+                      _transform_bands, &job);
+    return out;
+
+error:
+    free_tga_image(out);
+    return NULL;
+}
+
+/*
+ * Rotated and transposed copies. Rotations are clockwise; the transpose
+ * mirrors the image about its top-left to bottom-right diagonal.
+ */
+TGAImage *tga_rotate90(TGAImage *image)
+{
+    return _transform(image, TGA_OP_ROTATE90);
+}
+
+TGAImage *tga_rotate180(TGAImage *image)
+{
+    return _transform(image, TGA_OP_ROTATE180);
+}
+
+TGAImage *tga_rotate270(TGAImage *image)
+{
+    return _transform(image, TGA_OP_ROTATE270);
+}
+
+TGAImage *tga_transpose(TGAImage *image)
+{
+    return _transform(image, TGA_OP_TRANSPOSE);
+}
+
+static inline void _mirror(uint8_t *row, size_t width, size_t bytes)
+{
+    for(size_t x = 0; x < width / 2; x++)
+    {
+        uint8_t pixel[4];
+        uint8_t *a = row + x * bytes, *b = row + (width - 1 - x) * bytes;
+        memcpy(pixel, a, bytes);
+        memcpy(a, b, bytes);
+        memcpy(b, pixel, bytes);
+    }
+}
+
+static void _mirror_row(uint8_t *row, size_t width, size_t bytes)
+{
+    switch(bytes)
+    {
+        case 1:
+            _mirror(row, width, 1);
+            break;
+        case 2:
+            _mirror(row, width, 2);
+            break;
+        case 3:
+            _mirror(row, width, 3);
+            break;
+        default:
+            _mirror(row, width, 4);
+            break;
+    }
+}
+
+static void _swap_rows(uint8_t *a, uint8_t *b, size_t length)
+{
+    uint8_t chunk[TGA_SWAP_CHUNK];
+    for(size_t done = 0; done < length; done += TGA_SWAP_CHUNK)
+    {
+        size_t n = length - done < TGA_SWAP_CHUNK ? length - done
+                                                  : TGA_SWAP_CHUNK;
+        memcpy(chunk, a + done, n);
+        memcpy(a + done, b + done, n);
+        memcpy(b + done, chunk, n);
+    }
+}
+
+/* Each unit of work is a pair of rows: row y and its mirror. */
+static void _flip_rows(void *ctx, size_t begin, size_t end)
+{
+    TGAFlipJob *job = ctx;
+    TGAImage *image = job->image;
+    size_t width = image->_meta->width, height = image->_meta->height;
+    size_t bytes = _tga_bytes_per_pixel(image->_meta->pixel_depth);
+    size_t stride = _tga_row_stride(image);
+
+    for(size_t y = begin; y < end; y++)
+    {
+        uint8_t *a = image->data + y * stride;
+        uint8_t *b = image->data + (height - 1 - y) * stride;
+        if(job->columns)
+        {
+            _mirror_row(a, width, bytes);
+            if(a != b)
+                _mirror_row(b, width, bytes);
+        }
+        if(job->rows && a != b)
+            _swap_rows(a, b, stride);
+    }
+}
+
+/*
+ * Reverses the stored order of rows and/or of the pixels within each row, in
+ * place. The origin bits are left alone, so the displayed image flips.
+ */
+int _tga_flip_stored(TGAImage *image, int rows, int columns)
+{
+    TGAFlipJob job = {image, rows, columns};
+    size_t height = image->_meta->height;
+
+    if(!(rows || columns) || image->_meta->width == 0 || height == 0)
+        return 1;
+    check(_tga_writable_pixels(image), TGA_INV_IMAGE_PNT,
+            "Image data missing.");
+    _tga_parallel_for((height + 1) / 2,
+                      _tga_threads_for(_tga_row_stride(image) * height),
+                      _flip_rows, &job);
+    return 1;
+error:
+    return 0;
+}
+
+/* Mirror an image left to right or top to bottom, in place. */
+uint8_t tga_flip_h(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(_transformable(image), TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be flipped.");
+    return (uint8_t)_tga_flip_stored(image, 0, 1);
+error:
+    return 0;
+}
+
+uint8_t tga_flip_v(TGAImage *image)
+{
+    check(_tga_sanity(image), TGA_INV_IMAGE_PNT, "Invalid TGAImage Pointer.");
+    check(_transformable(image), TGA_UNSUPPORTED,
+            "Only truecolor and monochrome images can be flipped.");
+    return (uint8_t)_tga_flip_stored(image, 1, 0);
+error:
+    return 0;
+}
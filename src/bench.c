@@ -0,0 +1,551 @@
+/*
+ * Throughput benchmark for the TGA library.
+ *
+ * Every .tga file found below the image directory (the repository's images/
+ * corpus by default) is decoded, re-encoded and run through the per-pixel
+ * getters, setters and tga_set_pixel_block. Synthetic images of every
+ * writable type and depth are generated and measured the same way, both raw
+ * and RLE compressed. Results
+ * are printed as a table and can optionally be written to a JSON file so runs
+ * on the same machine can be compared against each other.
+ *
+ * Usage: TGABench [--images DIR] [--size N] [--iterations N] [--threads N]
+ *                 [--json FILE]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <TGAImage.h>
+
+#ifndef TGA_BENCH_IMAGES
+#define TGA_BENCH_IMAGES "images"
+#endif
+
+#define BENCH_TMP_FILE  "TGABench.tmp.tga"
+#define BENCH_NAME_MAX  256
+
+/*
+ * Allocation counting. When linked with -Wl,--wrap=malloc (and friends) every
+ * allocation made by the library ends up in these wrappers. Without the
+ * wrappers the allocation columns are reported as -1.
+ */
+static uint64_t bench_allocs = 0;
+static uint64_t bench_alloc_bytes = 0;
+
+#ifdef TGA_BENCH_WRAP_MALLOC
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    __real_free(ptr);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#else
+#define BENCH_COUNTS_ALLOCS 0
+#endif/*TGA_BENCH_WRAP_MALLOC*/
+
+typedef struct {
+    char image[BENCH_NAME_MAX];
+    const char *op;
+    uint16_t width;
+    uint16_t height;
+    uint8_t depth;
+    uint8_t type;
+    uint64_t bytes;         /* Bytes processed by one operation */
+    double seconds;         /* Mean wall time of one operation */
+    double allocs;          /* Mean allocations per operation */
+    double alloc_bytes;     /* Mean bytes allocated per operation */
+} BenchResult;
+
+typedef struct {
+    BenchResult *items;
+    size_t count;
+    size_t capacity;
+} BenchResults;
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    double start;
+} BenchMark;
+
+static int bench_iterations = 5;
+static volatile uint32_t bench_sink = 0;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_begin(BenchMark *mark)
+{
+    mark->allocs = bench_allocs;
+    mark->alloc_bytes = bench_alloc_bytes;
+    mark->start = bench_now();
+}
+
+static void bench_end(BenchResults *results, BenchMark *mark, TGAImage *img,
+                      const char *name, const char *op, uint64_t bytes, int n)
+{
+    double elapsed = bench_now() - mark->start;
+    TGAColorType type = tga_get_image_type(img);
+    BenchResult *res = NULL;
+
+    if(results->count == results->capacity)
+    {
+        size_t cap = results->capacity ? results->capacity * 2 : 64;
+        BenchResult *items = realloc(results->items, cap * sizeof(*items));
+        if(!items)
+        {
+            fprintf(stderr, "Out of memory recording results.\n");
+            exit(1);
+        }
+        results->items = items;
+        results->capacity = cap;
+    }
+    res = &results->items[results->count++];
+    memset(res, 0, sizeof(*res));
+    snprintf(res->image, sizeof(res->image), "%s", name);
+    res->op = op;
+    res->width = tga_get_width(img);
+    res->height = tga_get_height(img);
+    res->depth = tga_get_pixel_depth(img);
+    res->type = (uint8_t)type;
+    res->bytes = bytes;
+    res->seconds = elapsed / n;
+    if(BENCH_COUNTS_ALLOCS)
+    {
+        res->allocs = (double)(bench_allocs - mark->allocs) / n;
+        res->alloc_bytes = (double)(bench_alloc_bytes - mark->alloc_bytes) / n;
+    }
+    else
+    {
+        res->allocs = res->alloc_bytes = -1;
+    }
+}
+
+static uint64_t bench_file_size(const char *path)
+{
+    struct stat st;
+    if(stat(path, &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+}
+
+static int bench_has_channels(TGAImage *img)
+{
+    TGAColorType type = tga_get_image_type(img);
+    if(tga_is_monochrome(img))
+        return 1;
+    return type == TGA_TRUECOLOR &&
+           (tga_get_pixel_depth(img) == 16 || tga_get_pixel_depth(img) == 24 ||
+            tga_get_pixel_depth(img) == 32);
+}
+
+static void bench_pixels(BenchResults *results, TGAImage *img, const char *name)
+{
+    BenchMark mark;
+    uint16_t width = tga_get_width(img);
+    uint16_t height = tga_get_height(img);
+    uint8_t depth = tga_get_pixel_depth(img);
+    uint64_t bytes = (uint64_t)width * height * ((depth + 7) / 8);
+    int mono = tga_is_monochrome(img);
+    int alpha = depth == 16 || depth == 32;
+    uint32_t acc = 0;
+    uint8_t *pixel = NULL;
+    uint16_t x, y;
+    int i;
+
+    if(!bench_has_channels(img) || bytes == 0)
+        return;
+
+    bench_begin(&mark);
+    for(i = 0; i < bench_iterations; i++)
+        for(y = 0; y < height; y++)
+            for(x = 0; x < width; x++)
+            {
+                if(mono)
+                {
+                    acc += tga_get_mono_at(img, x, y);
+                    continue;
+                }
+                acc += tga_get_red_at(img, x, y);
+                acc += tga_get_green_at(img, x, y);
+                acc += tga_get_blue_at(img, x, y);
+                if(alpha)
+                    acc += tga_get_alpha_at(img, x, y);
+            }
+    bench_end(results, &mark, img, name, "get", bytes, bench_iterations);
+    bench_sink += acc;
+
+    bench_begin(&mark);
+    for(i = 0; i < bench_iterations; i++)
+        for(y = 0; y < height; y++)
+            for(x = 0; x < width; x++)
+            {
+                if(mono)
+                {
+                    tga_set_mono_at(img, x, y, (uint8_t)(x ^ y));
+                    continue;
+                }
+                tga_set_red_at(img, x, y, (uint8_t)x);
+                tga_set_green_at(img, x, y, (uint8_t)y);
+                tga_set_blue_at(img, x, y, (uint8_t)(x ^ y));
+                if(alpha)
+                    tga_set_alpha_at(img, x, y, 255);
+            }
+    bench_end(results, &mark, img, name, "set", bytes, bench_iterations);
+
+    /* Block fills are issued one row at a time so every call stays inside
+     * the image whatever the origin of the image is. */
+    if(mono)
+    {
+        pixel = malloc(1);
+        if(pixel)
+            *pixel = 0x7F;
+    }
+    else
+    {
+        pixel = tga_create_pixel_for_image(img, 200, 100, 50, 255);
+    }
+    if(!pixel)
+        return;
+    bench_begin(&mark);
+    for(i = 0; i < bench_iterations; i++)
+        for(y = 0; y < height; y++)
+            tga_set_pixel_block(img, 0, y, width, 1, pixel);
+    bench_end(results, &mark, img, name, "block", bytes, bench_iterations);
+    tga_free_pixel(pixel);
+}
+
+static void bench_encode(BenchResults *results, TGAImage *img, const char *name)
+{
+    BenchMark mark;
+    int i;
+    TGAColorType type = tga_get_image_type(img);
+
+    if(type != TGA_TRUECOLOR && type != TGA_MONOCHROME)
+        return;
+
+    bench_begin(&mark);
+    for(i = 0; i < bench_iterations; i++)
+    {
+        if(!write_tga_image(img, BENCH_TMP_FILE))
+        {
+            fprintf(stderr, "%s: encode failed: %s\n", name, tga_error_str());
+            tga_clear_error();
+            return;
+        }
+    }
+    bench_end(results, &mark, img, name, "encode",
+              bench_file_size(BENCH_TMP_FILE), bench_iterations);
+}
+
+/* Decodes the file repeatedly and returns the last decoded image. */
+static TGAImage *bench_decode(BenchResults *results, const char *path,
+                              const char *name)
+{
+    BenchMark mark;
+    TGAImage *img = NULL;
+    FILE *file = fopen(path, "rb");
+    int i;
+
+    if(!file)
+    {
+        fprintf(stderr, "%s: unable to open file.\n", name);
+        return NULL;
+    }
+
+    bench_begin(&mark);
+    for(i = 0; i < bench_iterations; i++)
+    {
+        free_tga_image(img);
+        img = read_tga_image(file);
+        if(!img)
+        {
+            fprintf(stderr, "%s: decode failed: %s\n", name, tga_error_str());
+            tga_clear_error();
+            fclose(file);
+            return NULL;
+        }
+    }
+    bench_end(results, &mark, img, name, "decode", bench_file_size(path),
+              bench_iterations);
+    fclose(file);
+    return img;
+}
+
+static void bench_file(BenchResults *results, const char *path,
+                       const char *name, TGACompression compression)
+{
+    TGAImage *img = bench_decode(results, path, name);
+    if(!img)
+        return;
+    tga_set_compression(img, compression);
+    bench_encode(results, img, name);
+    bench_pixels(results, img, name);
+    free_tga_image(img);
+}
+
+static void bench_synthetic(BenchResults *results, TGAColorType type,
+                            uint8_t depth, uint16_t size,
+                            TGACompression compression)
+{
+    char name[BENCH_NAME_MAX];
+    char path[BENCH_NAME_MAX];
+    TGAImage *img = new_tga_image(type, depth, size, size);
+    size_t total = (size_t)size * size * ((depth + 7) / 8);
+    size_t i;
+
+    snprintf(name, sizeof(name), "synthetic/%s%u_%ux%u%s",
+             type == TGA_MONOCHROME ? "mono" : "truecolor",
+             depth, size, size, compression == TGA_COMPRESS_RLE ? "_rle" : "");
+    if(!img)
+    {
+        fprintf(stderr, "%s: unable to create image: %s\n", name,
+                tga_error_str());
+        tga_clear_error();
+        return;
+    }
+
+    /* Mix of flat areas and noise, roughly like real texture content. */
+    for(i = 0; i < total; i++)
+        img->data[i] = (uint8_t)((i / 4096) % 2 ? (i * 2654435761u) >> 24
+                                                : (i / 65536));
+
+    /* Round-trip through a file so decoding is measured on the real format. */
+    snprintf(path, sizeof(path), "%s", BENCH_TMP_FILE);
+    tga_set_compression(img, compression);
+    if(!write_tga_image(img, path))
+    {
+        fprintf(stderr, "%s: unable to write image: %s\n", name,
+                tga_error_str());
+        tga_clear_error();
+        free_tga_image(img);
+        return;
+    }
+    free_tga_image(img);
+    bench_file(results, path, name, compression);
+}
+
+static int bench_is_tga(const char *name)
+{
+    size_t len = strlen(name);
+    const char *ext = NULL;
+    if(len < 4)
+        return 0;
+    ext = name + len - 4;
+    return ext[0] == '.' && (ext[1] == 't' || ext[1] == 'T') &&
+           (ext[2] == 'g' || ext[2] == 'G') && (ext[3] == 'a' || ext[3] == 'A');
+}
+
+static int bench_compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Recursively collects every .tga file below dir. */
+static void bench_collect(const char *dir, char ***paths, size_t *count,
+                          size_t *capacity)
+{
+    char path[BENCH_NAME_MAX * 2];
+    struct dirent *entry = NULL;
+    struct stat st;
+    DIR *handle = opendir(dir);
+
+    if(!handle)
+        return;
+    while((entry = readdir(handle)))
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if(stat(path, &st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+        {
+            bench_collect(path, paths, count, capacity);
+        }
+        else if(bench_is_tga(entry->d_name))
+        {
+            if(*count == *capacity)
+            {
+                size_t cap = *capacity ? *capacity * 2 : 32;
+                char **grown = realloc(*paths, cap * sizeof(char *));
+                if(!grown)
+                    break;
+                *paths = grown;
+                *capacity = cap;
+            }
+            (*paths)[*count] = malloc(strlen(path) + 1);
+            if(!(*paths)[*count])
+                break;
+            strcpy((*paths)[*count], path);
+            (*count)++;
+        }
+    }
+    closedir(handle);
+}
+
+static double bench_mb_per_s(const BenchResult *res)
+{
+    return res->seconds > 0 ? (double)res->bytes / 1e6 / res->seconds : 0;
+}
+
+static double bench_per_s(const BenchResult *res)
+{
+    return res->seconds > 0 ? 1.0 / res->seconds : 0;
+}
+
+static void bench_print(const BenchResults *results)
+{
+    size_t i;
+    printf("%-40s %-7s %11s %11s %10s %12s\n", "image", "op", "MB/s",
+           "images/s", "allocs/op", "bytes/op");
+    for(i = 0; i < results->count; i++)
+    {
+        const BenchResult *res = &results->items[i];
+        printf("%-40s %-7s %11.2f %11.2f %10.1f %12.0f\n", res->image,
+               res->op, bench_mb_per_s(res), bench_per_s(res), res->allocs,
+               res->alloc_bytes);
+    }
+}
+
+static int bench_write_json(const BenchResults *results, const char *path)
+{
+    size_t i;
+    FILE *out = fopen(path, "w");
+    if(!out)
+        return 0;
+
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"results\": [\n",
+            bench_iterations);
+    for(i = 0; i < results->count; i++)
+    {
+        const BenchResult *res = &results->items[i];
+        fprintf(out, "    {\"image\": \"%s\", \"op\": \"%s\", "
+                "\"width\": %u, \"height\": %u, \"depth\": %u, "
+                "\"type\": %u, \"bytes\": %llu, \"seconds\": %.9f, "
+                "\"mb_per_s\": %.3f, \"images_per_s\": %.3f, "
+                "\"allocs\": %.1f, \"alloc_bytes\": %.0f}%s\n",
+                res->image, res->op, res->width, res->height, res->depth,
+                res->type, (unsigned long long)res->bytes, res->seconds,
+                bench_mb_per_s(res), bench_per_s(res), res->allocs,
+                res->alloc_bytes, i + 1 < results->count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+static void bench_usage(void)
+{
+    printf("Usage: TGABench [--images DIR] [--size N] [--iterations N] "
+           "[--threads N] [--json FILE]\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct { TGAColorType type; uint8_t depth; } synthetic[] = {
+        { TGA_MONOCHROME, 8 },
+        { TGA_TRUECOLOR, 16 },
+        { TGA_TRUECOLOR, 24 },
+        { TGA_TRUECOLOR, 32 },
+    };
+    BenchResults results = { NULL, 0, 0 };
+    const char *images = TGA_BENCH_IMAGES;
+    const char *json = NULL;
+    long size = 2048;
+    char **paths = NULL;
+    size_t count = 0, capacity = 0, prefix = 0, i;
+    int arg;
+
+    for(arg = 1; arg < argc; arg++)
+    {
+        if(strcmp(argv[arg], "--images") == 0 && arg + 1 < argc)
+            images = argv[++arg];
+        else if(strcmp(argv[arg], "--size") == 0 && arg + 1 < argc)
+            size = strtol(argv[++arg], NULL, 10);
+        else if(strcmp(argv[arg], "--iterations") == 0 && arg + 1 < argc)
+            bench_iterations = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+            tga_set_thread_count((unsigned)strtoul(argv[++arg], NULL, 10));
+        else if(strcmp(argv[arg], "--json") == 0 && arg + 1 < argc)
+            json = argv[++arg];
+        else
+        {
+            bench_usage();
+            return arg < argc && strcmp(argv[arg], "--help") == 0 ? 0 : 1;
+        }
+    }
+    if(bench_iterations < 1 || size < 1 || size > UINT16_MAX)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    bench_collect(images, &paths, &count, &capacity);
+    qsort(paths, count, sizeof(char *), bench_compare_paths);
+    prefix = strlen(images) + 1;
+    for(i = 0; i < count; i++)
+    {
+        bench_file(&results, paths[i], paths[i] + prefix, TGA_COMPRESS_NONE);
+        free(paths[i]);
+    }
+    free(paths);
+
+    for(i = 0; i < sizeof(synthetic) / sizeof(synthetic[0]); i++)
+    {
+        bench_synthetic(&results, synthetic[i].type, synthetic[i].depth,
+                        (uint16_t)size, TGA_COMPRESS_NONE);
+        bench_synthetic(&results, synthetic[i].type, synthetic[i].depth,
+                        (uint16_t)size, TGA_COMPRESS_RLE);
+    }
+    remove(BENCH_TMP_FILE);
+
+    bench_print(&results);
+    if(json && !bench_write_json(&results, json))
+    {
+        fprintf(stderr, "Unable to write JSON results to %s\n", json);
+        free(results.items);
+        return 1;
+    }
+    free(results.items);
+    return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * Batch transcoder for trees of TGA images.
+ *
+ * Every .tga file found below INPUT is decoded, converted as requested and
+ * written to the same relative path below OUTPUT, creating directories as
+ * needed. Files are spread over a pool of worker threads, one per CPU by
+ * default. Each worker keeps its file buffer between files, so steady state
+ * conversion does not allocate for input. A line with the stage timings is
+ * printed per file, followed by a summary with the overall throughput.
+ *
+ * Usage: TGAConvert [--rle | --raw | --auto] [--depth 16|24|32]
+ *                   [--origin top|bottom] [--threads N] [--quiet] INPUT OUTPUT
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef TGA_CONVERT_THREADS
+#include <pthread.h>
+#endif
+
+#include <TGAImage.h>
+
+#define CONVERT_PATH_MAX    4096
+#define CONVERT_MAX_THREADS 64
+
+typedef enum {
+    CONVERT_KEEP            = 0,
+    CONVERT_RAW             = 1,
+    CONVERT_RLE             = 2,
+    CONVERT_AUTO            = 3     /* Whichever is estimated smaller. */
+} ConvertCompression;
+
+typedef struct {
+    ConvertCompression compression;
+    uint8_t depth;              /* 0 keeps the source depth. */
+    int origin;                 /* -1 keeps, 0 bottom-left, 1 top-left. */
+    int quiet;
+    const char *input;
+    const char *output;
+} ConvertOptions;
+
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t next;                /* Next file to hand out. */
+    const ConvertOptions *options;
+    size_t failed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+#ifdef TGA_CONVERT_THREADS
+    pthread_mutex_t lock;
+#endif
+} ConvertQueue;
+
+typedef struct {
+    ConvertQueue *queue;
+    uint8_t *buffer;            /* Reused for the contents of every file. */
+    size_t capacity;
+} ConvertWorker;
+
+static double convert_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void convert_lock(ConvertQueue *queue)
+{
+#ifdef TGA_CONVERT_THREADS
+    pthread_mutex_lock(&queue->lock);
+#else
+    (void)queue;
+#endif
+}
+
+static void convert_unlock(ConvertQueue *queue)
+{
+#ifdef TGA_CONVERT_THREADS
+    pthread_mutex_unlock(&queue->lock);
+#else
+    (void)queue;
+#endif
+}
+
+static int convert_is_tga(const char *name)
+{
+    size_t len = strlen(name);
+    const char *ext = NULL;
+    if(len < 4)
+        return 0;
+    ext = name + len - 4;
+    return ext[0] == '.' && (ext[1] == 't' || ext[1] == 'T') &&
+           (ext[2] == 'g' || ext[2] == 'G') && (ext[3] == 'a' || ext[3] == 'A');
+}
+
+static int convert_compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Recursively collects every .tga file below dir, relative to the root. */
+static void convert_collect(const char *root, const char *dir, char ***paths,
+                            size_t *count, size_t *capacity)
+{
+    char path[CONVERT_PATH_MAX * 2];
+    char relative[CONVERT_PATH_MAX];
+    struct dirent *entry = NULL;
+    struct stat st;
+    DIR *handle = NULL;
+
+    snprintf(path, sizeof(path), "%s%s%s", root, dir[0] ? "/" : "", dir);
+    handle = opendir(path);
+    if(!handle)
+        return;
+    while((entry = readdir(handle)))
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(relative, sizeof(relative), "%s%s%s", dir, dir[0] ? "/" : "",
+                 entry->d_name);
+        snprintf(path, sizeof(path), "%s/%s", root, relative);
+        if(stat(path, &st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+        {
+            convert_collect(root, relative, paths, count, capacity);
+        }
+        else if(convert_is_tga(entry->d_name))
+        {
+            if(*count == *capacity)
+            {
+                size_t cap = *capacity ? *capacity * 2 : 32;
+                char **grown = realloc(*paths, cap * sizeof(char *));
+                if(!grown)
+                    break;
+                *paths = grown;
+                *capacity = cap;
+            }
+            (*paths)[*count] = malloc(strlen(relative) + 1);
+            if(!(*paths)[*count])
+                break;
+            strcpy((*paths)[*count], relative);
+            (*count)++;
+        }
+    }
+    closedir(handle);
+}
+
+/* Creates every missing directory leading up to the file at path. */
+static int convert_make_parents(const char *path)
+{
+    char dir[CONVERT_PATH_MAX];
+    size_t i;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for(i = 1; dir[i]; i++)
+    {
+        if(dir[i] != '/')
+            continue;
+        dir[i] = '\0';
+        if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+            return 0;
+        dir[i] = '/';
+    }
+    return 1;
+}
+
+/* Reads a whole file into the worker's buffer, growing it when needed. */
+static int convert_read_file(ConvertWorker *worker, const char *path,
+                             size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    long size = 0;
+
+    if(!file)
+        return 0;
+    if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+       fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return 0;
+    }
+    if((size_t)size > worker->capacity)
+    {
+        uint8_t *grown = realloc(worker->buffer, (size_t)size);
+        if(!grown)
+        {
+            fclose(file);
+            return 0;
+        }
+        worker->buffer = grown;
+        worker->capacity = (size_t)size;
+    }
+    *length = fread(worker->buffer, 1, (size_t)size, file);
+    fclose(file);
+    return *length == (size_t)size;
+}
+
+/* Applies the requested depth and origin; may replace the image. */
+static TGAImage *convert_image(TGAImage *img, const ConvertOptions *options)
+{
+    if(options->depth && tga_get_image_type(img) == TGA_TRUECOLOR &&
+       tga_get_pixel_depth(img) != options->depth)
+    {
+        TGAImage *converted = tga_convert_depth(img, options->depth);
+        free_tga_image(img);
+        img = converted;
+        if(!img)
+            return NULL;
+    }
+    if(options->origin >= 0 &&
+       !tga_set_origin(img, 0, (uint8_t)options->origin))
+    {
+        free_tga_image(img);
+        return NULL;
+    }
+    return img;
+}
+
+static void convert_one(ConvertWorker *worker, const char *relative)
+{
+    ConvertQueue *queue = worker->queue;
+    const ConvertOptions *options = queue->options;
+    char in_path[CONVERT_PATH_MAX];
+    char out_path[CONVERT_PATH_MAX];
+    double start = 0, read_end = 0, decode_end = 0, convert_end = 0, end = 0;
+    TGAImage *img = NULL;
+    const char *failure = NULL;
+    size_t length = 0;
+    struct stat st;
+    int rle = 0;
+
+    snprintf(in_path, sizeof(in_path), "%s/%s", options->input, relative);
+    snprintf(out_path, sizeof(out_path), "%s/%s", options->output, relative);
+
+    start = convert_now();
+    if(!convert_read_file(worker, in_path, &length))
+        failure = "unable to read file";
+    read_end = convert_now();
+    if(!failure)
+    {
+        img = read_tga_image_from_memory(worker->buffer, length);
+        if(!img)
+            failure = tga_error_str();
+        /* Keep the source's compression unless told otherwise. */
+        rle = length > 2 && (worker->buffer[2] & 8) != 0;
+    }
+    decode_end = convert_now();
+    if(!failure)
+    {
+        img = convert_image(img, options);
+        if(!img)
+            failure = tga_error_str();
+    }
+    convert_end = convert_now();
+    if(!failure)
+    {
+        if(options->compression != CONVERT_KEEP)
+            rle = options->compression == CONVERT_RLE;
+        tga_set_compression(img, options->compression == CONVERT_AUTO ?
+                            TGA_COMPRESS_AUTO : rle ? TGA_COMPRESS_RLE :
+                                                      TGA_COMPRESS_NONE);
+        if(!convert_make_parents(out_path))
+            failure = "unable to create output directory";
+        else if(!write_tga_image(img, out_path))
+            failure = tga_error_str();
+    }
+    end = convert_now();
+    free_tga_image(img);
+
+    convert_lock(queue);
+    if(failure)
+    {
+        queue->failed++;
+        fprintf(stderr, "%s: %s\n", relative, failure);
+        tga_clear_error();
+    }
+    else
+    {
+        queue->bytes_in += length;
+        if(stat(out_path, &st) == 0)
+            queue->bytes_out += (uint64_t)st.st_size;
+        if(!options->quiet)
+            printf("%8.2f ms (read %6.2f decode %6.2f convert %6.2f "
+                   "encode %6.2f)  %s\n", (end - start) * 1e3,
+                   (read_end - start) * 1e3, (decode_end - read_end) * 1e3,
+                   (convert_end - decode_end) * 1e3,
+                   (end - convert_end) * 1e3, relative);
+    }
+    convert_unlock(queue);
+}
+
+static void *convert_worker(void *arg)
+{
+    ConvertWorker *worker = arg;
+    ConvertQueue *queue = worker->queue;
+
+    for(;;)
+    {
+        size_t index = 0;
+        convert_lock(queue);
+        index = queue->next++;
+        convert_unlock(queue);
+        if(index >= queue->count)
+            break;
+        convert_one(worker, queue->paths[index]);
+    }
+    return NULL;
+}
+
+static unsigned convert_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned)count : 1;
+}
+
+static void convert_usage(void)
+{
+    printf("Usage: TGAConvert [--rle | --raw | --auto] [--depth 16|24|32]\n"
+           "                  [--origin top|bottom] [--threads N] [--quiet] "
+           "INPUT OUTPUT\n");
+}
+
+int main(int argc, char **argv)
+{
+    ConvertOptions options = { CONVERT_KEEP, 0, -1, 0, NULL, NULL };
+    ConvertQueue queue;
+    ConvertWorker workers[CONVERT_MAX_THREADS];
+    unsigned threads = 0, i;
+    size_t capacity = 0, f;
+    double start = 0, seconds = 0;
+    int arg;
+
+    memset(&queue, 0, sizeof(queue));
+    for(arg = 1; arg < argc; arg++)
+    {
+        if(strcmp(argv[arg], "--rle") == 0)
+            options.compression = CONVERT_RLE;
+        else if(strcmp(argv[arg], "--raw") == 0)
+            options.compression = CONVERT_RAW;
+        else if(strcmp(argv[arg], "--auto") == 0)
+            options.compression = CONVERT_AUTO;
+        else if(strcmp(argv[arg], "--depth") == 0 && arg + 1 < argc)
+            options.depth = (uint8_t)atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--origin") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(strcmp(argv[arg], "top") == 0)
+                options.origin = 1;
+            else if(strcmp(argv[arg], "bottom") == 0)
+                options.origin = 0;
+            else
+                options.origin = -2;
+        }
+        else if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+            threads = (unsigned)strtoul(argv[++arg], NULL, 10);
+        else if(strcmp(argv[arg], "--quiet") == 0)
+            options.quiet = 1;
+        else if(argv[arg][0] != '-' && !options.input)
+            options.input = argv[arg];
+        else if(argv[arg][0] != '-' && !options.output)
+            options.output = argv[arg];
+        else
+        {
+            convert_usage();
+            return strcmp(argv[arg], "--help") == 0 ? 0 : 1;
+        }
+    }
+    if(!options.input || !options.output || options.origin < -1 ||
+       (options.depth && options.depth != 16 && options.depth != 24 &&
+        options.depth != 32))
+    {
+        convert_usage();
+        return 1;
+    }
+
+    if(threads == 0)
+        threads = convert_cpu_count();
+#ifndef TGA_CONVERT_THREADS
+    threads = 1;
+#endif
+    if(threads > CONVERT_MAX_THREADS)
+        threads = CONVERT_MAX_THREADS;
+
+    convert_collect(options.input, "", &queue.paths, &queue.count, &capacity);
+    qsort(queue.paths, queue.count, sizeof(char *), convert_compare_paths);
+    queue.options = &options;
+    if(threads > queue.count)
+        threads = queue.count ? (unsigned)queue.count : 1;
+
+    start = convert_now();
+#ifdef TGA_CONVERT_THREADS
+    {
+        pthread_t handles[CONVERT_MAX_THREADS];
+        int started[CONVERT_MAX_THREADS];
+        pthread_mutex_init(&queue.lock, NULL);
+        for(i = 0; i < threads; i++)
+        {
+            workers[i].queue = &queue;
+            workers[i].buffer = NULL;
+            workers[i].capacity = 0;
+        }
+        for(i = 1; i < threads; i++)
+            started[i] = pthread_create(&handles[i], NULL, convert_worker,
+                                        &workers[i]) == 0;
+        convert_worker(&workers[0]);
+        for(i = 1; i < threads; i++)
+            if(started[i])
+                pthread_join(handles[i], NULL);
+        pthread_mutex_destroy(&queue.lock);
+    }
+#else
+    workers[0].queue = &queue;
+    workers[0].buffer = NULL;
+    workers[0].capacity = 0;
+    convert_worker(&workers[0]);
+#endif
+    seconds = convert_now() - start;
+
+    printf("%zu files converted, %zu failed, %u threads, %.2f s\n",
+           queue.count - queue.failed, queue.failed, threads, seconds);
+    printf("%.2f MB in, %.2f MB out, %.2f MB/s\n",
+           (double)queue.bytes_in / 1e6, (double)queue.bytes_out / 1e6,
+           seconds > 0 ? (double)queue.bytes_in / 1e6 / seconds : 0);
+
+    for(i = 0; i < threads; i++)
+        free(workers[i].buffer);
+    for(f = 0; f < queue.count; f++)
+        free(queue.paths[f]);
+    free(queue.paths);
+    return queue.failed ? 1 : 0;
+}